@@ -0,0 +1,411 @@
+/* Traffic replay
+ * Description:
+ *  Drives a running aesdsocket with a trace recorded by its -c option:
+ *  opens one connection per captured connection, sends every packet
+ *  at its captured time divided by the speed (or as fast as the server
+ *  takes them with -x 0) and closes connections where they were closed.
+ *  Echoes are read back and timed from the last byte of a packet to
+ *  the end of its echo, found by matching the packet at the end of the
+ *  echoed data. A packet that repeats an earlier one exactly can match
+ *  early, and nothing is timed on a connection once it sends a command.
+ *  One line per run:
+ *    replay packets=N conns=N secs=N pps=N tx_mbps=N rx_mbps=N
+ *      timed=N p50_us=N p90_us=N p99_us=N max_us=N unmatched=N
+ *  Usage: ./replay [-a host|unix:path] [-p port] [-x speed] trace
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+//trace layout, as written by the server's capture.c
+#define CAPTURE_MAGIC "AZTR"
+#define CAPTURE_VERSION 1
+
+struct capture_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t start;
+};
+
+struct capture_record {
+	uint64_t t;
+	uint32_t conn;
+	uint32_t len; //0 when the connection closed
+};
+
+#define UNIX_PREFIX "unix:"
+#define RECV_SIZE 65536
+#define IDLE_MS 5000 //give up on echoes after this long without any data
+#define CMD_PREFIX "AESD" //server commands, answered differently from echoes
+
+//one packet of the trace
+struct rec {
+	uint64_t t; //ns from the start of the capture
+	uint32_t conn;
+	uint32_t len;
+	const char* data;
+};
+
+//a packet sent and waiting for the end of its echo
+struct pending {
+	uint64_t sent; //ns, when its last byte went out
+	const struct rec* r;
+};
+
+struct conn {
+	int fd; //-1 until the first packet, and again once closed
+	int closing; //1 once the trace closed it, shut down after the last send
+	int shut; //1 once shut down for writing
+	int untimed; //1 after a command, replies aren't plain echoes from there on
+	const struct rec** out; //packets to send, from out_head on
+	size_t out_head, out_n, out_cap;
+	size_t out_off; //bytes of out[out_head] already sent
+	struct pending* pend; //from pend_head on
+	size_t pend_head, pend_n, pend_cap;
+	char* win; //last received bytes, then room for a recv
+	size_t win_len;
+};
+
+static const char* host = "localhost";
+static const char* port = "9000";
+static struct conn* conns; //by connection number
+static uint32_t nconns;
+static uint32_t opened;
+static size_t max_len; //longest packet, the received history kept per connection
+static uint64_t* lat; //ns per timed packet
+static size_t nlat, lat_cap;
+static unsigned long unmatched;
+static uint64_t tx_bytes, rx_bytes;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//grows an array to hold n + 1 elements of size sz
+static int grow(void* arrp, size_t* cap, size_t n, size_t sz) {
+	if(n < *cap) return 0;
+	size_t c = *cap ? *cap * 2 : 64;
+	void* tmp = realloc(*(void**)arrp, c * sz);
+	if(!tmp) return -1;
+	*(void**)arrp = tmp;
+	*cap = c;
+	return 0;
+}
+
+/* LOAD_TRACE
+ * Description: maps a trace and indexes its records
+ * Input:
+ *  path = trace file
+ *  recs, nrecs = filled in, records point into the mapping
+ * Output: 0 on success, -1 on error
+ */
+static int load_trace(const char* path, struct rec** recs, size_t* nrecs) {
+	int fd = open(path, O_RDONLY);
+	struct stat sb;
+	if(fd == -1 || fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(struct capture_header)) {
+		fprintf(stderr, "Cannot read %s\n", path);
+		return -1;
+	}
+	const char* map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return -1;
+	
+	struct capture_header h;
+	memcpy(&h, map, sizeof h);
+	if(memcmp(h.magic, CAPTURE_MAGIC, sizeof h.magic) != 0 || h.version != CAPTURE_VERSION) {
+		fprintf(stderr, "%s is not a capture\n", path);
+		return -1;
+	}
+	
+	size_t cap = 0, off = sizeof h;
+	*recs = NULL;
+	*nrecs = 0;
+	while(off + sizeof(struct capture_record) <= (size_t)sb.st_size) {
+		struct capture_record cr;
+		memcpy(&cr, map + off, sizeof cr);
+		off += sizeof cr;
+		if(cr.len > (size_t)sb.st_size - off) break; //cut short, keep what is whole
+		if(grow(recs, &cap, *nrecs, sizeof **recs) != 0) return -1;
+		struct rec* r = &(*recs)[(*nrecs)++];
+		r->t = cr.t;
+		r->conn = cr.conn;
+		r->len = cr.len;
+		r->data = map + off;
+		off += cr.len;
+		if(cr.len > max_len) max_len = cr.len;
+		if(cr.conn >= nconns) nconns = cr.conn + 1;
+	}
+	return 0;
+}
+
+//connects to the server, returns a non-blocking socket or -1
+static int connect_server(void) {
+	int fd = -1;
+	if(strncmp(host, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+		struct sockaddr_un sa;
+		memset(&sa, 0, sizeof sa);
+		sa.sun_family = AF_UNIX;
+		strncpy(sa.sun_path, host + strlen(UNIX_PREFIX), sizeof sa.sun_path - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd != -1 && connect(fd, (struct sockaddr*)&sa, sizeof sa) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	else {
+		struct addrinfo hints, *res, *p;
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if(getaddrinfo(host, port, &hints, &res) != 0) return -1;
+		for(p = res; p; p = p->ai_next) {
+			fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+			if(fd == -1) continue;
+			if(connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+	}
+	if(fd != -1) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+/* ISSUE
+ * Description: hands a trace record to its connection, opening it
+ *   on its first packet
+ * Output: 0 on success, -1 on error
+ */
+static int issue(const struct rec* r) {
+	struct conn* c = &conns[r->conn];
+	if(r->len == 0) {
+		c->closing = 1;
+		return 0;
+	}
+	if(c->fd == -1) {
+		if(c->closing) return 0; //packets after the close can't happen, skip them
+		c->fd = connect_server();
+		c->win = malloc(max_len + RECV_SIZE);
+		if(c->fd == -1 || !c->win) {
+			fprintf(stderr, "Cannot connect to %s\n", host);
+			return -1;
+		}
+		opened++;
+	}
+	if(grow(&c->out, &c->out_cap, c->out_n, sizeof *c->out) != 0) return -1;
+	c->out[c->out_n++] = r;
+	return 0;
+}
+
+//closes a connection, anything still waiting for an echo is unmatched
+static void finish(struct conn* c) {
+	unmatched += c->pend_n - c->pend_head;
+	c->pend_head = c->pend_n;
+	close(c->fd);
+	c->fd = -1;
+	c->closing = 1;
+}
+
+/* SEND_SOME
+ * Description: sends what the connection has queued until the socket
+ *   is full, noting each packet sent to wait for its echo
+ * Output: 0 on success, -1 on error
+ */
+static int send_some(struct conn* c) {
+	while(c->out_head < c->out_n) {
+		const struct rec* r = c->out[c->out_head];
+		ssize_t n = send(c->fd, r->data + c->out_off, r->len - c->out_off, MSG_NOSIGNAL);
+		if(n == -1) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		tx_bytes += n;
+		c->out_off += n;
+		if(c->out_off < r->len) continue;
+		c->out_off = 0;
+		c->out_head++;
+	
+		if(r->len >= strlen(CMD_PREFIX) && memcmp(r->data, CMD_PREFIX, strlen(CMD_PREFIX)) == 0) {
+			c->untimed = 1;
+			unmatched += c->pend_n - c->pend_head;
+			c->pend_head = c->pend_n;
+		}
+		if(c->untimed || r->data[r->len - 1] != '\n') continue;
+		if(grow(&c->pend, &c->pend_cap, c->pend_n, sizeof *c->pend) != 0) return -1;
+		c->pend[c->pend_n].sent = now_ns();
+		c->pend[c->pend_n++].r = r;
+	}
+	//the trace closed it here: half close, the server finishes echoing
+	if(c->closing && !c->shut) {
+		shutdown(c->fd, SHUT_WR);
+		c->shut = 1;
+	}
+	return 0;
+}
+
+/* RECV_SOME
+ * Description: reads echoes and times every packet whose echo ended
+ * Output: 0 on success, -1 on error
+ */
+static int recv_some(struct conn* c) {
+	ssize_t n = recv(c->fd, c->win + c->win_len, RECV_SIZE, 0);
+	if(n == -1) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+	if(n == 0) {
+		finish(c);
+		return 0;
+	}
+	rx_bytes += n;
+	uint64_t now = now_ns();
+	
+	//an echo ends with the packet it answers, and packets end in a newline
+	char* p = c->win + c->win_len;
+	char* end = p + n;
+	while(c->pend_head < c->pend_n && (p = memchr(p, '\n', end - p))) {
+		p++;
+		const struct rec* r = c->pend[c->pend_head].r;
+		if((size_t)(p - c->win) >= r->len && memcmp(p - r->len, r->data, r->len) == 0) {
+			if(grow(&lat, &lat_cap, nlat, sizeof *lat) != 0) return -1;
+			lat[nlat++] = now - c->pend[c->pend_head++].sent;
+		}
+	}
+	
+	//keep enough history for a packet straddling the next recv
+	c->win_len += n;
+	if(c->win_len > max_len) {
+		memmove(c->win, c->win + c->win_len - max_len, max_len);
+		c->win_len = max_len;
+	}
+	return 0;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct_us(double q) {
+	if(!nlat) return 0;
+	size_t i = q * (nlat - 1);
+	return lat[i] / 1e3;
+}
+
+int main(int argc, char* argv[]) {
+	double speed = 1;
+	int opt;
+	while((opt = getopt(argc, argv, "a:p:x:")) != -1) {
+		switch(opt) {
+		case 'a':
+			host = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'x':
+			speed = atof(optarg);
+			if(speed >= 0) break;
+			//fall through
+		default:
+			fprintf(stderr, "Usage: %s [-a host|unix:path] [-p port] [-x speed, 0 for flat out] trace\n", argv[0]);
+			return 1;
+		}
+	}
+	if(optind >= argc) {
+		fprintf(stderr, "Usage: %s [-a host|unix:path] [-p port] [-x speed, 0 for flat out] trace\n", argv[0]);
+		return 1;
+	}
+	
+	struct rec* recs;
+	size_t nrecs;
+	if(load_trace(argv[optind], &recs, &nrecs) != 0) return 1;
+	conns = calloc(nconns ? nconns : 1, sizeof *conns);
+	struct pollfd* pfds = calloc(nconns ? nconns : 1, sizeof *pfds);
+	uint32_t* ids = calloc(nconns ? nconns : 1, sizeof *ids);
+	if(!conns || !pfds || !ids) return 1;
+	for(uint32_t i = 0; i < nconns; i++) conns[i].fd = -1;
+	
+	unsigned long packets = 0;
+	size_t next = 0;
+	uint64_t start = now_ns(), last_io = start;
+	while(1) {
+		//hand out every record that is due
+		uint64_t now = now_ns();
+		while(next < nrecs && (speed == 0 || recs[next].t / speed <= now - start)) {
+			if(issue(&recs[next]) != 0) return 1;
+			if(recs[next].len) packets++;
+			next++;
+		}
+	
+		//wait on every open connection
+		nfds_t n = 0;
+		for(uint32_t i = 0; i < nconns; i++) {
+			struct conn* c = &conns[i];
+			if(c->fd == -1) continue;
+			pfds[n].fd = c->fd;
+			pfds[n].events = POLLIN | (c->out_head < c->out_n ? POLLOUT : 0);
+			ids[n++] = i;
+		}
+		if(next == nrecs && n == 0) break;
+	
+		int timeout = IDLE_MS;
+		if(next < nrecs) {
+			uint64_t due = start + (uint64_t)(recs[next].t / speed);
+			timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+		}
+		int rc = poll(pfds, n, timeout);
+		if(rc == -1 && errno != EINTR) {
+			perror("poll");
+			return 1;
+		}
+		if(rc == 0 && next == nrecs && now_ns() - last_io >= IDLE_MS * 1000000ULL) {
+			//the server stopped answering: count what is left as unmatched
+			for(uint32_t i = 0; i < nconns; i++)
+				if(conns[i].fd != -1) finish(&conns[i]);
+			break;
+		}
+		for(nfds_t i = 0; rc > 0 && i < n; i++) {
+			struct conn* c = &conns[ids[i]];
+			if(pfds[i].revents) last_io = now_ns();
+			if((pfds[i].revents & POLLOUT) && send_some(c) != 0) {
+				perror("send");
+				finish(c);
+				continue;
+			}
+			if((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && recv_some(c) != 0) {
+				perror("recv");
+				finish(c);
+			}
+		}
+	
+		for(nfds_t i = 0; i < n; i++) {
+			struct conn* c = &conns[ids[i]];
+			if(c->fd == -1 || c->out_head < c->out_n) continue;
+			//connections the trace closed with nothing left to send
+			if(c->closing && !c->shut) send_some(c);
+			//and at the end of the trace, every one with all its echoes in
+			if(next == nrecs && c->pend_head == c->pend_n) finish(c);
+		}
+	}
+	
+	double secs = (now_ns() - start) / 1e9;
+	qsort(lat, nlat, sizeof *lat, cmp_u64);
+	printf("replay packets=%lu conns=%u secs=%.3f pps=%.0f tx_mbps=%.2f rx_mbps=%.2f "
+	  "timed=%zu p50_us=%.0f p90_us=%.0f p99_us=%.0f max_us=%.0f unmatched=%lu\n",
+	  packets, opened, secs, packets / secs, tx_bytes / secs / 1e6, rx_bytes / secs / 1e6,
+	  nlat, pct_us(0.5), pct_us(0.9), pct_us(0.99), pct_us(1), unmatched);
+	return 0;
+}
@@ -1,16 +1,47 @@
 #!/bin/sh
 
+CONFIG=/etc/aesdsocket.conf
+ARGS="-d"
+[ -f "$CONFIG" ] && ARGS="$ARGS -f $CONFIG"
+
+# waits for the daemons in $1 to exit, however long their drain (-w) takes
+wait_exit() {
+    for pid in $1; do
+        while kill -0 "$pid" 2>/dev/null; do
+            usleep 100000
+        done
+    done
+}
+
 case "$1" in
     start)
         echo "Starting aesdsocket."
-        start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- -d
+        start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- $ARGS
         ;;
     stop)
         echo "Stopping aesdsocket."
         start-stop-daemon -K -n aesdsocket
         ;;
+    restart)
+        echo "Restarting aesdsocket."
+        pids=$(pidof aesdsocket)
+        start-stop-daemon -K -n aesdsocket
+        wait_exit "$pids"
+        start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- $ARGS
+        ;;
+    upgrade)
+        # the new binary takes the listening socket and idle clients over
+        # from the running one (-T), which drains and exits; started
+        # directly since start-stop-daemon won't while the old one runs
+        echo "Upgrading aesdsocket."
+        /usr/bin/aesdsocket $ARGS -T
+        ;;
+    reload)
+        echo "Reloading aesdsocket."
+        start-stop-daemon -K -n aesdsocket -s HUP
+        ;;
     *)
-        echo "Usage: $0 {start|stop}"
+        echo "Usage: $0 {start|stop|restart|upgrade|reload}"
         exit 1
         ;;
 esac
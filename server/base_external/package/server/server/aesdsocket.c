@@ -16,6 +16,21 @@
  *    This program will utilize the aesd-char-driver's llseek and ioctl
  *    and therefore swaps out pread for read.  
  *
+ *  Hot restart:
+ *    With '-t' the program takes the listening socket over from an already
+ *    running aesdsocket (see handoff.c) instead of binding port 9000, and
+ *    the old one drains and exits. '-T' also takes over its idle clients.
+ *    The new one opens the store only once the old one has closed it.
+ *
+ *  Configuration:
+ *    Every option has a long name, and '-f file' reads them from a file
+ *    (see config.h), the command line winning over it. The backend is
+ *    picked with '-B chardev|file', the build only sets the default.
+ *    SIGHUP reads the file again for the log level ('-v'), the pipeline
+ *    batches ('-P'), the timestamp interval ('-I') and the shutdown
+ *    drain deadline ('-w'), and applies them only if the whole file is
+ *    valid. One taken out of the file goes back to its default.
+ *
  * Exit:
  *  This application will exit upon reciept of a signal or failure to connect.  
  *  It will specifically handle SIGINT and SIGTERM gracefully.
@@ -26,6 +41,15 @@
 
 #include "aesdsocket.h"
 
+//function: wake workers
+// signals the shutdown eventfd so every worker waiting in poll sees it
+// async-signal-safe, and harmless to call more than once
+static void wake_workers( void ) {
+	uint64_t one = 1;
+	if(shutdown_efd != -1)
+		write(shutdown_efd, &one, sizeof one);
+}
+
 //function: signal handler
 // to handle the SIGINT and SIGTERM signals
 // force exit from main while loop
@@ -33,7 +57,20 @@
 static void signal_handler( int sn ) {
 	if(sn == SIGTERM || sn == SIGINT) {
 		caught_sig = 1;
-		shutdown(sfd, SHUT_RDWR);
+		for(int i = 0; i < nlfds; i++) shutdown(lfds[i], SHUT_RDWR);
+		wake_workers();
+	}
+}
+
+static void stats_handler( int sn ) {
+	if(sn == SIGUSR1) {
+		caught_stats = 1;
+	}
+}
+
+static void reload_handler( int sn ) {
+	if(sn == SIGHUP) {
+		caught_reload = 1;
 	}
 }
 
@@ -109,30 +146,47 @@ int do_ioctl(int fd, char* data, ssize_t len) {
  * Description: writes packet to end of file
  *   or performs ioctl command
  *   specifically handles errors and locking
+ *   With the file backend this returns once the packet is durable
+ *   under the store's sync policy, so the echo acknowledges it.
  * Input:
- *  fd = file descriptor
+ *  tdp = connection the packet came from
  *  data = address of data to write
  *  len = length of the data to write
- *  m = mutext to control file access
  * Output: -1 if error, 0 if success
  */
-int file_write(int fd, char* data, ssize_t len, pthread_mutex_t* m) {
+int file_write(struct thread_data* tdp, char* data, ssize_t len) {
 	int result;
+	int fd = tdp->fd;
+	pthread_mutex_t* m = tdp->m;
 	
-	if(USE_AESD_CHAR_DEVICE) { //check ioctl
-		int rc = do_ioctl(fd, data, len);
-		if(rc == 0) return 0;
+	if(!use_char_device) {
+		if(repl_following(&repl)) return -1; //only the leader's records
+		off_t end = store_write(tdp->st, data, len);
+		if(end == -1) return -1;
+		store_wait_durable(tdp->st, end);
+		//only the default stream is replicated
+		if(tdp->stream == stream_default(&streams)) repl_wait(&repl, end);
+		return 0;
 	}
 	
+	//check ioctl
+	int irc = do_ioctl(fd, data, len);
+	if(irc == 0) return 0;
+	
 	//try to lock
+	TRACE_BEGIN(TR_LOCK, tdp->id, 0);
 	result = pthread_mutex_lock(m);
+	TRACE_END(TR_LOCK, tdp->id, 0);
 	if(result != 0) { //failure
 		syslog(LOG_ERR, "ERROR mutex lock:%d\n", result);
 		return -1;
 	}
 	
 	//write data to file
+	TRACE_BEGIN(TR_WRITE, tdp->id, 0);
 	ssize_t rc = write(fd, data, len);
+	TRACE_END(TR_WRITE, tdp->id, rc > 0 ? rc : 0);
+	if(rc == len) fanout_publish(&fanout, data, len); //in order, under the mutex
 	
 	//unlock
 	result = pthread_mutex_unlock(m);
@@ -153,306 +207,1966 @@ int file_write(int fd, char* data, ssize_t len, pthread_mutex_t* m) {
 	return result;
 }
 
-/*SEND_LINE
- * Description: sends a portion of the file at a time (defined by MAX_BUF_SIZE)
- * Input: 
- *  socket = the socket to echo the file to
- *  fd = file descriptor
- * Output:
- *  -1 if error, 0 if successful
+//passes what the store appended on to the subscribers
+static void publish_appended(void* arg, const char* data, size_t len, off_t end) {
+	fanout_publish(arg, data, len);
+}
+
+/* SEND_ALL
+ * Description: sends a whole buffer, looping over partial sends
+ * Input:
+ *  socket = socket to send on
+ *  data, len = bytes to send
+ * Output: 0 on success, -1 on error
  */
-int send_line(int socket, int fd) {
-	char read_buf[MAX_BUF_SIZE];
-	off_t cur_off = 0;
-	
-	int result;
-	char last_byte = 0;
-	
-	while(1) {
-		//read from socket the max allowed at a time
-		ssize_t num_read = 0;
-		if(USE_AESD_CHAR_DEVICE)
-			num_read = read(fd, read_buf, MAX_BUF_SIZE);
-		else
-			num_read = pread(fd, read_buf, MAX_BUF_SIZE, cur_off);
-		if(num_read == -1) {
-			syslog(LOG_ERR, "Buffered file read:%m\n");
-			result = -1;
-			break;
-		}
-		if(num_read == 0) { //end of file reached
-			result = 0;
-			if(last_byte != '\n') {
-				int rc = send(socket, "\n", 1, 0);
-				if(rc == -1) syslog(LOG_ERR, "failed to send:%m\n");
-			}
-			break;
-		}
-		
-		//send *some* data via socket
-		ssize_t rc = send(socket, read_buf, num_read, 0);
+static int send_all(int socket, const char* data, size_t len) {
+	while(len > 0) {
+		ssize_t rc = send(socket, data, len, MSG_NOSIGNAL);
 		if(rc == -1) {
+			if(errno == EINTR) continue;
 			syslog(LOG_ERR, "Failed to send:%m\n");
-			result = -1;
-			break;
+			return -1;
 		}
-		last_byte = read_buf[num_read-1];
-		
-		//increase offset to read
-		cur_off += num_read;
-	
-	}//end while
-	
-	return result;
+		data += rc;
+		len -= rc;
+	}
+	return 0;
 }
 
-/*READ_PACKET 
- * Description: buffered reads the packet of data
- *  assumes the end of a packet is from null terminator
- *  writes the data out to specified file
- * Inputs: 
- *  socket = socket file descriptor to read data from
- *  fd = file descriptor of specified file
- *  m = mutex to control file access
+/* ECHO_READ
+ * Description: reads the next piece of what gets echoed
+ *   from the char device or the store
+ * Input:
+ *  tdp = connection being echoed to
+ *  buf, len = destination
+ *  off = store offset (the char device tracks its own position)
+ * Output: bytes read, 0 at the end, -1 on error
+ */
+static ssize_t echo_read(struct thread_data* tdp, char* buf, size_t len, off_t off) {
+	if(use_char_device)
+		return read(tdp->fd, buf, len);
+	return store_read(tdp->st, buf, len, off);
+}
+
+//raw block being compressed, only the reply scheduler uses it
+static char reply_raw[REPLY_BLOCK_SIZE];
+
+/* FILL_COMPRESSED
+ * Description: puts the next LZ4 frame of the echo (see COMPRESS_CMD)
+ *   in the connection's tx buffer
+ * Input:
+ *  tdp = connection being echoed to
  * Output:
- *  result = -1 upon failure, 0 if connection closed, 1 if successful
+ *  1 if there is a frame to send, 0 once the echo is complete, -1 if error
  */
-int read_packet(int socket, int fd, pthread_mutex_t* m) {
-	int result;
-	char read_buf[MAX_BUF_SIZE];
-	
-	char* buffer = malloc(1);
-	if(!buffer) {
-		syslog(LOG_ERR, "Failed to malloc: %m\n");
-		result = -1;
-	}
-	*buffer = '\0'; //initialize to null pointer terminated string
-	ssize_t bufs = 0;
+static int fill_compressed(struct thread_data* tdp) {
+	char* frame = tdp->tx;
+	off_t until = tdp->cur->end;
+	uint32_t hdr[2];
 	
-	while(1) {
-		memset(read_buf, 0, MAX_BUF_SIZE); //default to 0s
-		//read from socket the max allowed at a time
-		ssize_t num_read = recv(socket, read_buf, MAX_BUF_SIZE-1, 0);
-		if(num_read == -1) {
-			syslog(LOG_ERR, "Failed to recv: %m\n");
-			result = -1;
-			break;
-		}
-		else  if(num_read == 0) { //connection closed
-			result = 0;
-			break;
-		}
-		else {
-			//reallocate buffer with string lengths of char arrays + \0
-			size_t new_len = strlen(read_buf) + strlen(buffer) + 1;
-			char* tmp = realloc(buffer, new_len);
-			if(!tmp) {
-				syslog(LOG_ERR, "Failed to realloc write buffer: %m\n");
-				result = -1;
-				break;
+	if(tdp->r_state == REPLY_BODY) {
+		//fill a whole block, the store returns short reads at segment ends
+		size_t have = 0;
+		while(have < REPLY_BLOCK_SIZE) {
+			size_t want = REPLY_BLOCK_SIZE - have;
+			if(until != -1 && (off_t)want > until - tdp->r_off) want = until - tdp->r_off;
+			if(want == 0) break;
+			ssize_t n = echo_read(tdp, reply_raw + have, want, tdp->r_off);
+			if(n == -1) {
+				syslog(LOG_ERR, "Buffered file read:%m\n");
+				return -1;
 			}
-			//mem handling
-			buffer = tmp;
-			
-			//increase total size of packet
-			bufs += num_read;
-			
-			//concatenate contents into buffer
-			strcat(buffer, read_buf);
-			
-			//break out if read the end of packet
-			int eop = num_read -1;
-			if(read_buf[eop] == '\n') {
-				result = 1;
-				break;
+			if(n == 0) break;
+			have += n;
+			tdp->r_off += n;
+		}
+		if(have < REPLY_BLOCK_SIZE || tdp->r_off == until) tdp->r_state = REPLY_TAIL;
+		if(have > 0) {
+			tdp->r_last = reply_raw[have - 1];
+			int clen = lz4_compress(reply_raw, have, frame + 8, REPLY_FRAME_MAX - 8);
+			if(clen < 0 || (size_t)clen >= have) { //not worth it, send as is
+				memcpy(frame + 8, reply_raw, have);
+				clen = have;
 			}
-		} //end if-else
-	
-	}//end while
+			hdr[0] = htonl(have);
+			hdr[1] = htonl(clen);
+			memcpy(frame, hdr, sizeof hdr);
+			tdp->r_pos = 0;
+			tdp->r_len = 8 + clen;
+			return 1;
+		}
+	}
 	
-	//only write packet upon successful read
-	if(result == 1 || result == 0) {
-		//write buffer to file
-		int num_w = file_write(fd, buffer, bufs, m);
-		if(num_w != 0) {
-			syslog(LOG_ERR, "Failed to write to the file\n");
-			result = -1;
+	if(tdp->r_state == REPLY_TAIL) {
+		//same trailing newline rule as the plain echo, then the end frame
+		size_t len = 0;
+		if(tdp->r_last != '\n') {
+			hdr[0] = hdr[1] = htonl(1);
+			memcpy(frame, hdr, sizeof hdr);
+			frame[8] = '\n';
+			len = 9;
 		}
+		hdr[0] = hdr[1] = 0;
+		memcpy(frame + len, hdr, sizeof hdr);
+		tdp->r_pos = 0;
+		tdp->r_len = len + sizeof hdr;
+		tdp->r_state = REPLY_DONE;
+		return 1;
 	}
-	free(buffer);
-	return result;
+	return 0;
 }
 
-/* ACCEPT_SOCKET
- * Description: tries to accept connections from client
- * Input: sfd = original socket file descriptor
- * Output: new_sfd = new socket file descriptor for receiving, -1 on error
+//packets of one connection in flight at once. The driver keeps one file
+//position for writes, seeks and the echo's reads, so there it is one.
+static int conn_depth(void) {
+	return use_char_device ? 1 : atomic_load_explicit(&pipe_depth, memory_order_relaxed);
+}
+
+/* WAIT_INFLIGHT
+ * Description: waits until at most max packets of the connection are in flight
+ * Input:
+ *  tdp = connection
+ *  max = packets still allowed in flight
+ * Output: none
  */
-int accept_socket(int sfd, char* host) {
-	//accept connection
-	struct sockaddr_storage client_addr;
-	socklen_t client_addr_size = sizeof client_addr;
-	int new_sfd = accept(sfd, (struct sockaddr*)&client_addr, &client_addr_size);
-	if(new_sfd == -1){
-		syslog(LOG_ERR, "socket accept fail: %m\n");
+static void wait_inflight(struct thread_data* tdp, int max) {
+	pthread_mutex_lock(&tdp->pl_lock);
+	while(tdp->inflight > max) pthread_cond_wait(&tdp->pl_cond, &tdp->pl_lock);
+	pthread_mutex_unlock(&tdp->pl_lock);
+}
+
+/* SUBMIT_PACKET
+ * Description: receive stage: hands a framed packet on to the storage
+ *   stage, first waiting for room if the connection has conn_depth()
+ *   packets in flight already
+ * Input:
+ *  tdp = connection the packet came from
+ *  data, len = packet, copied
+ *  echo = 1 to echo once stored
+ * Output: 0 on success, -1 on failure
+ */
+static int submit_packet(struct thread_data* tdp, const char* data, size_t len, int echo) {
+	pthread_mutex_lock(&tdp->pl_lock);
+	if(tdp->inflight >= conn_depth()) {
+		atomic_fetch_add(&recv_stats.full_waits, 1);
+		while(tdp->inflight >= conn_depth()) pthread_cond_wait(&tdp->pl_cond, &tdp->pl_lock);
+	}
+	pthread_mutex_unlock(&tdp->pl_lock);
+	
+	struct pkt* p = pkt_get(data, len);
+	if(!p) {
+		syslog(LOG_ERR, "Failed to allocate packet.\n");
 		return -1;
 	}
-	//pull client_ip from client_addr
-	int rc = getnameinfo((struct sockaddr*)&client_addr, client_addr_size, host, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
-	if(rc != 0) {
-		syslog(LOG_ERR, "Failed to get new hostname:%m\n");
+	p->conn = tdp;
+	p->echo = echo;
+	
+	pthread_mutex_lock(&tdp->pl_lock);
+	tdp->inflight++;
+	pthread_mutex_unlock(&tdp->pl_lock);
+	long d = atomic_fetch_add(&recv_stats.depth, 1) + 1;
+	long m = atomic_load(&recv_stats.max_depth);
+	while(d > m && !atomic_compare_exchange_weak(&recv_stats.max_depth, &m, d));
+	atomic_fetch_add(&recv_stats.items, 1);
+	
+	if(pkt_queue_push(&tdp->stream->q, p) != 0) { //only once main stopped the stage
+		pkt_put(p);
+		atomic_fetch_sub(&recv_stats.depth, 1);
+		pthread_mutex_lock(&tdp->pl_lock);
+		tdp->inflight--;
+		pthread_mutex_unlock(&tdp->pl_lock);
+		return -1;
 	}
-	syslog(LOG_DEBUG, "Accepted connection from %s\n", host);
-	return new_sfd;
+	return 0;
 }
 
-/* INIT_SOCKET
- * Description: setups a server socket
- * Input: N/A
- * Output: 
- *   sfd = socket file descriptor or -1 upon error
- */ 
-int init_socket() {
-	int sfd = socket(AF_INET, SOCK_STREAM, 0); //create an IPv4 stream(TCP) socket w/ auto protocol
-	if(sfd < 0) {
-		syslog(LOG_ERR, "failed to create socket:%m\n");
-		return -1; //return to main with failure to connect
+//sends a piece of the trace dump to the connection asking for it
+static int trace_out(void* arg, const char* data, size_t len) {
+	struct thread_data* tdp = arg;
+	return send_all(tdp->nsfd, data, len);
+}
+
+/* SEND_STORE
+ * Description: sends a header line and then store bytes [from, to) to
+ *   the connection through its tx buffer, which is free while none of
+ *   its packets are in flight. The header goes out with the first of
+ *   the bytes, a send of its own would wait on the client's delayed ACK.
+ * Input:
+ *  tdp = connection
+ *  head, hlen = header, shorter than the tx buffer
+ *  from, to = logical store offsets
+ * Output: 0 on success, -1 on error
+ */
+static int send_store(struct thread_data* tdp, const char* head, size_t hlen, off_t from, off_t to) {
+	size_t cap = tx_pool.size;
+	size_t have = hlen;
+	memcpy(tdp->tx, head, hlen);
+	do {
+		//fill the buffer, the store returns short reads at segment ends
+		while(from < to && have < cap) {
+			size_t want = cap - have;
+			if((off_t)want > to - from) want = to - from;
+			ssize_t n = store_read(tdp->st, tdp->tx + have, want, from);
+			if(n <= 0) {
+				syslog(LOG_ERR, "Failed to read records at %lld\n", (long long)from);
+				return -1;
+			}
+			have += n;
+			from += n;
+		}
+		if(send_all(tdp->nsfd, tdp->tx, have) != 0) return -1;
+		have = 0;
+	} while(from < to);
+	return 0;
+}
+
+/* QUERY_ARGS
+ * Description: parses the numbers after a query name, ":N" or ":N,M",
+ *   up to the end of the line
+ * Input:
+ *  args = what follows the name
+ *  v = filled with the numbers
+ *  max = room in v
+ * Output: how many numbers there were, -1 if malformed
+ */
+static int query_args(const char* args, long* v, int max) {
+	int n = 0;
+	if(*args == ':') {
+		do {
+			char* end = NULL;
+			errno = 0;
+			long x = strtol(args + 1, &end, 10);
+			if(end == args + 1 || errno != 0 || x < 0 || n == max) return -1;
+			v[n++] = x;
+			args = end;
+		} while(*args == ',');
+	}
+	while(*args == '\r' || *args == '\n') args++;
+	return *args ? -1 : n;
+}
+
+/* DO_SEARCH
+ * Description: answers "AESD_SEARCH:text" from the search index
+ * Inputs:
+ *   tdp = connection the packet came from
+ *   args = what follows the query name
+ * Outputs:
+ *   1 once answered, -1 upon failure
+ */
+static int do_search(struct thread_data* tdp, const char* args) {
+	//the client's earlier packets are stored before we answer
+	wait_inflight(tdp, 0);
+	
+	const char* text = args + 1;
+	size_t len = strcspn(text, "\r\n");
+	struct search_result r;
+	char line[64];
+	if(*args != ':' || len == 0 || !tdp->st || search_run(&tdp->stream->search, text, len, &r) != 0) {
+		syslog(LOG_ERR, "ERROR: can't answer %s.\n", QUERY_SEARCH);
+		snprintf(line, sizeof line, "%s:error\n", QUERY_SEARCH);
+		return send_all(tdp->nsfd, line, strlen(line)) == 0 ? 1 : -1;
 	}
-	int yes = 1; 
-	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes); //tip for possible bind failure
 	
-	//need to get address in addrinfo struct
-	struct addrinfo hint; //need to make a hint for getaddrinfo function
-	memset(&hint, 0, sizeof(hint)); //default to 0s
-	hint.ai_family = AF_INET;
-	hint.ai_socktype = SOCK_STREAM;
-	hint.ai_flags = AI_PASSIVE; //to make the address suitable for bind/accept
+	//the header goes in the room left before the records, to be sent with them
+	int hlen = snprintf(line, sizeof line, "%s:%ld,%zu\n", QUERY_SEARCH, r.count, r.len);
+	char* head = r.data + SEARCH_HEADROOM - hlen;
+	memcpy(head, line, hlen);
+	int rc = send_all(tdp->nsfd, head, hlen + r.len);
+	free(r.data);
+	return rc == 0 ? 1 : -1;
+}
+
+/* DO_QUERY
+ * Description: answers the record queries (see QUERY_RECORD) from the
+ *   store's record and time indexes, in plain text whatever the echo mode
+ * Inputs:
+ *   tdp = connection the packet came from
+ *   data = packet, NUL terminated
+ * Outputs:
+ *   1 if it was a query and was answered, 0 if it is not a query,
+ *   -1 upon failure
+ */
+static int do_query(struct thread_data* tdp, const char* data) {
+	size_t nlen = strcspn(data, ":\r\n");
+	if(nlen > QUERY_MAX_L) return 0;
+	char name[QUERY_MAX_L + 1];
+	memcpy(name, data, nlen);
+	name[nlen] = '\0';
+	if(strcmp(name, QUERY_SEARCH) == 0) return do_search(tdp, data + nlen);
 	
-	struct addrinfo* addr_sp;
-	int rc = getaddrinfo(NULL, S_PORT, &hint, &addr_sp);
-	if(rc != 0) {
-		close(sfd);
-		syslog(LOG_ERR, "getaddr fail:%s\n", gai_strerror(rc));
-		return -1;
+	long v[2] = { 0, 0 };
+	int n = query_args(data + nlen, v, 2);
+	long a = 0, b = LONG_MAX;
+	int want = 0; //numbers the query takes
+	if(strcmp(name, QUERY_RECORD) == 0) {
+		want = 1;
+		a = v[0];
+		b = a + 1;
 	}
+	else if(strcmp(name, QUERY_RANGE) == 0) {
+		want = 2;
+		a = v[0];
+		b = v[1];
+	}
+	else if(strcmp(name, QUERY_TAIL) == 0) {
+		want = 1;
+		a = v[0] ? -v[0] : LONG_MAX;
+	}
+	else if(strcmp(name, QUERY_TIME) == 0)
+		want = n == 1 ? 1 : 2; //to now by default
+	else if(strcmp(name, QUERY_COUNT) != 0 && strcmp(name, QUERY_SIZE) != 0)
+		return 0;
 	
-	//try to bind the socket
-	for(struct addrinfo* rp = addr_sp; rp != NULL; rp = rp->ai_next) { //result from getaddrinfo is linked list
-		rc = bind(sfd, rp->ai_addr, rp->ai_addrlen);
-		if(rc == 0) { //success
-			break;
-		}
+	//the client's earlier packets are stored before we answer
+	wait_inflight(tdp, 0);
+	
+	char line[128];
+	struct rec_span s;
+	int ok = n == want && tdp->st;
+	if(ok && strcmp(name, QUERY_TIME) == 0) {
+		int64_t to = n == 2 && v[1] < INT64_MAX / 1000 ? v[1] * 1000LL : INT64_MAX;
+		ok = v[0] < INT64_MAX / 1000 && store_records_between(tdp->st, v[0] * 1000LL, to, &s) == 0;
 	}
-	freeaddrinfo(addr_sp); //FREE!
-	if(rc != 0) {
-		close(sfd);
-		syslog(LOG_ERR, "Failed to bind.%m\n"); //errno is set on bind
-		return -1;
+	else if(ok) ok = store_records(tdp->st, a, b, &s) == 0;
+	if(ok && strcmp(name, QUERY_RECORD) == 0 && s.count == 0) ok = 0; //no such record
+	if(!ok) {
+		syslog(LOG_ERR, "ERROR: can't answer %s.\n", name);
+		snprintf(line, sizeof line, "%s:error\n", name);
+		return send_all(tdp->nsfd, line, strlen(line)) == 0 ? 1 : -1;
 	}
 	
-	//listen to socket
-	int result = listen(sfd, BACKLOG); 
-	if(result == -1) {
-		syslog(LOG_ERR, "Failed to listen.%m\n");
-		close(sfd);	
+	if(strcmp(name, QUERY_COUNT) == 0)
+		snprintf(line, sizeof line, "%s:%ld\n", name, s.count);
+	else if(strcmp(name, QUERY_SIZE) == 0)
+		snprintf(line, sizeof line, "%s:%lld\n", name, (long long)(store_size(tdp->st) - store_start(tdp->st)));
+	else
+		snprintf(line, sizeof line, "%s:%ld,%ld,%lld\n", name, s.first, s.count, (long long)(s.to - s.from));
+	if(want == 0) return send_all(tdp->nsfd, line, strlen(line)) == 0 ? 1 : -1;
+	return send_store(tdp, line, strlen(line), s.from, s.to) == 0 ? 1 : -1;
+}
+
+/* DO_SUBSCRIBE
+ * Description: answers "AESD_SUBSCRIBE" by handing a copy of the socket
+ *   to the fan-out thread, which sends it the records stored from then on
+ * Inputs:
+ *   tdp = connection the packet came from
+ * Outputs:
+ *   2 once subscribed, the connection takes no more packets,
+ *   1 if refused and answered, -1 upon failure
+ */
+static int do_subscribe(struct thread_data* tdp) {
+	//the echoes still due go out before the records
+	wait_inflight(tdp, 0);
+	
+	char line[64];
+	//the ring only carries the default stream's records
+	if(tdp->stream != stream_default(&streams)) {
+		snprintf(line, sizeof line, "%s:error\n", SUBSCRIBE_CMD);
+		return send_all(tdp->nsfd, line, strlen(line)) == 0 ? 1 : -1;
+	}
+	uint64_t pos = fanout_head(&fanout);
+	int fd = dup(tdp->nsfd);
+	snprintf(line, sizeof line, "%s:%s\n", SUBSCRIBE_CMD, fd == -1 ? "error" : "ok");
+	if(send_all(tdp->nsfd, line, strlen(line)) != 0) {
+		if(fd != -1) close(fd);
 		return -1;
 	}
-	return sfd;
+	if(fd == -1) {
+		syslog(LOG_ERR, "ERROR: can't subscribe:%m\n");
+		return 1;
+	}
+	return fanout_subscribe(&fanout, fd, pos) == 0 ? 2 : -1;
 }
 
-void* threadfunc(void* thread_param)
-{
-	//setup threading info
-	if(!thread_param) {
-		syslog(LOG_ERR, "Null pointer exception in thread func.\n");
-		return NULL;
+/* DO_STREAM
+ * Description: answers "AESD_STREAM[:name]" by moving the connection's
+ *   packets from then on to that stream, opened if need be
+ * Inputs:
+ *   tdp = connection the packet came from
+ *   args = what follows the command name
+ * Outputs:
+ *   1 once answered, -1 upon failure
+ */
+static int do_stream(struct thread_data* tdp, const char* args) {
+	//the packets before it are stored (and echoed) where they were sent
+	wait_inflight(tdp, 0);
+	
+	const char* name = *args == ':' ? args + 1 : args;
+	size_t len = strcspn(name, "\r\n");
+	const char* end = name + len;
+	while(*end == '\r' || *end == '\n') end++;
+	char line[STREAM_CMD_L + STREAM_NAME_MAX + 16];
+	//only the default stream is replicated, a follower wouldn't have the others
+	if(len && repl_active(&repl)) {
+		syslog(LOG_WARNING, "WARNING: stream %.*s refused, only the default stream is replicated.\n",
+		  (int)(len < STREAM_NAME_MAX ? len : STREAM_NAME_MAX), name);
+		snprintf(line, sizeof line, "%s:error\n", STREAM_CMD);
+		return send_all(tdp->nsfd, line, strlen(line)) == 0 ? 1 : -1;
 	}
-	struct thread_data* tdp = (struct thread_data *) thread_param;
-	int success = 1;
-    
-	//continuously read on a socket
-	while(1) {
-		//read full packet
-		int rc = read_packet(tdp->nsfd, tdp->fd, tdp->m);
-		if(rc == -1) { //reading/echoing failed in some way
-			syslog(LOG_ERR, "Not reading correctly.\n");
-			success = -1;
-			break;
-		}
-		if(rc == 0) { //connection ended
-			break;
-		}
-		
-		syslog(LOG_DEBUG,"Read packet.\n");
-		//attempt to echo the file back
-		send_line(tdp->nsfd, tdp->fd);
-		syslog(LOG_DEBUG,"sent back file.\n");
-		
-	} //end of reading packets
-    
-	tdp->complete_flag = success;
-    
-	return thread_param;
+	struct stream* sp = *end ? NULL : stream_get(&streams, name, len);
+	if(!sp) {
+		syslog(LOG_ERR, "ERROR: can't open stream %.*s.\n", (int)(len < STREAM_NAME_MAX ? len : STREAM_NAME_MAX), name);
+		snprintf(line, sizeof line, "%s:error\n", STREAM_CMD);
+	}
+	else {
+		tdp->stream = sp;
+		if(!use_char_device) tdp->st = &sp->st;
+		snprintf(line, sizeof line, "%s:%s\n", STREAM_CMD, sp->name);
+	}
+	return send_all(tdp->nsfd, line, strlen(line)) == 0 ? 1 : -1;
 }
 
-int main(int argc, char* argv[]) {
-	int result = 0;
-	int fd;
+/* DO_COMMAND
+ * Description: handles the in-band server commands, which are
+ *   answered directly instead of being stored and echoed
+ * Inputs:
+ *   tdp = connection the packet came from
+ *   data = packet
+ *   len = size of the packet
+ * Outputs:
+ *   1 if it was a command and was handled, 0 if it is not a command,
+ *   2 if the connection subscribed, -1 upon failure
+ */
+static int do_command(struct thread_data* tdp, char* data, ssize_t len) {
+	int q = do_query(tdp, data);
+	if(q != 0) return q;
+	if(len >= TRACE_CMD_L && len <= TRACE_CMD_L + 2 && strncmp(data, TRACE_CMD, TRACE_CMD_L) == 0) {
+		wait_inflight(tdp, 0); //no echo in the middle of the JSON
+		return trace_dump(trace_out, tdp) == 0 ? 1 : -1;
+	}
+	if(len >= PROMOTE_CMD_L && len <= PROMOTE_CMD_L + 2 && strncmp(data, PROMOTE_CMD, PROMOTE_CMD_L) == 0) {
+		char line[64];
+		wait_inflight(tdp, 0); //not in the middle of an echo
+		off_t end = repl_promote(&repl);
+		if(end == -1) snprintf(line, sizeof line, "%s:error\n", PROMOTE_CMD);
+		else snprintf(line, sizeof line, "%s:%lld\n", PROMOTE_CMD, (long long)end);
+		return send_all(tdp->nsfd, line, strlen(line)) == 0 ? 1 : -1;
+	}
+	if(len >= STREAM_CMD_L && strncmp(data, STREAM_CMD, STREAM_CMD_L) == 0 && strchr(":\r\n", data[STREAM_CMD_L]))
+		return do_stream(tdp, data + STREAM_CMD_L);
+	if(len >= SUBSCRIBE_CMD_L && len <= SUBSCRIBE_CMD_L + 2 && strncmp(data, SUBSCRIBE_CMD, SUBSCRIBE_CMD_L) == 0)
+		return do_subscribe(tdp);
+	if(len < COMPRESS_CMD_L || strncmp(data, COMPRESS_CMD, COMPRESS_CMD_L) != 0)
+		return 0;
 	
-	//setup syslog
-	openlog("assignment_8", 0, LOG_USER);
+	//the echoes still due were asked for in the old mode
+	wait_inflight(tdp, 0);
 	
-	//open stream bound to port 9000, returns -1 upon failure to connect
-	sfd = init_socket();
-	if(sfd == -1){	
-		result = -1;
+	const char* mode = data + COMPRESS_CMD_L;
+	size_t mlen = len - COMPRESS_CMD_L;
+	while(mlen > 0 && (mode[mlen-1] == '\n' || mode[mlen-1] == '\r')) mlen--;
+	if(mlen == 3 && strncmp(mode, "lz4", 3) == 0) tdp->compress = 1;
+	else if(mlen == 4 && strncmp(mode, "none", 4) == 0) tdp->compress = 0;
+	else {
+		syslog(LOG_ERR, "ERROR: unknown compression mode.\n");
+		return send_all(tdp->nsfd, "AESD_COMPRESS:error\n", 20) == 0 ? 1 : -1;
 	}
 	
-	//make/open the file for appending and read/write
-	if(!USE_AESD_CHAR_DEVICE) {
-		fd = open(FILENAME, O_CREAT | O_RDWR | O_APPEND, 00666);
-		if(fd == -1) {
-			syslog(LOG_ERR, "ERROR opening file:%m\n");
-			result = -1;
+	//acknowledge in plain text, the echoes after it use the new mode
+	const char* ack = tdp->compress ? "AESD_COMPRESS:lz4\n" : "AESD_COMPRESS:none\n";
+	return send_all(tdp->nsfd, ack, strlen(ack)) == 0 ? 1 : -1;
+}
+
+/*FILL_LINE
+ * Description: puts the next portion of the file (up to io.tx_size)
+ *   in the connection's tx buffer
+ * Input: 
+ *  tdp = connection being echoed to, the echo stops at the end of
+ *    the packet being acknowledged (the char device echoes it all)
+ * Output:
+ *  1 if there is a portion to send, 0 once the echo is complete, -1 if error
+ */
+static int fill_line(struct thread_data* tdp) {
+	if(tdp->compress) return fill_compressed(tdp);
+	off_t until = tdp->cur->end;
+	
+	if(tdp->r_state == REPLY_BODY) {
+		//read from the file the max allowed at a time
+		size_t want = io.tx_size;
+		if(until != -1 && (off_t)want > until - tdp->r_off) want = until - tdp->r_off;
+		ssize_t num_read = want ? echo_read(tdp, tdp->tx, want, tdp->r_off) : 0;
+		if(num_read == -1) {
+			syslog(LOG_ERR, "Buffered file read:%m\n");
+			return -1;
 		}
+		if(num_read > 0) {
+			tdp->r_last = tdp->tx[num_read - 1];
+			tdp->r_off += num_read;
+			tdp->r_pos = 0;
+			tdp->r_len = num_read;
+			return 1;
+		}
+		tdp->r_state = REPLY_TAIL; //end of file reached
 	}
 	
-	//setup signal handling
-	struct sigaction new_act;
-	memset(&new_act, 0, sizeof(struct sigaction)); //default the sigaction struct
-	new_act.sa_handler = signal_handler; //setup the signal handling function
-	int rc = sigaction(SIGTERM, &new_act, NULL); //register for SIGTERM
-	if(rc != 0) {
-		syslog(LOG_ERR, "Error %d registering for SIGTERM\n", errno);
-		result = -1;
-	}
-	rc = sigaction(SIGINT, &new_act, NULL); //register for SIGINT
-	if(rc != 0) {
-		syslog(LOG_ERR, "Error %d registering for SIGINT\n", errno);
-		result = -1;
+	if(tdp->r_state == REPLY_TAIL) {
+		tdp->r_state = REPLY_DONE;
+		if(tdp->r_last != '\n') {
+			tdp->tx[0] = '\n';
+			tdp->r_pos = 0;
+			tdp->r_len = 1;
+			return 1;
+		}
 	}
+	return 0;
+}
+
+//reply scheduler state: connections that got echoes to send since it
+//last looked (under sched_lock), how to wake it and when to stop
+STAILQ_HEAD(td_list, thread_data);
+static struct td_list sched_incoming = STAILQ_HEAD_INITIALIZER(sched_incoming);
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static int reply_efd = -1;
+static atomic_int reply_stop;
+
+/* REPLY_ENQUEUE
+ * Description: passes a stored packet on to the reply scheduler,
+ *   handing it the connection unless it already has it
+ * Input:
+ *  p = stored packet
+ * Output: none
+ */
+static void reply_enqueue(struct pkt* p) {
+	struct thread_data* tdp = p->conn;
+	long d = atomic_fetch_add(&reply_stats.depth, 1) + 1;
+	long m = atomic_load(&reply_stats.max_depth);
+	while(d > m && !atomic_compare_exchange_weak(&reply_stats.max_depth, &m, d));
 	
-	if(!USE_AESD_CHAR_DEVICE) {
-		new_act.sa_handler = timer_handler; //setup the signal handling function
-		rc = sigaction(SIGALRM, &new_act, NULL); //register for SIGALRM
-		if(rc != 0) {
-			syslog(LOG_ERR, "Error %d registering for SIGALRM\n", errno);
-			result = -1;
-		}
+	int wake = 0;
+	pthread_mutex_lock(&tdp->pl_lock);
+	STAILQ_INSERT_TAIL(&tdp->replies, p, link);
+	if(!tdp->scheduled) {
+		tdp->scheduled = 1;
+		wake = 1;
 	}
+	pthread_mutex_unlock(&tdp->pl_lock);
 	
+	if(wake) {
+		pthread_mutex_lock(&sched_lock);
+		STAILQ_INSERT_TAIL(&sched_incoming, tdp, sched_link);
+		pthread_mutex_unlock(&sched_lock);
+		uint64_t one = 1;
+		write(reply_efd, &one, sizeof one);
+	}
+}
+
+/* STORAGE_STAGE
+ * Description: thread storing the packets of a stream's connections in
+ *   order, a batch at a time: with the file backend the whole batch is
+ *   appended and then made durable with a single wait. Each packet then
+ *   goes to the reply scheduler.
+ * Input:
+ *  arg = stream
+ * Output: NULL
+ */
+static void* storage_stage(void* arg) {
+	struct stream* sp = arg;
+	struct store* st = &sp->st; //unused with the char device
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
 	
-	//support -d argument for creating daemon
-	if(argc == 2) {
-		//compare argv[1] with "-d"
-		int res = strcmp(argv[1], "-d");
-		if(res != 0) {
-			syslog(LOG_ERR, "ERROR: incorrect arguments.\n");
-			syslog(LOG_ERR, "Usage: ./aesdsocket or ./aesdsocket -d\n");
-			result = -1;
+	TRACE_THREAD("storage", 0);
+	place_thread(PLACE_STORAGE);
+	struct pkt* batch[PIPE_BATCH];
+	size_t n;
+	while((n = pkt_queue_pop(&sp->q, batch, atomic_load_explicit(&pipe_batch, memory_order_relaxed))) > 0) {
+		TRACE_BEGIN(TR_STORE, 0, n);
+		off_t last = -1;
+		for(size_t i = 0; i < n; i++) {
+			struct pkt* p = batch[i];
+			if(use_char_device) {
+				p->rc = file_write(p->conn, p->data, p->len);
+				continue;
+			}
+			p->end = store_write(st, p->data, p->len);
+			p->rc = p->end == -1 ? -1 : 0;
+			if(p->end > last) last = p->end;
+		}
+		if(last != -1) {
+			store_wait_durable(st, last);
+			//only the default stream is replicated, other offsets mean
+			//nothing to the follower
+			if(sp == stream_default(&streams)) repl_wait(&repl, last);
 		}
 		
-		//fork to create daemon here-- (socket bound, signal actions will carry over)
+		for(size_t i = 0; i < n; i++) reply_enqueue(batch[i]);
+		TRACE_END(TR_STORE, 0, n);
+	}
+	return NULL;
+}
+
+//the maintenance thread: how to wake it and when to stop
+static int maint_efd = -1;
+static atomic_int maint_stop;
+
+/* MAINTAINER
+ * Description: thread rotating, expiring and compressing the streams'
+ *   segments each time main's timer wakes it, so a compression pass
+ *   never holds up accepting or handing off connections (file backend)
+ * Input:
+ *  arg = unused
+ * Output: NULL
+ */
+static void* maintainer(void* arg) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	
+	TRACE_THREAD("maintain", 0);
+	place_thread(PLACE_OTHER);
+	uint64_t n;
+	while(read(maint_efd, &n, sizeof n) == sizeof n && !atomic_load(&maint_stop))
+		stream_each(&streams, store_maintain);
+	return NULL;
+}
+
+/* REPLY_DONE
+ * Description: finishes the packet being echoed
+ * Input:
+ *  tdp = connection
+ * Output: 1 if more packets are waiting, 0 if the connection went idle.
+ *   Then the scheduler must not touch it any more: once nothing is in
+ *   flight its receive stage can end and the connection be freed.
+ */
+static int reply_done(struct thread_data* tdp) {
+	pkt_put(tdp->cur);
+	tdp->cur = NULL;
+	atomic_fetch_sub(&reply_stats.depth, 1);
+	atomic_fetch_add(&reply_stats.items, 1);
+	atomic_fetch_sub(&recv_stats.depth, 1);
+	
+	pthread_mutex_lock(&tdp->pl_lock);
+	int more = !STAILQ_EMPTY(&tdp->replies);
+	if(!more) tdp->scheduled = 0;
+	tdp->inflight--;
+	pthread_cond_broadcast(&tdp->pl_cond);
+	pthread_mutex_unlock(&tdp->pl_lock);
+	return more;
+}
+
+/* REPLY_SERVE
+ * Description: gives a connection its turn: sends up to REPLY_QUANTUM
+ *   bytes of its echoes without blocking, moving on to its next packet
+ *   as each echo completes. A failed send abandons that echo, like a
+ *   failed send_all did.
+ * Input:
+ *  tdp = connection, held by the scheduler
+ * Output: 1 if it has more to send, 2 if its socket is full,
+ *   0 if it went idle (see reply_done)
+ */
+static int reply_serve(struct thread_data* tdp) {
+	size_t budget = REPLY_QUANTUM;
+	while(1) {
+		//what was already read goes out first
+		if(tdp->r_pos < tdp->r_len) {
+			if(budget == 0) return 1;
+			size_t n = tdp->r_len - tdp->r_pos;
+			if(n > budget) n = budget;
+			TRACE_BEGIN(TR_SEND, tdp->id, 0);
+			ssize_t rc = send(tdp->nsfd, tdp->tx + tdp->r_pos, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+			TRACE_END(TR_SEND, tdp->id, rc > 0 ? rc : 0);
+			if(rc == -1) {
+				if(errno == EINTR) continue;
+				if(errno == EAGAIN || errno == EWOULDBLOCK) {
+					atomic_fetch_add(&reply_stats.full_waits, 1);
+					return 2;
+				}
+				syslog(LOG_ERR, "Failed to send:%m\n");
+				tdp->r_pos = tdp->r_len;
+				tdp->r_state = REPLY_DONE;
+				continue;
+			}
+			tdp->r_pos += rc;
+			budget -= rc;
+			continue;
+		}
+		
+		//then the rest of the echo in progress
+		if(tdp->cur) {
+			int rc = fill_line(tdp);
+			if(rc == 1) continue;
+			if(rc == -1) tdp->r_state = REPLY_DONE;
+			TRACE_ASYNC_END(TR_ECHO, tdp->id);
+			syslog(LOG_DEBUG,"sent back file.\n");
+			if(!reply_done(tdp)) return 0;
+		}
+		
+		//then the connection's next stored packet
+		pthread_mutex_lock(&tdp->pl_lock);
+		struct pkt* p = STAILQ_FIRST(&tdp->replies);
+		STAILQ_REMOVE_HEAD(&tdp->replies, link); //never empty here
+		pthread_mutex_unlock(&tdp->pl_lock);
+		tdp->cur = p;
+		
+		if(p->rc != 0 && !tdp->failed) {
+			syslog(LOG_ERR, "Failed to write to the file\n");
+			tdp->failed = 1;
+			shutdown(tdp->nsfd, SHUT_RDWR); //ends the receive stage too
+		}
+		if(!p->echo || tdp->failed) {
+			if(!reply_done(tdp)) return 0;
+			continue;
+		}
+		syslog(LOG_DEBUG,"Read packet.\n");
+		tdp->r_off = use_char_device ? 0 : store_start(tdp->st);
+		tdp->r_state = REPLY_BODY;
+		tdp->r_last = tdp->compress ? '\n' : 0;
+		tdp->r_pos = tdp->r_len = 0;
+		TRACE_ASYNC_BEGIN(TR_ECHO, tdp->id);
+	}
+}
+
+/* REPLY_SCHEDULER
+ * Description: thread sending every connection's echoes. Connections
+ *   with something to send take turns of REPLY_QUANTUM bytes, so a
+ *   client with huge echoes only delays the others by one turn each.
+ *   Sockets that are full wait for POLLOUT without holding up the rest.
+ * Input:
+ *  arg = unused
+ * Output: NULL
+ */
+static void* reply_scheduler(void* arg) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	
+	TRACE_THREAD("reply", 0);
+	place_thread(PLACE_REPLY);
+	struct td_list active = STAILQ_HEAD_INITIALIZER(active);
+	struct td_list blocked = STAILQ_HEAD_INITIALIZER(blocked);
+	size_t nblocked = 0;
+	struct pollfd* pfds = NULL;
+	size_t pcap = 0;
+	int short_set = 0; //1 while the poll set can't hold every blocked socket
+	
+	while(1) {
+		//take on connections with new echoes
+		pthread_mutex_lock(&sched_lock);
+		STAILQ_CONCAT(&active, &sched_incoming);
+		pthread_mutex_unlock(&sched_lock);
+		
+		//one turn each
+		int idle = STAILQ_EMPTY(&active);
+		if(idle && nblocked == 0 && atomic_load(&reply_stop)) break;
+		struct td_list next = STAILQ_HEAD_INITIALIZER(next);
+		struct thread_data* tdp;
+		while((tdp = STAILQ_FIRST(&active)) != NULL) {
+			STAILQ_REMOVE_HEAD(&active, sched_link);
+			int rc = reply_serve(tdp);
+			if(rc == 1) STAILQ_INSERT_TAIL(&next, tdp, sched_link);
+			else if(rc == 2) {
+				STAILQ_INSERT_TAIL(&blocked, tdp, sched_link);
+				nblocked++;
+			}
+		}
+		STAILQ_CONCAT(&active, &next);
+		
+		//wait for work or room, only if there is nothing to do meanwhile.
+		//Short of memory for the poll set, the sockets that don't fit in
+		//the old one are retried every REPLY_RETRY_MS instead
+		size_t npoll = nblocked + 1;
+		if(pcap < npoll) {
+			struct pollfd* tmp = realloc(pfds, npoll * 2 * sizeof *tmp);
+			if(tmp) {
+				pfds = tmp;
+				pcap = npoll * 2;
+			}
+			else if(!short_set) syslog(LOG_ERR, "Failed to grow reply poll set, retrying sockets\n");
+		}
+		struct pollfd efd_only;
+		struct pollfd* set = pcap ? pfds : &efd_only;
+		size_t nset = npoll < pcap ? npoll : (pcap ? pcap : 1);
+		short_set = nset < npoll;
+		set[0].fd = reply_efd;
+		set[0].events = POLLIN;
+		size_t i = 1;
+		STAILQ_FOREACH(tdp, &blocked, sched_link) {
+			if(i == nset) break;
+			set[i].fd = tdp->nsfd;
+			set[i].events = POLLOUT;
+			i++;
+		}
+		int timeout = !STAILQ_EMPTY(&active) ? 0 : nset < npoll ? REPLY_RETRY_MS : -1;
+		int rc = poll(set, nset, timeout);
+		if(rc < 0 || (rc == 0 && nset == npoll)) continue;
+		if(set[0].revents) {
+			uint64_t n;
+			read(reply_efd, &n, sizeof n);
+		}
+		
+		//sockets with room again get their turns back, as do the ones
+		//left out of the set
+		struct td_list still = STAILQ_HEAD_INITIALIZER(still);
+		i = 1;
+		while((tdp = STAILQ_FIRST(&blocked)) != NULL) {
+			STAILQ_REMOVE_HEAD(&blocked, sched_link);
+			if(i >= nset || set[i++].revents) {
+				STAILQ_INSERT_TAIL(&active, tdp, sched_link);
+				nblocked--;
+			}
+			else STAILQ_INSERT_TAIL(&still, tdp, sched_link);
+		}
+		STAILQ_CONCAT(&blocked, &still);
+	}
+	free(pfds);
+	return NULL;
+}
+
+//logs one line per pipeline stage
+static void log_stage_stats(void) {
+	struct stage_stats* stages[] = { &recv_stats, &store_stats, &reply_stats };
+	char line[128];
+	for(size_t i = 0; i < sizeof stages / sizeof stages[0]; i++) {
+		stage_stats_format(stages[i], line, sizeof line);
+		syslog(LOG_INFO, "pipeline %s\n", line);
+	}
+}
+
+/*WAIT_READABLE
+ * Description: blocks until the socket has data or the server is shutting down
+ *  once shutdown is signaled, a packet already in progress keeps the wait
+ *  on the socket alone; main shuts the socket down if the deadline passes.
+ * Inputs:
+ *  socket = socket file descriptor to wait on
+ *  in_packet = 1 if part of a packet has already been received
+ * Output:
+ *  1 if the socket is readable, 0 if the worker should stop, -1 on error
+ */
+static int wait_readable(int socket, int in_packet) {
+	struct pollfd pfds[2];
+	pfds[0].fd = socket;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = shutdown_efd;
+	pfds[1].events = POLLIN;
+	
+	while(1) {
+		//only watch for shutdown between packets
+		nfds_t n = (in_packet || shutdown_efd == -1) ? 1 : 2;
+		int rc = poll(pfds, n, -1);
+		if(rc == -1) {
+			if(errno == EINTR) continue;
+			syslog(LOG_ERR, "Failed to poll: %m\n");
+			return -1;
+		}
+		if(pfds[0].revents) return 1; //data, hangup or error: let recv report it
+		if(n == 2 && pfds[1].revents) return 0; //idle and shutting down
+	}
+}
+
+/*READ_PACKET 
+ * Description: buffered reads the packet of data
+ *  the end of a packet is the first newline, found by scanning every
+ *  received byte; whatever arrived after it stays in the connection's
+ *  receive buffer as the start of the next packet
+ *  writes the data out to specified file
+ * Inputs: 
+ *  tdp = connection to read from, holds the socket and the backend
+ * Output:
+ *  result = -1 upon failure, 0 if connection closed, 1 if successful,
+ *    2 if stopped between packets because the server is shutting down,
+ *    3 if the packet was a command, already answered,
+ *    4 if it subscribed, the fan-out thread has the connection now
+ */
+int read_packet(struct thread_data* tdp) {
+	int result;
+	int socket = tdp->nsfd;
+	size_t scanned = 0; //bytes of rx already known to hold no newline
+	size_t pkt_len = 0;
+	
+	while(1) {
+		//a packet may already be waiting from the last recv
+		const char* eop = scan_newline(tdp->rx + scanned, tdp->rx_len - scanned);
+		if(eop) {
+			pkt_len = eop - tdp->rx + 1;
+			result = 1;
+			break;
+		}
+		scanned = tdp->rx_len;
+		
+		//wait for data, giving up between packets if shutting down
+		int ready = wait_readable(socket, tdp->rx_len != 0);
+		if(ready == -1) {
+			result = -1;
+			break;
+		}
+		if(ready == 0) {
+			result = 2;
+			break;
+		}
+		
+		//make room for a full read plus the terminator do_ioctl relies on
+		//(only packets longer than the pooled buffer get here)
+		if(tdp->rx_cap < tdp->rx_len + tdp->rx_want + 1) {
+			size_t new_cap = tdp->rx_cap * 2;
+			while(new_cap < tdp->rx_len + tdp->rx_want + 1) new_cap *= 2;
+			char* tmp = realloc(tdp->rx, new_cap);
+			if(!tmp) {
+				syslog(LOG_ERR, "Failed to realloc receive buffer: %m\n");
+				result = -1;
+				break;
+			}
+			tdp->rx = tmp;
+			tdp->rx_cap = new_cap;
+		}
+		
+		//read from socket the max allowed at a time
+		TRACE_BEGIN(TR_RECV, tdp->id, 0);
+		ssize_t num_read = recv(socket, tdp->rx + tdp->rx_len, tdp->rx_want, 0);
+		TRACE_END(TR_RECV, tdp->id, num_read > 0 ? num_read : 0);
+		if(num_read == -1) {
+			syslog(LOG_ERR, "Failed to recv: %m\n");
+			result = -1;
+			break;
+		}
+		else  if(num_read == 0) { //connection closed, whatever is left is the packet
+			pkt_len = tdp->rx_len;
+			result = 0;
+			break;
+		}
+		tdp->rx_len += num_read;
+	}//end while
+	
+	if(pkt_len == 0) return result;
+	
+	//packets bigger than the recvs: ask for more at a time from now on
+	if(io.autotune && pkt_len > tdp->rx_want && tdp->rx_want < io.rx_size) {
+		while(tdp->rx_want < pkt_len && tdp->rx_want < io.rx_size) tdp->rx_want *= 2;
+		if(tdp->rx_want > io.rx_size) tdp->rx_want = io.rx_size;
+	}
+	
+	//terminate the packet for the string parsing in the commands,
+	//keeping the first byte of the next one aside
+	char* buffer = tdp->rx;
+	char next = buffer[pkt_len];
+	buffer[pkt_len] = '\0';
+	capture_packet(&capture, tdp->id, buffer, pkt_len);
+	TRACE_MARK(TR_FRAME, tdp->id, pkt_len);
+	
+	//commands are answered here and not stored
+	if(result == 1) {
+		int cmd = do_command(tdp, buffer, pkt_len);
+		if(cmd != 0) result = cmd == 2 ? 4 : cmd == 1 ? 3 : -1;
+	}
+	
+	//a follower takes no packets of its own until promoted
+	if((result == 1 || result == 0) && repl_following(&repl)) {
+		syslog(LOG_ERR, "ERROR: following a leader, packets are refused.\n");
+		result = -1;
+	}
+	
+	//only store packet upon successful read, the echo waits for it
+	//in the reply stage while we go on receiving
+	if(result == 1 || result == 0) {
+		if(submit_packet(tdp, buffer, pkt_len, result == 1) != 0) result = -1;
+	}
+	
+	//keep the rest for the next packet
+	buffer[pkt_len] = next;
+	tdp->rx_len -= pkt_len;
+	memmove(buffer, buffer + pkt_len, tdp->rx_len);
+	return result;
+}
+
+/* ACCEPT_SOCKET
+ * Description: tries to accept connections from client
+ * Input: sfd = original socket file descriptor
+ * Output: new_sfd = new socket file descriptor for receiving, -1 on error
+ */
+int accept_socket(int sfd, char* host) {
+	//accept connection
+	struct sockaddr_storage client_addr;
+	socklen_t client_addr_size = sizeof client_addr;
+	int new_sfd = accept(sfd, (struct sockaddr*)&client_addr, &client_addr_size);
+	if(new_sfd == -1){
+		syslog(LOG_ERR, "socket accept fail: %m\n");
+		return -1;
+	}
+	//size the kernel buffers, leaving its autotuning alone unless asked
+	if(io.rcvbuf) setsockopt(new_sfd, SOL_SOCKET, SO_RCVBUF, &io.rcvbuf, sizeof io.rcvbuf);
+	if(io.sndbuf) setsockopt(new_sfd, SOL_SOCKET, SO_SNDBUF, &io.sndbuf, sizeof io.sndbuf);
+	//pull client_ip from client_addr (local producers have none)
+	if(client_addr.ss_family == AF_UNIX) {
+		strcpy(host, "local");
+	}
+	else {
+		int rc = getnameinfo((struct sockaddr*)&client_addr, client_addr_size, host, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
+		if(rc != 0) {
+			syslog(LOG_ERR, "Failed to get new hostname:%s\n", gai_strerror(rc));
+			strcpy(host, "unknown");
+		}
+	}
+	syslog(LOG_DEBUG, "Accepted connection from %s\n", host);
+	return new_sfd;
+}
+
+/* INIT_UNIX_SOCKET
+ * Description: setups a server socket on a Unix domain path,
+ *   replacing a socket file left there by an earlier run
+ * Input: path = filesystem path to listen on
+ * Output: 
+ *   sfd = socket file descriptor or -1 upon error
+ */
+static int init_unix_socket(const char* path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof addr.sun_path) {
+		syslog(LOG_ERR, "Unix socket path too long:%s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	
+	int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sfd < 0) {
+		syslog(LOG_ERR, "failed to create socket:%m\n");
+		return -1;
+	}
+	unlink(path);
+	if(bind(sfd, (struct sockaddr*)&addr, sizeof addr) == -1 || listen(sfd, listen_backlog) == -1) {
+		syslog(LOG_ERR, "Failed to listen on %s:%m\n", path);
+		close(sfd);
+		return -1;
+	}
+	return sfd;
+}
+
+/* INIT_SOCKET
+ * Description: setups a server socket
+ * Input: spec = where to listen: "port", "host:port", "[v6 addr]:port"
+ *   or "unix:/path". A missing or "*" host listens on every address,
+ *   IPv6 and IPv4 on one socket when the system has IPv6.
+ * Output: 
+ *   sfd = socket file descriptor or -1 upon error
+ */ 
+int init_socket(const char* spec) {
+	if(strncmp(spec, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0)
+		return init_unix_socket(spec + strlen(UNIX_PREFIX));
+	
+	//split host and port, the host may be a bracketed IPv6 address
+	char host[NI_MAXHOST];
+	const char* port = spec;
+	host[0] = '\0';
+	const char* colon = strrchr(spec, ':');
+	if(colon) {
+		const char* h = spec;
+		size_t hlen = colon - spec;
+		if(hlen >= 2 && h[0] == '[' && h[hlen - 1] == ']') {
+			h++;
+			hlen -= 2;
+		}
+		if(hlen >= sizeof host) {
+			syslog(LOG_ERR, "Bad listen address:%s\n", spec);
+			return -1;
+		}
+		memcpy(host, h, hlen);
+		host[hlen] = '\0';
+		port = colon + 1;
+	}
+	int wildcard = host[0] == '\0' || strcmp(host, "*") == 0;
+	
+	//need to get address in addrinfo struct
+	struct addrinfo hint; //need to make a hint for getaddrinfo function
+	memset(&hint, 0, sizeof(hint)); //default to 0s
+	hint.ai_socktype = SOCK_STREAM;
+	hint.ai_flags = AI_PASSIVE; //to make the address suitable for bind/accept
+	
+	//the wildcard tries a dual-stack IPv6 socket first, then plain IPv4
+	int families[2] = { AF_INET6, AF_INET };
+	int nfamilies = 2;
+	if(!wildcard) {
+		families[0] = AF_UNSPEC;
+		nfamilies = 1;
+	}
+	
+	int sfd = -1;
+	for(int f = 0; f < nfamilies && sfd == -1; f++) {
+		hint.ai_family = families[f];
+		struct addrinfo* addr_sp;
+		int rc = getaddrinfo(wildcard ? NULL : host, port, &hint, &addr_sp);
+		if(rc != 0) {
+			syslog(LOG_ERR, "getaddr fail:%s\n", gai_strerror(rc));
+			continue;
+		}
+		
+		//try to bind a socket
+		for(struct addrinfo* rp = addr_sp; rp != NULL; rp = rp->ai_next) { //result from getaddrinfo is linked list
+			sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+			if(sfd < 0) continue;
+			int yes = 1;
+			setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes); //tip for possible bind failure
+			if(rp->ai_family == AF_INET6) {
+				int v6only = 0; //take IPv4 clients as mapped addresses too
+				setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof v6only);
+			}
+			if(bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0) break; //success
+			close(sfd);
+			sfd = -1;
+		}
+		freeaddrinfo(addr_sp); //FREE!
+	}
+	if(sfd == -1) {
+		syslog(LOG_ERR, "Failed to bind %s.%m\n", spec); //errno is set on bind
+		return -1;
+	}
+	
+	//listen to socket
+	int result = listen(sfd, listen_backlog); 
+	if(result == -1) {
+		syslog(LOG_ERR, "Failed to listen.%m\n");
+		close(sfd);	
+		return -1;
+	}
+	return sfd;
+}
+
+/* CLOSE_LISTENERS
+ * Description: closes every listening socket
+ * Input: remove = 1 to also remove the files of Unix domain ones,
+ *   0 when another process is accepting on them now
+ * Output: none
+ */
+static void close_listeners(int remove) {
+	for(int i = 0; i < nlfds; i++) {
+		struct sockaddr_un addr;
+		socklen_t len = sizeof addr;
+		if(remove && getsockname(lfds[i], (struct sockaddr*)&addr, &len) == 0 &&
+		   addr.sun_family == AF_UNIX && addr.sun_path[0] != '\0')
+			unlink(addr.sun_path);
+		close(lfds[i]);
+	}
+	nlfds = 0;
+}
+
+/* INGEST_SINK
+ * Description: stores a batch of records from a shared memory producer
+ *   like packets from a socket. The file backend takes the batch in one
+ *   append, the driver one packet per write.
+ * Input:
+ *  arg = the producer's thread_data
+ *  data, len = whole records
+ * Output: -1 if error, 0 if success
+ */
+static int ingest_sink(void* arg, char* data, size_t len) {
+	struct thread_data* tdp = arg;
+	if(!use_char_device) return file_write(tdp, data, len);
+	
+	while(len) {
+		const char* eop = scan_newline(data, len);
+		size_t n = eop ? (size_t)(eop - data) + 1 : len;
+		if(file_write(tdp, data, n) != 0) return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void* threadfunc(void* thread_param)
+{
+	//setup threading info
+	if(!thread_param) {
+		syslog(LOG_ERR, "Null pointer exception in thread func.\n");
+		return NULL;
+	}
+	struct thread_data* tdp = (struct thread_data *) thread_param;
+	int success = 1;
+	TRACE_THREAD(tdp->ingest ? "ingest" : "conn", tdp->id);
+	place_thread(PLACE_CONN);
+	
+	//leave signals to main so they interrupt accept, not a worker
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	
+	//local producers write through a shared ring, nothing is echoed
+	if(tdp->ingest) {
+		if(ingest_serve(tdp->nsfd, INGEST_RING_SIZE, shutdown_efd, ingest_sink, tdp) != 0)
+			success = -1;
+		tdp->complete_flag = success;
+		return thread_param;
+	}
+	
+    
+	//continuously read on a socket
+	while(1) {
+		//read full packet
+		int rc = read_packet(tdp);
+		if(rc == -1) { //reading/echoing failed in some way
+			syslog(LOG_ERR, "Not reading correctly.\n");
+			success = -1;
+			break;
+		}
+		if(rc == 0) { //connection ended
+			break;
+		}
+		if(rc == 2) { //shutting down, connection still open
+			tdp->idle_exit = 1;
+			break;
+		}
+		if(rc == 4) { //a live tail now, its copy of the socket lives on
+			break;
+		}
+		//packet (or command) handled, the reply scheduler echoes it
+	} //end of reading packets
+	
+	//every packet received is stored and echoed before we are done
+	wait_inflight(tdp, 0);
+	if(tdp->failed) success = -1;
+	capture_packet(&capture, tdp->id, NULL, 0);
+    
+	tdp->complete_flag = success;
+    
+	return thread_param;
+}
+
+/* START_THREAD
+ * Description: creates a thread for an accepted (or handed over) client
+ *   and adds it to the list
+ * Input:
+ *  head = list of running threads
+ *  nsfd = client socket, closed here upon failure
+ *  host = name of the client
+ *  m = mutex to control file access
+ *  sp = stream it starts on
+ *  ingest = 1 if nsfd is a shared memory producer's control connection
+ * Output: 0 on success, -1 on failure
+ */
+static int start_thread(struct slisthead* head, int nsfd, const char* host, pthread_mutex_t* m, struct stream* sp, int ingest) {
+	pthread_t thread;
+	int fd = -1;
+	
+	if(use_char_device) {
+		fd = open(data_path, O_RDWR);
+		if(fd == -1) {
+			syslog(LOG_ERR, "ERROR opening file:%m\n");
+			close(nsfd);
+			return -1;
+		}
+	}
+	
+	//allocate memory for thread_data and its receive buffer
+	struct thread_data* td = slab_alloc(&td_slab);
+	if(!td) {
+		syslog(LOG_ERR, "Failed to allocate thread_data.\n");
+		goto fail;
+	}
+	char* rx = buf_get(&rx_pool);
+	char* tx = buf_get(&tx_pool);
+	if(!rx || !tx) {
+		syslog(LOG_ERR, "Failed to allocate I/O buffers.\n");
+		buf_put(&rx_pool, rx, rx_pool.size);
+		buf_put(&tx_pool, tx, tx_pool.size);
+		slab_free(&td_slab, td);
+		goto fail;
+	}
+	//setup arguments
+	td->m = m;
+	td->nsfd = nsfd;
+	td->fd = fd;
+	td->stream = sp;
+	td->st = use_char_device ? NULL : &sp->st;
+	td->complete_flag = 0;
+	td->idle_exit = 0;
+	td->compress = 0;
+	td->ingest = ingest;
+	td->inflight = 0;
+	td->failed = 0;
+	STAILQ_INIT(&td->replies);
+	td->scheduled = 0;
+	td->cur = NULL;
+	pthread_mutex_init(&td->pl_lock, NULL);
+	pthread_cond_init(&td->pl_cond, NULL);
+	td->rx = rx;
+	td->rx_len = 0;
+	td->rx_cap = rx_pool.size;
+	td->rx_want = io.autotune ? IO_AUTO_MIN : io.rx_size;
+	td->tx = tx;
+	td->id = ++conn_count;
+	TRACE_MARK(TR_ACCEPT, td->id, 0);
+	strncpy(td->host, host, NI_MAXHOST - 1);
+	td->host[NI_MAXHOST - 1] = '\0';
+	
+	//setup linked list element
+	slist_thread_t* threadp = slab_alloc(&node_slab);
+	if(!threadp) { //NO MORE MEMORY
+		syslog(LOG_ERR, "Failed to allocate ll element.\n");
+		buf_put(&rx_pool, rx, rx_pool.size);
+		buf_put(&tx_pool, tx, tx_pool.size);
+		slab_free(&td_slab, td);
+		goto fail;
+	}
+
+	int rc = pthread_create(&thread, NULL, &threadfunc, td);
+	if(rc != 0) {
+		syslog(LOG_ERR, "Failed to create thread.\n");
+		pthread_cond_destroy(&td->pl_cond);
+		pthread_mutex_destroy(&td->pl_lock);
+		buf_put(&rx_pool, rx, rx_pool.size);
+		buf_put(&tx_pool, tx, tx_pool.size);
+		slab_free(&td_slab, td);
+		slab_free(&node_slab, threadp);
+		goto fail;
+	}
+	
+	//----add to linked list----
+	threadp->thread = thread;
+	threadp->td = td;
+	SLIST_INSERT_HEAD(head, threadp, entries);
+	return 0;
+	
+fail:
+	close(nsfd);
+	if(use_char_device) close(fd);
+	return -1;
+}
+
+/* REAP_THREAD
+ * Description: joins a finished thread, then closes its socket(s)
+ *   or passes the client on to the process taking over from us.
+ *   The element must already be out of the list.
+ * Input:
+ *  tp = list element of the finished thread
+ *  handoff_fd = connection to the new process, -1 if clients aren't handed over
+ * Output: 0 on success, -1 if the join failed
+ */
+static int reap_thread(slist_thread_t* tp, int handoff_fd) {
+	int result = 0;
+	
+	//join thread
+	void* thread_rtn = NULL;
+	int rc = pthread_join(tp->thread, &thread_rtn);
+	if(rc != 0) {
+		syslog(LOG_ERR, "Failed to end thread:%ld\n", tp->thread);
+		result = -1;
+	}
+	
+	//check thread success
+	if(!thread_rtn) //failure
+		syslog(LOG_ERR, "threadfunc failed.\n");
+	struct thread_data* tdp = tp->td;
+	
+	//hand idle clients over, the new process carries on from the next packet
+	//(not compressed ones or ones on a named stream: the negotiated mode
+	//and stream don't travel with the socket)
+	if(handoff_fd != -1 && tdp->idle_exit && !tdp->compress && tdp->stream == stream_default(&streams)) {
+		if(handoff_send(handoff_fd, HANDOFF_CLIENT, tdp->nsfd, tdp->host) == 0)
+			syslog(LOG_DEBUG, "Handed over connection from %s\n", tdp->host);
+	}
+	else
+		syslog(LOG_DEBUG, "Closed connection from %s\n", tdp->host);
+	
+	//close the socket(s)
+	close(tdp->nsfd); //close accepted socket (the new process holds its own copy)
+	if(use_char_device)
+		close(tdp->fd); //close the driver
+	
+	//free the thread, its memory goes back for the next connection
+	pthread_cond_destroy(&tdp->pl_cond);
+	pthread_mutex_destroy(&tdp->pl_lock);
+	buf_put(&rx_pool, tdp->rx, tdp->rx_cap);
+	buf_put(&tx_pool, tdp->tx, tx_pool.size);
+	slab_free(&td_slab, tdp);
+	slab_free(&node_slab, tp);
+	return result;
+}
+
+/* REAP_FINISHED
+ * Description: reaps every thread in the list that has completed
+ * Input:
+ *  head = list of running threads
+ *  handoff_fd = passed on to reap_thread
+ * Output: number of threads still running, -1 if a join failed
+ */
+static int reap_finished(struct slisthead* head, int handoff_fd) {
+	int running = 0;
+	int failed = 0;
+	slist_thread_t* tp = NULL;
+	slist_thread_t* next = NULL;
+	SLIST_FOREACH_SAFE(tp, head, entries, next) {
+		//check if thread is done
+		if(tp->td->complete_flag) {
+			//remove from linked list
+			SLIST_REMOVE(head, tp, slist_thread_s, entries);
+			if(reap_thread(tp, handoff_fd) != 0) failed = 1;
+		}
+		else running++;
+	}
+	return failed ? -1 : running;
+}
+
+/* DRAIN_THREADS
+ * Description: reaps threads as they finish for up to drain_ms (-w),
+ *   then shuts down the sockets of any that are still going
+ *   and joins them as well. Leaves the list empty.
+ * Input:
+ *   head = list of running threads
+ *   handoff_fd = passed on to reap_thread
+ * Output: N/A
+ */
+static void drain_threads(struct slisthead* head, int handoff_fd) {
+	struct timespec now, deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += drain_ms / 1000;
+	deadline.tv_nsec += (drain_ms % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	
+	const struct timespec nap = { 0, DRAIN_POLL_MS * 1000000L };
+	while(1) {
+		int running = reap_finished(head, handoff_fd);
+		if(running == 0) return;
+		
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec > deadline.tv_sec ||
+		  (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+			syslog(LOG_DEBUG, "Shutdown deadline hit with connections open\n");
+			break;
+		}
+		nanosleep(&nap, NULL);
+	}
+	
+	//wake anything still blocked in recv or send
+	slist_thread_t* tp = NULL;
+	SLIST_FOREACH(tp, head, entries)
+		if(!tp->td->complete_flag) shutdown(tp->td->nsfd, SHUT_RDWR);
+	
+	//free linked list
+	while(!SLIST_EMPTY(head)) {
+		tp = SLIST_FIRST(head);
+		SLIST_REMOVE_HEAD(head, entries);
+		reap_thread(tp, handoff_fd);
+	}
+}
+
+/* TAKE_OVER
+ * Description: asks a running aesdsocket for its listening sockets.
+ *   The first one is waited for here, any others and the clients
+ *   follow on the handoff connection (see await_handoff).
+ * Input:
+ *   with_clients = 1 to also ask for its idle client connections
+ *   hfd = set to the handoff connection, kept open to receive the rest
+ * Output: listening socket, or -1 if there was nothing to take over
+ */
+static int take_over(int with_clients, int* hfd) {
+	*hfd = handoff_connect(HANDOFF_PATH);
+	if(*hfd == -1) return -1;
+	
+	char req = with_clients ? HANDOFF_REQ_ALL : HANDOFF_REQ_LISTENER;
+	if(send(*hfd, &req, 1, MSG_NOSIGNAL) != 1) {
+		syslog(LOG_ERR, "Failed to request handoff:%m\n");
+		close(*hfd);
+		*hfd = -1;
+		return -1;
+	}
+	
+	char type = 0;
+	int lfd = handoff_recv(*hfd, &type, NULL, 0);
+	if(lfd < 0 || type != HANDOFF_LISTENER) {
+		syslog(LOG_ERR, "Handoff did not send a listening socket\n");
+		if(lfd >= 0) close(lfd);
+		close(*hfd);
+		*hfd = -1;
+		return -1;
+	}
+	syslog(LOG_DEBUG, "Took over listening socket\n");
+	return lfd;
+}
+
+/* AWAIT_HANDOFF
+ * Description: takes the rest of what the old process hands over, its
+ *   other listening sockets and its idle clients, up to HANDOFF_END,
+ *   which it sends once its stores are closed. Opening them any earlier
+ *   would miss what it appends while draining, and -k could cut a record
+ *   it is still writing. The clients wait in *adopted until the streams
+ *   are open.
+ * Input:
+ *   hfd = handoff connection, closed here
+ *   adopted = set to the clients received, for the caller to free
+ * Output: number of clients received
+ */
+static int await_handoff(int hfd, struct adopted** adopted) {
+	int n = 0;
+	int cap = 0;
+	*adopted = NULL;
+	syslog(LOG_DEBUG, "Waiting for the old process to close its stores\n");
+	while(1) {
+		char host[NI_MAXHOST];
+		char type = 0;
+		int fd = handoff_recv(hfd, &type, host, sizeof host);
+		if(fd >= 0 && type == HANDOFF_LISTENER && nlfds < MAX_LISTENERS) {
+			syslog(LOG_DEBUG, "Took over listening socket\n");
+			lfds[nlfds++] = fd;
+		}
+		else if(fd >= 0 && type == HANDOFF_CLIENT) {
+			if(n == cap) {
+				struct adopted* a = realloc(*adopted, (cap ? 2 * cap : 16) * sizeof *a);
+				if(!a) {
+					syslog(LOG_ERR, "Failed to take over connection from %s\n", host);
+					close(fd);
+					continue;
+				}
+				*adopted = a;
+				cap = cap ? 2 * cap : 16;
+			}
+			syslog(LOG_DEBUG, "Took over connection from %s\n", host);
+			(*adopted)[n].fd = fd;
+			memcpy((*adopted)[n].host, host, sizeof host);
+			n++;
+		}
+		else {
+			if(fd >= 0) close(fd);
+			break; //end of handoff (or old process gone)
+		}
+	}
+	close(hfd);
+	return n;
+}
+
+/* HAND_OFF
+ * Description: serves a new aesdsocket that connected to our handoff socket:
+ *   sends it the listening sockets and stops accepting.
+ * Input:
+ *   hsfd = handoff listening socket
+ *   handoff_fd = set to the connection, kept to tell the new process
+ *     when our stores are closed
+ *   send_clients = set to 1 if the new process wants our clients
+ * Output: 0 if the listening socket was handed off, -1 if not
+ */
+static int hand_off(int hsfd, int* handoff_fd, int* send_clients) {
+	int conn = handoff_accept(hsfd);
+	if(conn == -1) return -1;
+	
+	char req = 0;
+	if(recv(conn, &req, 1, 0) != 1 ||
+	  (req != HANDOFF_REQ_LISTENER && req != HANDOFF_REQ_ALL)) {
+		syslog(LOG_ERR, "Bad handoff request\n");
+		close(conn);
+		return -1;
+	}
+	for(int i = 0; i < nlfds; i++) {
+		if(handoff_send(conn, HANDOFF_LISTENER, lfds[i], NULL) != 0) {
+			close(conn);
+			return -1;
+		}
+	}
+	
+	//the new process accepts from here on, our copies just go away
+	//(no shutdown: that would stop the shared sockets for both of us)
+	close_listeners(0);
+	syslog(LOG_DEBUG, "Handed off listening sockets\n");
+	
+	*handoff_fd = conn;
+	*send_clients = req == HANDOFF_REQ_ALL;
+	return 0;
+}
+
+/* PARSE_IO
+ * Description: parses the -b option, a comma separated list of
+ *   rx=N (bytes per recv), tx=N (bytes per echo read), rcvbuf=N and
+ *   sndbuf=N (socket buffers, 0 for the kernel's autotuning) and auto
+ *   (recvs start small and grow with the connection's packets, up to rx)
+ * Input:
+ *  arg = option argument
+ *  o = options to fill in
+ * Output: 0 on success, -1 if the argument is malformed
+ */
+static int parse_io(const char* arg, struct io_opts* o) {
+	char* copy = strdup(arg);
+	if(!copy) return -1;
+	int result = 0;
+	char* save = NULL;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if(strcmp(tok, "auto") == 0) {
+			o->autotune = 1;
+			continue;
+		}
+		char* eq = strchr(tok, '=');
+		if(!eq) {
+			result = -1;
+			break;
+		}
+		*eq = '\0';
+		char* end = NULL;
+		long long val = strtoll(eq + 1, &end, 10);
+		if(*end != '\0' || val < 0 || val > IO_MAX_SIZE) {
+			result = -1;
+			break;
+		}
+		if(strcmp(tok, "rx") == 0 && val > 0) o->rx_size = val;
+		else if(strcmp(tok, "tx") == 0 && val > 0) o->tx_size = val;
+		else if(strcmp(tok, "rcvbuf") == 0) o->rcvbuf = val;
+		else if(strcmp(tok, "sndbuf") == 0) o->sndbuf = val;
+		else {
+			result = -1;
+			break;
+		}
+	}
+	free(copy);
+	if(o->autotune && o->rx_size < IO_AUTO_MIN) o->rx_size = IO_AUTO_MIN;
+	return result;
+}
+
+/* PARSE_PIPELINE
+ * Description: parses the -P option, batch=N (packets the storage
+ *   stage commits together, up to PIPE_BATCH) and depth=N (packets of
+ *   one connection in flight, up to PIPE_CONN_MAX), comma separated
+ * Input:
+ *  arg = option argument
+ * Output: 0 on success, -1 if the argument is malformed
+ */
+static int parse_pipeline(const char* arg, struct settings* cfg) {
+	char* copy = strdup(arg);
+	if(!copy) return -1;
+	int result = 0;
+	char* save = NULL;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char* eq = strchr(tok, '=');
+		char* end = NULL;
+		long val = eq ? strtol(eq + 1, &end, 10) : 0;
+		if(!eq || *end != '\0' || val < 1) {
+			result = -1;
+			break;
+		}
+		*eq = '\0';
+		if(strcmp(tok, "batch") == 0 && val <= PIPE_BATCH) cfg->pipe_batch = val;
+		else if(strcmp(tok, "depth") == 0 && val <= PIPE_CONN_MAX) cfg->pipe_depth = val;
+		else {
+			result = -1;
+			break;
+		}
+	}
+	free(copy);
+	return result;
+}
+
+//-v names, in syslog priority order
+static const char* const log_levels[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+//the long options, also the config file's keys (see config.h)
+static const struct option long_opts[] = {
+	{ "config", required_argument, NULL, 'f' },
+	{ "daemon", no_argument, NULL, 'd' },
+	{ "takeover", no_argument, NULL, 't' },
+	{ "takeover-clients", no_argument, NULL, 'T' },
+	{ "backend", required_argument, NULL, 'B' },
+	{ "data", required_argument, NULL, 'D' },
+	{ "sync", required_argument, NULL, 's' },
+	{ "keep", no_argument, NULL, 'k' },
+	{ "segments", required_argument, NULL, 'S' },
+	{ "io", required_argument, NULL, 'b' },
+	{ "pipeline", required_argument, NULL, 'P' },
+	{ "listen", required_argument, NULL, 'l' },
+	{ "backlog", required_argument, NULL, 'Q' },
+	{ "timestamp", required_argument, NULL, 'I' },
+	{ "drain", required_argument, NULL, 'w' },
+	{ "log-level", required_argument, NULL, 'v' },
+	{ "cpus", required_argument, NULL, 'C' },
+	{ "priority", required_argument, NULL, 'p' },
+	{ "ingest", required_argument, NULL, 'i' },
+	{ "capture", required_argument, NULL, 'c' },
+	{ "lead", required_argument, NULL, 'R' },
+	{ "follow", required_argument, NULL, 'F' },
+	{ NULL, 0, NULL, 0 }
+};
+#define SHORT_OPTS "f:dtTB:D:s:kS:b:P:l:Q:I:w:v:C:p:i:c:R:F:"
+
+/* APPLY_OPTION
+ * Description: applies an option, from the command line or the config file
+ * Input:
+ *  arg = settings
+ *  opt = getopt value
+ *  value = its argument, NULL for a flag
+ * Output: 0 on success, -1 if the argument is malformed
+ */
+static int apply_option(void* arg, int opt, const char* value) {
+	struct settings* cfg = arg;
+	char* end = NULL;
+	long n = 0;
+	switch(opt) {
+	case 'f':
+		cfg->config = value;
+		return 0;
+	case 'd':
+		cfg->daemonize = 1;
+		return 0;
+	case 't':
+		cfg->takeover = 1;
+		return 0;
+	case 'T':
+		cfg->takeover = 2;
+		return 0;
+	case 'B':
+		if(strcmp(value, "chardev") == 0) use_char_device = 1;
+		else if(strcmp(value, "file") == 0) use_char_device = 0;
+		else {
+			syslog(LOG_ERR, "ERROR: backend is chardev or file\n");
+			return -1;
+		}
+		return 0;
+	case 'D':
+		data_path = value;
+		return 0;
+	case 's':
+		if(store_parse_sync(value, &cfg->sopts) == 0) return 0;
+		syslog(LOG_ERR, "ERROR: sync policy is none, packet, ms:N or bytes:N\n");
+		return -1;
+	case 'k':
+		cfg->sopts.keep = 1;
+		return 0;
+	case 'S':
+		if(store_parse_segments(value, &cfg->sopts) == 0) return 0;
+		syslog(LOG_ERR, "ERROR: segments take size=,age=,keep_segs=,keep_bytes=,keep_age=\n");
+		return -1;
+	case 'b':
+		if(parse_io(value, &io) == 0) return 0;
+		syslog(LOG_ERR, "ERROR: I/O sizes take rx=,tx=,rcvbuf=,sndbuf=,auto\n");
+		return -1;
+	case 'P':
+		if(parse_pipeline(value, cfg) == 0) return 0;
+		syslog(LOG_ERR, "ERROR: pipeline takes batch=1..%d,depth=1..%d\n", PIPE_BATCH, PIPE_CONN_MAX);
+		return -1;
+	case 'l':
+		if(cfg->nspecs < MAX_LISTENERS) {
+			cfg->specs[cfg->nspecs++] = value;
+			return 0;
+		}
+		syslog(LOG_ERR, "ERROR: at most %d listen addresses\n", MAX_LISTENERS);
+		return -1;
+	case 'Q':
+		n = strtol(value, &end, 10);
+		if(*end != '\0' || n < 1 || n > SOMAXCONN) {
+			syslog(LOG_ERR, "ERROR: backlog is 1..%d\n", SOMAXCONN);
+			return -1;
+		}
+		listen_backlog = n;
+		return 0;
+	case 'I':
+		n = strtol(value, &end, 10);
+		if(*end != '\0' || n < 0 || n > 86400) {
+			syslog(LOG_ERR, "ERROR: timestamp interval is 0 (none) to 86400 s\n");
+			return -1;
+		}
+		cfg->timestamp_s = n;
+		return 0;
+	case 'w':
+		n = strtol(value, &end, 10);
+		if(*end != '\0' || n < 0 || n > SHUTDOWN_DEADLINE_MAX) {
+			syslog(LOG_ERR, "ERROR: drain deadline is 0 to %d ms\n", SHUTDOWN_DEADLINE_MAX);
+			return -1;
+		}
+		cfg->drain_ms = n;
+		return 0;
+	case 'v':
+		for(int i = 0; i < (int)(sizeof log_levels / sizeof *log_levels); i++) {
+			if(strcmp(value, log_levels[i]) == 0) {
+				cfg->log_level = i;
+				return 0;
+			}
+		}
+		syslog(LOG_ERR, "ERROR: log level is err, warning, notice, info or debug\n");
+		return -1;
+	case 'C':
+		if(place_parse_cpus(value) == 0) return 0;
+		syslog(LOG_ERR, "ERROR: CPUs take listen|conn|storage|commit|reply|other=list, e.g. conn=1-2,4\n");
+		return -1;
+	case 'p':
+		if(place_parse_prio(value) == 0) return 0;
+		syslog(LOG_ERR, "ERROR: priority takes role=fifo:1..%d or role=nice:-20..19\n", PLACE_FIFO_MAX);
+		return -1;
+	case 'i':
+		cfg->ingest_path = value;
+		return 0;
+	case 'c':
+		cfg->capture_path = value;
+		return 0;
+	case 'R':
+		if(repl_parse_leader(value, &cfg->ropts) == 0) return 0;
+		syslog(LOG_ERR, "ERROR: leading takes addr[,ack=none|received|durable][,timeout=ms]\n");
+		return -1;
+	case 'F':
+		cfg->ropts.leader = value;
+		return 0;
+	default:
+		syslog(LOG_ERR, "ERROR: incorrect arguments.\n");
+		syslog(LOG_ERR, "Usage: ./aesdsocket [-f config] [-d] [-t|-T] [-B chardev|file] [-D path] [-s sync] [-k] [-S segments] [-b io] [-P pipeline] [-l addr]... [-Q backlog] [-I secs] [-w ms] [-v level] [-C role=cpus]... [-p role=prio]... [-i path] [-c trace] [-R addr,...] [-F host:port]\n");
+		return -1;
+	}
+}
+
+/* RESET_RELOADABLE
+ * Description: puts the options SIGHUP reloads (-P, -I, -w and -v) back
+ *   to their defaults, but for the ones given on the command line, so
+ *   one taken out of the config file reverts on the next reload
+ * Input:
+ *  cfg = settings
+ * Output: N/A
+ */
+static void reset_reloadable(struct settings* cfg) {
+	if(!cfg->on_cmdline['P']) {
+		cfg->pipe_batch = PIPE_BATCH;
+		cfg->pipe_depth = PIPE_CONN_DEPTH;
+	}
+	if(!cfg->on_cmdline['I']) cfg->timestamp_s = TIMESTAMP_S;
+	if(!cfg->on_cmdline['w']) cfg->drain_ms = SHUTDOWN_DEADLINE_MS;
+	if(!cfg->on_cmdline['v']) cfg->log_level = LOG_DEBUG;
+}
+
+/* RELOAD_OPTION
+ * Description: applies an option from the config file read again on
+ *   SIGHUP if it is safe to change while running (-P, -I, -w and -v) and
+ *   wasn't given on the command line. The others need a restart. It
+ *   goes into a scratch copy of the settings, kept only if the whole
+ *   file is valid.
+ * Input: as apply_option
+ * Output: 0 on success, -1 if the argument is malformed
+ */
+static int reload_option(void* arg, int opt, const char* value) {
+	struct settings* cfg = arg;
+	if(cfg->on_cmdline[opt]) return 0;
+	if(opt == 'P' || opt == 'I' || opt == 'w' || opt == 'v') return apply_option(arg, opt, value);
+	return 0;
+}
+
+/* APPLY_RUNTIME
+ * Description: puts the settings that can change while running in
+ *   effect: the log level, the pipeline's limits and the drain deadline
+ * Input:
+ *  cfg = settings
+ * Output: N/A
+ */
+static void apply_runtime(struct settings* cfg) {
+	setlogmask(LOG_UPTO(cfg->log_level));
+	atomic_store(&pipe_batch, cfg->pipe_batch);
+	atomic_store(&pipe_depth, cfg->pipe_depth);
+	drain_ms = cfg->drain_ms;
+}
+
+/* ARM_TIMER
+ * Description: (re)arms the timer for the timestamp interval. It also
+ *   drives segment maintenance, so it keeps TIMESTAMP_S without timestamps
+ * Input:
+ *  cfg = settings
+ * Output: N/A
+ */
+static void arm_timer(struct settings* cfg) {
+	if(use_char_device) return;
+	struct itimerval delay;
+	delay.it_value.tv_sec = cfg->timestamp_s ? cfg->timestamp_s : TIMESTAMP_S;
+	delay.it_value.tv_usec = 0;
+	delay.it_interval = delay.it_value;
+	setitimer(ITIMER_REAL, &delay, NULL);
+}
+
+int main(int argc, char* argv[]) {
+	int result = 0;
+	struct store* store = NULL; //the default stream's, file backend
+	struct settings cfg;
+	memset(&cfg, 0, sizeof cfg); //no syncs, one file, no replication
+	reset_reloadable(&cfg);
+	int takeover_fd = -1; //handoff connection we receive sockets on
+	int handoff_fd = -1; //handoff connection we send sockets on
+	int send_clients = 0; //1 if our clients go on it too
+	int handed_off = 0;
+	int ifd = -1; //ingest listening socket
+	int repl_ok = 0;
+	
+	//setup syslog
+	openlog("assignment_8", 0, LOG_USER);
+	TRACE_THREAD("main", 0);
+	place_init();
+	
+	//the config file (-f) first, then the command line over it: -d for
+	//creating daemon, -t/-T for taking over, -B/-D for the backend and
+	//its file, -s for the file backend's sync policy, -k to keep its
+	//file, -S to split it into segments, -b for I/O sizes, -P for the
+	//pipeline's batches, -l for each address to listen on (-Q backlog),
+	//-I for the timestamp interval, -w for how long shutdown waits on
+	//packets in flight, -v for the log level, -C/-p for each
+	//kind of thread's CPUs and priority, -i for local shared memory
+	//producers, -c to capture client traffic for replay, -R to lead a
+	//follower and -F to follow a leader
+	int opt;
+	opterr = 0; //reported on the second pass
+	while((opt = getopt_long(argc, argv, SHORT_OPTS, long_opts, NULL)) != -1)
+		if(opt == 'f') cfg.config = optarg;
+	if(cfg.config) {
+		cfg.config_buf = config_read(cfg.config, long_opts, apply_option, &cfg);
+		if(!cfg.config_buf) result = -1;
+	}
+	opterr = 1;
+	optind = 0; //start over
+	while((opt = getopt_long(argc, argv, SHORT_OPTS, long_opts, NULL)) != -1) {
+		if(opt == 'f') continue;
+		if(opt == 'l' && !cfg.on_cmdline['l']) cfg.nspecs = 0; //instead of the file's
+		if(opt > 0 && opt < (int)sizeof cfg.on_cmdline) cfg.on_cmdline[opt] = 1;
+		if(apply_option(&cfg, opt, optarg) != 0) result = -1;
+	}
+	if(!data_path) data_path = use_char_device ? CHAR_DEVICE_NAME : STORE_NAME;
+	apply_runtime(&cfg);
+	place_thread(PLACE_LISTEN);
+	
+	//setup the eventfd used to wake workers on shutdown
+	shutdown_efd = eventfd(0, EFD_CLOEXEC);
+	if(shutdown_efd == -1) {
+		syslog(LOG_ERR, "ERROR creating shutdown eventfd:%m\n");
+		result = -1;
+	}
+	
+	//take the listening sockets from the running server, or
+	//open the ones asked for (port 9000 by default)
+	if(cfg.takeover) {
+		int lfd = take_over(cfg.takeover == 2, &takeover_fd);
+		if(lfd == -1) syslog(LOG_DEBUG, "Nothing to take over, binding\n");
+		else lfds[nlfds++] = lfd;
+	}
+	if(nlfds == 0 && !result) {
+		if(cfg.nspecs == 0) cfg.specs[cfg.nspecs++] = S_PORT;
+		for(int i = 0; i < cfg.nspecs; i++) {
+			int lfd = init_socket(cfg.specs[i]);
+			if(lfd == -1) {
+				result = -1;
+				break;
+			}
+			lfds[nlfds++] = lfd;
+		}
+	}
+	
+	//let the next version of us take over
+	int hsfd = -1;
+	if(!result) hsfd = handoff_listen(HANDOFF_PATH);
+	
+	//local producers get their rings here
+	if(!result && cfg.ingest_path) {
+		ifd = init_unix_socket(cfg.ingest_path);
+		if(ifd == -1) result = -1;
+	}
+	
+	//fork before any thread is started, only the forking thread is
+	//copied into the daemon
+	if(cfg.daemonize && !result) {
+		//fork to create daemon here-- (socket bound, signal actions will carry over)
 		pid_t cpid = fork();
 		if(cpid == -1){ //this is failure condition of fork
 			syslog(LOG_ERR,"a5_fork:%m\n");
@@ -473,82 +2187,186 @@ int main(int argc, char* argv[]) {
 		freopen("/dev/null", "w", stderr);
 	}
 	
+	//the old process's stores have to be closed before we open them
+	struct adopted* adopted = NULL;
+	int nadopted = 0;
+	if(takeover_fd != -1) {
+		nadopted = await_handoff(takeover_fd, &adopted);
+		takeover_fd = -1;
+	}
+	
+	//open the default stream, with the file backend making/opening its
+	//file for appending and read/write, and start its storage stage
+	int store_ok = 0;
+	if(stream_table_open(&streams, data_path, use_char_device ? NULL : &cfg.sopts, storage_stage, &store_stats) != 0)
+		result = -1;
+	else if(!use_char_device) {
+		store = &stream_default(&streams)->st;
+		store_ok = 1;
+	}
+	
+	//stream the store to a follower and/or follow a leader
+	if(!result && (cfg.ropts.listen || cfg.ropts.leader)) {
+		int rfd = -1;
+		if(!store_ok) {
+			syslog(LOG_ERR, "ERROR: replication needs the file backend.\n");
+			result = -1;
+		}
+		else if(cfg.ropts.listen && (rfd = init_socket(cfg.ropts.listen)) == -1)
+			result = -1;
+		else {
+			repl_ok = 1;
+			if(repl_start(&repl, &cfg.ropts, store, rfd) != 0) result = -1;
+		}
+	}
+	
+	//subscribers are sent what is stored, whichever way it is stored
+	int fanout_ok = 0;
+	if(!result) {
+		if(fanout_open(&fanout) != 0) result = -1;
+		else fanout_ok = 1;
+		if(fanout_ok && store_ok && store_add_hook(store, publish_appended, &fanout) != 0) result = -1;
+	}
+	
+	//record what clients send from the first connection on
+	if(!result && cfg.capture_path && capture_open(&capture, cfg.capture_path) != 0) result = -1;
+	
+	//setup signal handling
+	struct sigaction new_act;
+	memset(&new_act, 0, sizeof(struct sigaction)); //default the sigaction struct
+	new_act.sa_handler = signal_handler; //setup the signal handling function
+	int rc = sigaction(SIGTERM, &new_act, NULL); //register for SIGTERM
+	if(rc != 0) {
+		syslog(LOG_ERR, "Error %d registering for SIGTERM\n", errno);
+		result = -1;
+	}
+	rc = sigaction(SIGINT, &new_act, NULL); //register for SIGINT
+	if(rc != 0) {
+		syslog(LOG_ERR, "Error %d registering for SIGINT\n", errno);
+		result = -1;
+	}
+	
+	new_act.sa_handler = stats_handler;
+	rc = sigaction(SIGUSR1, &new_act, NULL); //register for SIGUSR1
+	if(rc != 0) {
+		syslog(LOG_ERR, "Error %d registering for SIGUSR1\n", errno);
+		result = -1;
+	}
+	
+	new_act.sa_handler = reload_handler;
+	rc = sigaction(SIGHUP, &new_act, NULL); //register for SIGHUP
+	if(rc != 0) {
+		syslog(LOG_ERR, "Error %d registering for SIGHUP\n", errno);
+		result = -1;
+	}
+	
+	if(!use_char_device) {
+		new_act.sa_handler = timer_handler; //setup the signal handling function
+		rc = sigaction(SIGALRM, &new_act, NULL); //register for SIGALRM
+		if(rc != 0) {
+			syslog(LOG_ERR, "Error %d registering for SIGALRM\n", errno);
+			result = -1;
+		}
+	}
+	
+	
 	//continually accept!
 
 	//create linked list
-	SLIST_HEAD(slisthead, slist_thread_s) head;
+	struct slisthead head;
 	SLIST_INIT(&head);
 	
 	//create single mutex for all threads to share
 	pthread_mutex_t mutex;
 	pthread_mutex_init(&mutex, NULL);
 	
-	//setup 10 second timer
-	struct itimerval delay;
+	//per-connection memory comes from these, not malloc, once warmed up
+	slab_init(&td_slab, sizeof(struct thread_data));
+	slab_init(&node_slab, sizeof(slist_thread_t));
+	//room for a partial packet plus a full recv and the terminator
+	buf_pool_init(&rx_pool, 2 * (io.autotune ? IO_AUTO_MIN : io.rx_size) + 1);
+	buf_pool_init(&tx_pool, io.tx_size > REPLY_FRAME_MAX ? io.tx_size : REPLY_FRAME_MAX);
+	
+	//start the reply scheduler after the streams' storage stages
+	pthread_t replier;
+	int replier_ok = 0;
+	reply_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(reply_efd != -1 && pthread_create(&replier, NULL, &reply_scheduler, NULL) == 0) replier_ok = 1;
+	if(!replier_ok) {
+		syslog(LOG_ERR, "Failed to start reply scheduler.\n");
+		result = -1;
+	}
+	
+	//segment maintenance runs off the timer, away from accepting
+	pthread_t maint;
+	int maint_ok = 0;
+	if(!result && store_ok) {
+		maint_efd = eventfd(0, EFD_CLOEXEC);
+		if(maint_efd != -1 && pthread_create(&maint, NULL, &maintainer, NULL) == 0) maint_ok = 1;
+		else {
+			syslog(LOG_ERR, "Failed to start maintenance thread.\n");
+			result = -1;
+		}
+	}
+	
+	//setup the timestamp timer (10 seconds by default)
 	char data[MAX_TIME_SIZE];
 	time_t rawNow;
 	struct tm* now = (struct tm*)malloc(sizeof(struct tm));
-	if(!USE_AESD_CHAR_DEVICE) {
-		delay.it_value.tv_sec = 10;
-		delay.it_value.tv_usec = 0;
-		delay.it_interval.tv_sec = 10;
-		delay.it_interval.tv_usec = 0;
-		setitimer(ITIMER_REAL, &delay, NULL);
-		memset(&data, 0, MAX_TIME_SIZE);
+	arm_timer(&cfg);
+	memset(&data, 0, MAX_TIME_SIZE);
+	
+	//the clients handed over along with the listeners, now that there is a stream to serve them
+	for(int i = 0; i < nadopted; i++) {
+		if(result) close(adopted[i].fd);
+		else if(start_thread(&head, adopted[i].fd, adopted[i].host, &mutex, stream_default(&streams), 0) != 0)
+			result = -1;
 	}
+	free(adopted);
 	
 	while(!caught_sig && !result) {
+		//wait on the handoff socket, local producers and the listeners
+		struct pollfd pfds[2 + MAX_LISTENERS];
+		int npfds = 2 + nlfds;
+		pfds[0].fd = hsfd;
+		pfds[1].fd = ifd;
+		for(int i = 0; i < nlfds; i++) pfds[2 + i].fd = lfds[i];
+		for(int i = 0; i < npfds; i++) {
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+		}
+		rc = poll(pfds, npfds, -1);
+		if(rc == -1 && errno != EINTR) {
+			syslog(LOG_ERR, "Failed to poll listeners:%m\n");
+			result = -1;
+			continue;
+		}
+		
 		/*------CREATE SOCKET RX THREAD------*/
-		char host[NI_MAXHOST];
-		int nsfd = accept_socket(sfd, host);
-		if(nsfd != -1) { //success
-			//----create a new thread----
-			pthread_t thread;
-			
-			if(USE_AESD_CHAR_DEVICE) {
-				fd = open(FILENAME, O_RDWR);
-				if(fd == -1) {
-					syslog(LOG_ERR, "ERROR opening file:%m\n");
+		for(int i = 2; i < npfds; i++) {
+			if(!pfds[i].revents) continue;
+			char host[NI_MAXHOST];
+			int nsfd = accept_socket(pfds[i].fd, host);
+			if(nsfd != -1) { //success
+				if(start_thread(&head, nsfd, host, &mutex, stream_default(&streams), 0) != 0)
 					result = -1;
-				}
-			}
-	    		
-	    		//allocate memory for thread_data
-			struct thread_data* td = (struct thread_data*)malloc(sizeof(struct thread_data));
-			if(!td) {
-				syslog(LOG_ERR, "Failed to allocate thread_data.\n");
-				result = -1;
-				continue;
-			}
-			//setup arguments
-			td->m = &mutex;
-			td->nsfd = nsfd;
-			td->fd = fd;
-			td->complete_flag = 0;
-			memcpy(td->host, host, NI_MAXHOST);
-			
-			//setup linked list element
-			slist_thread_t* threadp = malloc(sizeof(slist_thread_t));
-			if(!threadp) { //NO MORE MEMORY
-				syslog(LOG_ERR, "Failed to allocate ll element.\n");
-				free(td);
-				result = -1;
-				continue;
 			}
-
-			int rc = pthread_create(&thread, NULL, &threadfunc, td);
-			if(rc != 0) {
-				syslog(LOG_ERR, "Failed to create thread.\n");
-				free(td);
-				free(threadp);
+		}
+		
+		/*------CREATE LOCAL PRODUCER THREAD------*/
+		if(pfds[1].revents) {
+			int nsfd = accept(ifd, NULL, NULL);
+			if(nsfd == -1) syslog(LOG_ERR, "ingest accept fail: %m\n");
+			else if(start_thread(&head, nsfd, "local producer", &mutex, stream_default(&streams), 1) != 0)
 				result = -1;
-				continue;
+		}
+		
+		/*------HAND OFF TO A NEW PROCESS------*/
+		if(pfds[0].revents) {
+			if(hand_off(hsfd, &handoff_fd, &send_clients) == 0) {
+				handed_off = 1;
+				caught_sig = 1; //drain and exit as if signaled
 			}
-	    		
-			//----add to linked list----
-			threadp->thread = thread;
-			threadp->td = td;
-			SLIST_INSERT_HEAD(&head, threadp, entries);
 		}
 		
 		/*------CHECK TIMER------*/
@@ -562,88 +2380,113 @@ int main(int argc, char* argv[]) {
 			memset(&data, 0, MAX_TIME_SIZE);
 			strftime(data, MAX_TIME_SIZE, RFC2822_FORMAT, now);
 
-			rc = pthread_mutex_lock(&mutex);
-			if(rc != 0) {
-				syslog(LOG_ERR, "Failed to lock timestamp\n");
-				result = -1;
-				continue;
+			//write timestamp to file, nobody waits on it being durable
+			//(a follower has its leader's)
+			if(cfg.timestamp_s && !repl_following(&repl) && store_write(store, data, strlen(data)) == -1)
+				syslog(LOG_ERR, "Failed to write timestamp\n");
+			
+			//rotate and expire segments by age, in every stream (wakes
+			//during a pass add up to one more)
+			if(maint_efd != -1) {
+				uint64_t one = 1;
+				write(maint_efd, &one, sizeof one);
 			}
-
-			//write timestamp to file
-			write(fd, data, strlen(data));
-
-			rc = pthread_mutex_unlock(&mutex);
 		}
 		
-		/*------MANAGE RUNNING THREADS------*/
-		slist_thread_t* tp = NULL;
-		slist_thread_t* next = NULL;
-		SLIST_FOREACH_SAFE(tp, &head, entries, next) {
-			//check if thread is done
-			if(tp->td->complete_flag) {
-				//remove from linked list
-				SLIST_REMOVE(&head, tp, slist_thread_s, entries);
-				
-				//join thread
-				void* thread_rtn = NULL;
-				int rc = pthread_join(tp->thread, &thread_rtn);
-				if(rc != 0) {
-					syslog(LOG_ERR, "Failed to end thread:%ld\n", tp->thread);
-					result = -1;
+		/*------RELOAD CONFIG------*/
+		if(caught_reload) {
+			caught_reload = 0;
+			if(cfg.config) {
+				//all of the file or none of it
+				struct settings next = cfg;
+				reset_reloadable(&next);
+				char* buf = config_read(cfg.config, long_opts, reload_option, &next);
+				if(buf) {
+					cfg = next;
+					apply_runtime(&cfg);
+					arm_timer(&cfg);
+					syslog(LOG_INFO, "Reloaded %s\n", cfg.config);
 				}
-				
-				//check thread success
-				if(!thread_rtn) //failure
-					syslog(LOG_ERR, "threadfunc failed.\n");
-				struct thread_data* tdp = (struct thread_data *) thread_rtn;
-				
-				//close the socket(s)
-				syslog(LOG_DEBUG, "Closed connection from %s\n", tdp->host);
-				close(tdp->nsfd); //close accepted socket	
-				if(USE_AESD_CHAR_DEVICE)
-					close(tdp->fd); //close the driver	
-			
-				//free the thread
-				free(tdp);
-				free(tp);
+				else syslog(LOG_ERR, "Reloading %s failed, nothing changed\n", cfg.config);
+				free(buf);
 			}
-			
-		}//end list loop
+		}
+		
+		/*------REPORT PIPELINE------*/
+		if(caught_stats) {
+			caught_stats = 0;
+			log_stage_stats();
+		}
+		
+		/*------MANAGE RUNNING THREADS------*/
+		if(reap_finished(&head, -1) == -1)
+			result = -1;
 	}//end while
 	syslog(LOG_DEBUG, "Caught signal, exiting\n");
 	
-	if(result == -1) {
-		close(sfd);
-	}
+	if(result == -1) close_listeners(1);
 	
-	//free linked list
-	void* thread_rtn;
-	while(!SLIST_EMPTY(&head)) {
-		slist_thread_t* threadp = SLIST_FIRST(&head);
-		SLIST_REMOVE_HEAD(&head, entries);
-		pthread_join(threadp->thread, &thread_rtn);
-		
-		//close the socket(s)
-		struct thread_data* tdp = (struct thread_data *) thread_rtn;
-		syslog(LOG_DEBUG, "Closed connection from %s\n", tdp->host);
-		close(tdp->nsfd); //close accepted socket	
-		if(USE_AESD_CHAR_DEVICE)
-			close(tdp->fd); //close the driver
-		
-		free(thread_rtn);
-		free(threadp);
-		threadp = NULL;
+	//stop idle workers now, let the rest finish their packet until the deadline
+	wake_workers();
+	stream_each(&streams, store_flush); //don't hold draining packets to the sync interval
+	drain_threads(&head, send_clients ? handoff_fd : -1);
+	
+	//every connection is gone, so is everything they queued
+	stream_table_stop(&streams);
+	if(maint_ok) {
+		uint64_t one = 1;
+		atomic_store(&maint_stop, 1);
+		write(maint_efd, &one, sizeof one);
+		pthread_join(maint, NULL);
+	}
+	if(maint_efd != -1) close(maint_efd);
+	if(replier_ok) {
+		uint64_t one = 1;
+		atomic_store(&reply_stop, 1);
+		write(reply_efd, &one, sizeof one);
+		pthread_join(replier, NULL);
+		log_stage_stats();
 	}
+	if(reply_efd != -1) close(reply_efd);
+	pkt_pool_destroy();
+	capture_close(&capture);
 	
 	syslog(LOG_DEBUG, "Made it through the threads.\n");
 	
 	free(now);
 	pthread_mutex_destroy(&mutex);
+	slab_destroy(&td_slab);
+	slab_destroy(&node_slab);
+	buf_pool_destroy(&rx_pool);
+	buf_pool_destroy(&tx_pool);
+	close(shutdown_efd);
 	 
-	if(!USE_AESD_CHAR_DEVICE) close(fd); //close writing file
-	close(sfd); //close socket
+	//close writing file, flushing what the sync policy still holds
+	//and removing it, unless kept or the process that took over is still writing it
+	if(repl_ok) repl_stop(&repl);
+	free(cfg.ropts.listen);
+	free(cfg.config_buf);
+	if(fanout_ok) {
+		if(store_ok) store_remove_hook(store, publish_appended, &fanout);
+		fanout_close(&fanout);
+	}
+	stream_table_close(&streams, !cfg.sopts.keep && !handed_off);
+	//only now may the process that took over open them
+	if(handoff_fd != -1) {
+		handoff_send(handoff_fd, HANDOFF_END, -1, NULL);
+		close(handoff_fd);
+	}
+	close_listeners(1); //close sockets
+	if(ifd != -1) {
+		close(ifd);
+		if(!handed_off) unlink(cfg.ingest_path); //the new process has its own there
+	}
+	if(hsfd != -1) {
+		close(hsfd);
+		//the handoff path now belongs to whoever took over
+		if(!handed_off) unlink(HANDOFF_PATH);
+	}
 	
-	if(!USE_AESD_CHAR_DEVICE) unlink(FILENAME); //remove file
 	closelog();
 	return result;
 }
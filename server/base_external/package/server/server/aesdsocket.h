@@ -12,6 +12,11 @@
 #include <pthread.h>
 #include "queue.h"
 #include <sys/time.h>
+//shutdown includes:
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 //Assignment 5 includes:
 #include <fcntl.h>
 #include <stdio.h>
@@ -26,46 +31,227 @@
 #include <signal.h>
 //assignment 9 includes:
 #include "../aesd-char-driver/aesd_ioctl.h"
+//hot restart includes:
+#include <getopt.h>
+#include "handoff.h"
+//user space backend includes:
+#include "store.h"
+//compressed echo includes:
+#include <arpa/inet.h>
+#include "lz4.h"
+//framing includes:
+#include "scan.h"
+//allocator includes:
+#include "pool.h"
+//listener includes:
+#include <sys/un.h>
+#include <netinet/in.h>
+//local ingestion includes:
+#include "ingest.h"
+//pipeline includes:
+#include "pipeline.h"
+//capture includes:
+#include "capture.h"
+//tracing includes:
+#include "trace.h"
+//record query includes:
+#include <limits.h>
+//record search includes:
+#include "search.h"
+//replication includes:
+#include "repl.h"
+//live tail includes:
+#include "fanout.h"
+//stream includes:
+#include "stream.h"
+//configuration includes:
+#include "config.h"
+//placement includes:
+#include "place.h"
 
 //-------------------------DEFINES-------------------------
 #define S_PORT "9000"
+#define MAX_LISTENERS 8 //-l given at most this many times
+#define UNIX_PREFIX "unix:" //-l unix:/path listens on a Unix domain socket
 
-#define BACKLOG 5 //beej.us/guide/bgnet recommends 5 as number in backlog
-#define MAX_BUF_SIZE 50 //just to buffer
+#define BACKLOG 5 //beej.us/guide/bgnet recommends 5 as number in backlog, -Q changes it
+#define IO_BUF_SIZE 65536 //default bytes per recv and per echo read
+#define IO_AUTO_MIN 4096 //recv size auto-tuned connections start at
+#define IO_MAX_SIZE (16 * 1024 * 1024) //largest -b rx/tx accepted
 #define RFC2822_FORMAT "timestamp:%a, %d %b %Y %T %z\n"
 #define MAX_TIME_SIZE 60
+#define TIMESTAMP_S 10 //seconds between timestamps by default, -I changes it
 
+#ifndef USE_AESD_CHAR_DEVICE //build with -DUSE_AESD_CHAR_DEVICE=0 for the file backend
 #define USE_AESD_CHAR_DEVICE 1
+#endif
+
+#define SHUTDOWN_DEADLINE_MS 2000 //time given to in-flight packets on SIGTERM/SIGINT, -w changes it
+#define SHUTDOWN_DEADLINE_MAX 600000 //longest -w accepted
+#define DRAIN_POLL_MS 10 //how often main checks on draining threads
 
 #define IOCTL_CMD "AESDCHAR_IOCSEEKTO"
 #define IOCTL_CMD_L 18
 
+//"AESD_COMPRESS:lz4\n" switches a connection's echoes to LZ4 frames,
+//"AESD_COMPRESS:none\n" back to plain text. Each frame is a 4 byte raw
+//length and a 4 byte compressed length (network order) and the block,
+//stored as is when both lengths match. A 0,0 frame ends an echo.
+#define COMPRESS_CMD "AESD_COMPRESS:"
+#define COMPRESS_CMD_L 14
+#define TRACE_CMD "AESD_TRACE" //answered with the tracer's Chrome JSON, see trace.h
+#define TRACE_CMD_L 10
+
+//record queries, answered from the store's record index (file backend).
+//Records are numbered from 0, the oldest kept one:
+// "AESD_RECORD:N\n" record N
+// "AESD_RANGE:A,B\n" records [A,B)
+// "AESD_TAIL:K\n" the last K records
+// "AESD_TIME:T1,T2\n" the records written in [T1,T2), Unix seconds,
+//   "AESD_TIME:T1\n" those written since T1 (see timeindex.h)
+//each answered with "CMD:first,count,bytes\n" and then those bytes,
+// "AESD_COUNT\n" with "AESD_COUNT:records\n"
+// "AESD_SIZE\n" with "AESD_SIZE:bytes\n" (kept in the store)
+// "AESD_SEARCH:text\n" with "AESD_SEARCH:count,bytes\n" and the records
+//   holding text, the oldest SEARCH_MAX_MATCHES of them (see search.h)
+//and any of them with "CMD:error\n" if it can't be answered
+#define QUERY_RECORD "AESD_RECORD"
+#define QUERY_RANGE "AESD_RANGE"
+#define QUERY_TAIL "AESD_TAIL"
+#define QUERY_TIME "AESD_TIME"
+#define QUERY_COUNT "AESD_COUNT"
+#define QUERY_SIZE "AESD_SIZE"
+#define QUERY_SEARCH "AESD_SEARCH"
+#define QUERY_MAX_L 11 //longest query name
+#define REPLY_BLOCK_SIZE 16384 //raw bytes per compressed echo frame
+#define REPLY_FRAME_MAX (8 + LZ4_BOUND(REPLY_BLOCK_SIZE)) //largest compressed echo frame
+
+//echoes are sent a chunk at a time, round robin over the connections
+//with one up to this many bytes per turn
+#define REPLY_QUANTUM 65536
+#define REPLY_BODY 0 //echoing the file
+#define REPLY_TAIL 1 //file done, closing newline/frame left
+#define REPLY_DONE 2
+#define REPLY_RETRY_MS 50 //blocked sockets left out of a poll set we couldn't grow are retried this often
+
+#define CHAR_DEVICE_NAME "/dev/aesdchar"
+#define STORE_NAME "/var/tmp/aesdsocketdata" //the file backend's
 #undef FILENAME             /* undef it, just in case */
 #if USE_AESD_CHAR_DEVICE
-#    define FILENAME "/dev/aesdchar"
+#    define FILENAME CHAR_DEVICE_NAME
 #else
      /* This one for user space */
-#    define FILENAME "/var/tmp/aesdsocketdata"
+#    define FILENAME STORE_NAME
 #endif
 
 
+//I/O sizes, from -b (declared here for the io global below)
+struct io_opts {
+	size_t rx_size; //bytes asked of each recv
+	size_t tx_size; //bytes read from the file per echo send
+	int rcvbuf; //SO_RCVBUF for accepted sockets, 0 leaves kernel autotuning on
+	int sndbuf; //SO_SNDBUF for accepted sockets, 0 leaves kernel autotuning on
+	int autotune; //1 to start recvs at IO_AUTO_MIN and grow them with the packets seen
+};
+
+//a client handed over by the old process, started once the streams are open
+struct adopted {
+	int fd;
+	char host[NI_MAXHOST];
+};
+
+//what main is started with, from the command line and the config file
+struct settings {
+	const char* config; //-f file, NULL for none
+	char* config_buf; //holds the values read from it
+	char on_cmdline[128]; //options given on the command line, by getopt value
+	int daemonize;
+	int takeover; //1 for -t, 2 for -T (with the clients)
+	const char* specs[MAX_LISTENERS]; //-l addresses
+	int nspecs;
+	const char* ingest_path; //-i
+	const char* capture_path; //-c
+	struct store_opts sopts; //-s, -k and -S
+	struct repl_opts ropts; //-R and -F
+	int timestamp_s; //-I, 0 for none
+	int log_level; //-v, syslog priority
+	int pipe_batch; //-P batch=, published in pipe_batch
+	int pipe_depth; //-P depth=, published in pipe_depth
+	int drain_ms; //-w, published in drain_ms
+};
+
 //-------------------------GLOBALS-------------------------
 int caught_timer = 0;
+int caught_stats = 0; //SIGUSR1 asks for the pipeline metrics in syslog
+int caught_reload = 0; //SIGHUP asks for the config file to be read again
 int caught_sig = 0;
-int sfd; //make socket global for shutdown
+int lfds[MAX_LISTENERS]; //listening sockets, global for shutdown
+int nlfds = 0;
+int shutdown_efd = -1; //eventfd written once on shutdown to wake every worker
+//per-connection memory, only touched by main (start_thread/reap_thread)
+struct slab td_slab; //struct thread_data
+struct slab node_slab; //slist_thread_t
+struct buf_pool rx_pool; //receive buffers
+struct buf_pool tx_pool; //echo buffers
+struct io_opts io = { IO_BUF_SIZE, IO_BUF_SIZE, 0, 0, 0 };
+int use_char_device = USE_AESD_CHAR_DEVICE; //-B, the build picks the default
+const char* data_path = NULL; //-D, the backend's default (FILENAME) if not given
+int listen_backlog = BACKLOG; //-Q
+int drain_ms = SHUTDOWN_DEADLINE_MS; //-w
+atomic_int pipe_batch = PIPE_BATCH; //-P batch=, packets the storage stage commits together
+atomic_int pipe_depth = PIPE_CONN_DEPTH; //-P depth=, packets of one connection in flight
+//packet pipeline: receive (each connection) -> storage (a thread per stream) -> reply (each connection)
+struct stream_table streams; //the default stream and the named ones, each with its storage stage
+struct stage_stats recv_stats = { .name = "receive" }; //depth = packets in flight
+struct stage_stats store_stats = { .name = "storage" };
+struct stage_stats reply_stats = { .name = "reply" };
+struct capture capture; //-c trace of the packets clients send
+struct repl repl; //-R/-F replication of the store
+struct fanout fanout; //live tail subscribers, fed what is stored
+uint32_t conn_count = 0; //connections started, numbers them for the capture
 
 //-------------------------STRUCTS-------------------------
 /**
- * This structure should be dynamically allocated and passed as
- * an argument to your thread using pthread_create.
+ * This structure should be allocated from td_slab and passed as
+ * an argument to your thread using pthread_create. Its fields are
+ * grouped by the threads that write them, a cache line apart.
  * It should be returned by your thread so it can be freed by
  * the joiner thread.
  */
 struct thread_data{
+	//set up by main (or the connection's commands), read by every stage
 	pthread_mutex_t* m;
 	int nsfd; //file descriptor for the socket
-	int fd; //file descriptor for the written file
-	int complete_flag; //1 if success, -1 if failure, 0 if not complete
+	int fd; //file descriptor for the char device, -1 with the file backend
+	struct stream* stream; //where its packets go, the default one at first
+	struct store* st; //the stream's store, NULL with the char device
+	int compress; //1 if the client asked for compressed echoes
+	int ingest; //1 if nsfd is a shared memory producer's control connection
+	uint32_t id; //connection number in the capture
+	//receive side, written on every recv by the connection's thread
+	_Alignas(CACHE_LINE) char* rx; //received bytes not yet consumed as packets, from rx_pool
+	size_t rx_len;
+	size_t rx_cap;
+	size_t rx_want; //bytes asked of each recv
+	//polled by main, a line of their own so the polls don't stall the receives
+	_Alignas(CACHE_LINE) int complete_flag; //1 if success, -1 if failure, 0 if not complete
+	int idle_exit; //1 if stopped between packets for shutdown, socket still usable
+	//shared by the stages
+	_Alignas(CACHE_LINE) pthread_mutex_t pl_lock; //protects inflight, replies and scheduled
+	pthread_cond_t pl_cond; //signaled when a packet was echoed
+	int inflight; //packets handed to storage and not yet echoed
+	int failed; //1 once storing failed, the connection is shut down
+	struct pkt_list replies; //stored packets waiting for their echo
+	int scheduled; //1 while the reply scheduler holds the connection
+	//reply scheduler state, only touched by its thread
+	_Alignas(CACHE_LINE) STAILQ_ENTRY(thread_data) sched_link;
+	char* tx; //echo buffer of io.tx_size, from tx_pool
+	struct pkt* cur; //packet being echoed, NULL between echoes
+	off_t r_off; //next store offset to echo
+	int r_state; //REPLY_BODY, REPLY_TAIL or REPLY_DONE
+	char r_last; //last byte echoed
+	size_t r_pos; //tx[r_pos..r_len) is still to be sent
+	size_t r_len;
 	char host[NI_MAXHOST]; //to hold the hostname per socket
 };
 
@@ -76,6 +262,7 @@ struct slist_thread_s {
 	struct thread_data* td;
 	SLIST_ENTRY(slist_thread_s) entries;
 };
+SLIST_HEAD(slisthead, slist_thread_s);
 
 //-------------------------FUNCTIONS-------------------------
 /* THREADFUNC 
@@ -0,0 +1,392 @@
+/* Packet path micro-benchmarks
+ * Description:
+ *  Times the server's own functions outside a running server.
+ *  aesdsocket.c is compiled in with its main renamed, so these are the
+ *  real (static) functions; it is built for the file backend, which is
+ *  put in a temporary directory (on /dev/shm when there is one), and
+ *  clients are socketpairs, so it runs on any Linux host.
+ *   frame: read_packet framing a stream of packets, each handed to
+ *     the next stage and released right away
+ *   ioctl: do_ioctl on a seek command (to /dev/null, so the ioctl
+ *     itself fails fast) and on a plain packet, as the char device
+ *     path checks every packet
+ *   write: file_write from 1 to 64 threads at once
+ *   echo: the echo of a whole store (fill_line and send) by store size
+ *   share: threads bumping counters of their own, either packed side
+ *     by side or a cache line apart, as the connection fields main
+ *     polls were before struct thread_data was laid out by line
+ *  Threads are placed as the server's would be with the same -C and
+ *  -p (see place.h): the framing and echoing thread and the writers as
+ *  conn, the next stage as storage, the clients as other. Running it
+ *  with and without them shows what the placement buys.
+ *  One line per case:
+ *    frame size=BYTES pps=N mbps=N
+ *    ioctl kind=seekto|packet cps=N
+ *    write threads=N size=BYTES wps=N mbps=N
+ *    echo store=BYTES mbps=N ms=N
+ *    share threads=N layout=packed|lines mops=N
+ *  Usage: ./aesdBench [-C role=cpus]... [-p role=prio]... [seconds per case, default 1]
+ */
+
+#define main aesdsocket_main
+#include "aesdsocket.c"
+#undef main
+
+#define BENCH_WRITE_SIZE 64 //bytes per file_write
+#define BENCH_MAX_THREADS 64
+#define BENCH_SHARE_THREADS 4 //most threads in the share case
+
+static double secs = 1; //per case
+static char dir[64]; //temporary store directory
+static atomic_int stop;
+static struct stream bench_stream; //only its queue, framed packets go there
+
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//fills buf with lines of len bytes, the last byte of each a newline
+static void make_lines(char* buf, size_t total, size_t len) {
+	for(size_t i = 0; i < total; i++)
+		buf[i] = (i + 1) % len == 0 ? '\n' : 'a' + i % 26;
+}
+
+//opens a fresh store in the temporary directory
+static int bench_store(struct store* st, const struct store_opts* opts) {
+	char path[128];
+	snprintf(path, sizeof path, "%s/data", dir);
+	return store_open(st, path, opts);
+}
+
+//a connection on socket fd writing to st
+static struct thread_data* bench_conn(int fd, struct store* st) {
+	struct thread_data* td = aligned_alloc(CACHE_LINE, sizeof *td);
+	if(!td) return NULL;
+	memset(td, 0, sizeof *td);
+	td->nsfd = fd;
+	td->fd = -1;
+	td->stream = &bench_stream;
+	td->st = st;
+	td->rx_cap = 2 * io.rx_size + 1;
+	td->rx_want = io.rx_size;
+	td->rx = malloc(td->rx_cap);
+	td->tx = malloc(io.tx_size);
+	pthread_mutex_init(&td->pl_lock, NULL);
+	pthread_cond_init(&td->pl_cond, NULL);
+	STAILQ_INIT(&td->replies);
+	if(!td->rx || !td->tx) return NULL;
+	return td;
+}
+
+static void free_conn(struct thread_data* td) {
+	pthread_cond_destroy(&td->pl_cond);
+	pthread_mutex_destroy(&td->pl_lock);
+	free(td->rx);
+	free(td->tx);
+	free(td);
+}
+
+//-------------------------FRAME-------------------------
+struct feeder {
+	int fd;
+	const char* data;
+	size_t len;
+};
+
+//client side: sends the same packets over and over until the socket closes
+static void* feed(void* arg) {
+	struct feeder* f = arg;
+	place_thread(PLACE_OTHER);
+	while(send_all(f->fd, f->data, f->len) == 0);
+	return NULL;
+}
+
+//next stage: releases each packet like an echo that is done
+static void* release(void* arg) {
+	struct pkt* batch[PIPE_BATCH];
+	size_t n;
+	place_thread(PLACE_STORAGE);
+	while((n = pkt_queue_pop(&bench_stream.q, batch, PIPE_BATCH)) > 0) {
+		for(size_t i = 0; i < n; i++) {
+			struct thread_data* tdp = batch[i]->conn;
+			tdp->cur = batch[i];
+			reply_done(tdp);
+		}
+	}
+	return NULL;
+}
+
+static int bench_frame(size_t size) {
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return -1;
+	size_t len = (1 << 20) / size * size;
+	char* data = malloc(len);
+	struct thread_data* tdp = bench_conn(sv[0], NULL);
+	if(!data || !tdp) return -1;
+	make_lines(data, len, size);
+	
+	pkt_queue_init(&bench_stream.q, PIPE_STORE_DEPTH, &store_stats);
+	struct feeder f = { sv[1], data, len };
+	pthread_t feeder, releaser;
+	pthread_create(&feeder, NULL, feed, &f);
+	pthread_create(&releaser, NULL, release, NULL);
+	
+	unsigned long pkts = 0;
+	double t0 = now_s(), t;
+	do {
+		for(int i = 0; i < 256; i++) {
+			if(read_packet(tdp) != 1) {
+				printf("frame size=%zu error=read_packet\n", size);
+				return -1;
+			}
+		}
+		pkts += 256;
+	} while((t = now_s() - t0) < secs);
+	
+	//closing our end fails the feeder's send, then nothing is left in flight
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(feeder, NULL);
+	wait_inflight(tdp, 0);
+	pkt_queue_close(&bench_stream.q);
+	pthread_join(releaser, NULL);
+	pkt_queue_destroy(&bench_stream.q);
+	close(sv[0]);
+	close(sv[1]);
+	free_conn(tdp);
+	free(data);
+	printf("frame size=%zu pps=%.0f mbps=%.1f\n", size, pkts / t, pkts * size / t / 1e6);
+	return 0;
+}
+
+//-------------------------IOCTL-------------------------
+static int bench_ioctl(const char* kind, const char* cmd) {
+	int fd = open("/dev/null", O_RDWR);
+	if(fd == -1) return -1;
+	char buf[128];
+	size_t len = strlen(cmd);
+	unsigned long n = 0;
+	double t0 = now_s(), t;
+	do {
+		for(int i = 0; i < 1024; i++) {
+			memcpy(buf, cmd, len + 1); //strtok writes into it
+			do_ioctl(fd, buf, len);
+		}
+		n += 1024;
+	} while((t = now_s() - t0) < secs);
+	close(fd);
+	printf("ioctl kind=%s cps=%.0f\n", kind, n / t);
+	return 0;
+}
+
+//-------------------------WRITE-------------------------
+struct writer {
+	pthread_t thread;
+	struct thread_data td;
+	unsigned long n;
+};
+
+static pthread_barrier_t go;
+
+static void* write_loop(void* arg) {
+	struct writer* w = arg;
+	char data[BENCH_WRITE_SIZE];
+	make_lines(data, sizeof data, sizeof data);
+	place_thread(PLACE_CONN);
+	pthread_barrier_wait(&go);
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		if(file_write(&w->td, data, sizeof data) != 0) break;
+		w->n++;
+	}
+	return NULL;
+}
+
+static int bench_write(int threads) {
+	//rotating segments keep the store's size bounded however fast it goes
+	struct store st;
+	struct store_opts opts;
+	memset(&opts, 0, sizeof opts);
+	opts.seg_size = 16 << 20;
+	opts.ret_segs = 2;
+	if(bench_store(&st, &opts) != 0) return -1;
+	
+	struct writer w[BENCH_MAX_THREADS];
+	memset(w, 0, sizeof w);
+	atomic_store(&stop, 0);
+	pthread_barrier_init(&go, NULL, threads + 1);
+	for(int i = 0; i < threads; i++) {
+		w[i].td.st = &st;
+		w[i].td.fd = -1;
+		pthread_create(&w[i].thread, NULL, write_loop, &w[i]);
+	}
+	pthread_barrier_wait(&go);
+	double t0 = now_s();
+	usleep(secs * 1e6);
+	atomic_store(&stop, 1);
+	unsigned long n = 0;
+	for(int i = 0; i < threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		n += w[i].n;
+	}
+	double t = now_s() - t0;
+	pthread_barrier_destroy(&go);
+	store_close(&st, 1);
+	printf("write threads=%d size=%d wps=%.0f mbps=%.1f\n", threads, BENCH_WRITE_SIZE, n / t, n * BENCH_WRITE_SIZE / t / 1e6);
+	return 0;
+}
+
+//-------------------------ECHO-------------------------
+//client side: reads and drops everything echoed
+static void* drain(void* arg) {
+	int fd = *(int*)arg;
+	char buf[65536];
+	place_thread(PLACE_OTHER);
+	while(recv(fd, buf, sizeof buf, 0) > 0);
+	return NULL;
+}
+
+static int bench_echo(size_t size) {
+	struct store st;
+	struct store_opts opts;
+	memset(&opts, 0, sizeof opts);
+	if(bench_store(&st, &opts) != 0) return -1;
+	char* lines = malloc(1 << 20);
+	if(!lines) return -1;
+	make_lines(lines, 1 << 20, BENCH_WRITE_SIZE);
+	for(size_t left = size; left; ) {
+		size_t n = left < (1 << 20) ? left : (1 << 20);
+		if(store_write(&st, lines, n) == -1) return -1;
+		left -= n;
+	}
+	free(lines);
+	
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return -1;
+	struct thread_data* tdp = bench_conn(sv[0], &st);
+	if(!tdp) return -1;
+	pthread_t drainer;
+	pthread_create(&drainer, NULL, drain, &sv[1]);
+	
+	struct pkt p;
+	memset(&p, 0, sizeof p);
+	p.end = store_size(&st);
+	tdp->cur = &p;
+	unsigned long echoes = 0;
+	double t0 = now_s(), t;
+	do {
+		tdp->r_off = store_start(&st);
+		tdp->r_state = REPLY_BODY;
+		tdp->r_last = 0;
+		int rc;
+		while((rc = fill_line(tdp)) == 1)
+			if(send_all(tdp->nsfd, tdp->tx, tdp->r_len) != 0) return -1;
+		if(rc == -1) return -1;
+		echoes++;
+	} while((t = now_s() - t0) < secs);
+	
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(drainer, NULL);
+	close(sv[0]);
+	close(sv[1]);
+	free_conn(tdp);
+	store_close(&st, 1);
+	printf("echo store=%zu mbps=%.1f ms=%.3f\n", size, echoes * size / t / 1e6, t * 1e3 / echoes);
+	return 0;
+}
+
+//-------------------------SHARE-------------------------
+//a counter every stride bytes, stride 8 packs them into one line
+struct sharer {
+	pthread_t thread;
+	volatile unsigned long* n;
+};
+
+static void* share_loop(void* arg) {
+	struct sharer* sh = arg;
+	place_thread(PLACE_CONN);
+	pthread_barrier_wait(&go);
+	while(!atomic_load_explicit(&stop, memory_order_relaxed))
+		for(int i = 0; i < 1024; i++) (*sh->n)++;
+	return NULL;
+}
+
+static int bench_share(int threads, size_t stride) {
+	char* lines = aligned_alloc(CACHE_LINE, BENCH_SHARE_THREADS * CACHE_LINE);
+	if(!lines) return -1;
+	memset(lines, 0, BENCH_SHARE_THREADS * CACHE_LINE);
+	struct sharer sh[BENCH_SHARE_THREADS];
+	atomic_store(&stop, 0);
+	pthread_barrier_init(&go, NULL, threads + 1);
+	for(int i = 0; i < threads; i++) {
+		sh[i].n = (volatile unsigned long*)(lines + i * stride);
+		pthread_create(&sh[i].thread, NULL, share_loop, &sh[i]);
+	}
+	pthread_barrier_wait(&go);
+	double t0 = now_s();
+	usleep(secs * 1e6);
+	atomic_store(&stop, 1);
+	unsigned long n = 0;
+	for(int i = 0; i < threads; i++) {
+		pthread_join(sh[i].thread, NULL);
+		n += *sh[i].n;
+	}
+	double t = now_s() - t0;
+	pthread_barrier_destroy(&go);
+	free(lines);
+	printf("share threads=%d layout=%s mops=%.1f\n", threads, stride < CACHE_LINE ? "packed" : "lines", n / t / 1e6);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	openlog("aesdBench", 0, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING)); //the debug logging isn't what is measured
+	place_init();
+	int opt;
+	while((opt = getopt(argc, argv, "C:p:")) != -1) {
+		if((opt == 'C' && place_parse_cpus(optarg) == 0) || (opt == 'p' && place_parse_prio(optarg) == 0))
+			continue;
+		secs = 0;
+	}
+	if(optind < argc) secs = atof(argv[optind]);
+	if(secs <= 0) {
+		fprintf(stderr, "Usage: %s [-C role=cpus]... [-p role=prio]... [seconds per case]\n", argv[0]);
+		return 1;
+	}
+	place_thread(PLACE_CONN);
+	
+	snprintf(dir, sizeof dir, "/dev/shm/aesdbench.XXXXXX");
+	if(!mkdtemp(dir)) {
+		snprintf(dir, sizeof dir, "/tmp/aesdbench.XXXXXX");
+		if(!mkdtemp(dir)) {
+			perror("mkdtemp");
+			return 1;
+		}
+	}
+	
+	int result = 0;
+	const size_t frames[] = { 64, 1024, 16384, 262144 };
+	for(size_t i = 0; !result && i < sizeof frames / sizeof frames[0]; i++)
+		result = bench_frame(frames[i]);
+	
+	if(!result) result = bench_ioctl("seekto", IOCTL_CMD ":3,12\n");
+	if(!result) result = bench_ioctl("packet", "an ordinary packet of data\n");
+	
+	for(int n = 1; !result && n <= BENCH_MAX_THREADS; n *= 2)
+		result = bench_write(n);
+	
+	const size_t stores[] = { 1 << 16, 1 << 20, 16 << 20 };
+	for(size_t i = 0; !result && i < sizeof stores / sizeof stores[0]; i++)
+		result = bench_echo(stores[i]);
+	
+	for(int n = 2; !result && n <= BENCH_SHARE_THREADS; n *= 2) {
+		result = bench_share(n, sizeof(unsigned long));
+		if(!result) result = bench_share(n, CACHE_LINE);
+	}
+	
+	pkt_pool_destroy();
+	rmdir(dir);
+	closelog();
+	if(result) fprintf(stderr, "benchmark failed\n");
+	return result ? 1 : 0;
+}
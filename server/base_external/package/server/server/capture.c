@@ -0,0 +1,81 @@
+/* Traffic capture
+ * Description:
+ *  Writes the trace described in capture.h. Connections append under
+ *  one mutex into a large stdio buffer, so capturing costs a memcpy
+ *  per packet and a write per CAPTURE_BUF_SIZE bytes.
+ */
+
+#include "capture.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+int capture_open(struct capture* cap, const char* path) {
+	memset(cap, 0, sizeof *cap);
+	cap->f = fopen(path, "w");
+	if(!cap->f) {
+		syslog(LOG_ERR, "Failed to open capture %s:%m\n", path);
+		return -1;
+	}
+	cap->buf = malloc(CAPTURE_BUF_SIZE);
+	if(cap->buf) setvbuf(cap->f, cap->buf, _IOFBF, CAPTURE_BUF_SIZE);
+	
+	struct capture_header h;
+	struct timespec now;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, CAPTURE_MAGIC, sizeof h.magic);
+	h.version = CAPTURE_VERSION;
+	clock_gettime(CLOCK_REALTIME, &now);
+	h.start = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	if(fwrite(&h, sizeof h, 1, cap->f) != 1) {
+		syslog(LOG_ERR, "Failed to write capture %s:%m\n", path);
+		fclose(cap->f);
+		free(cap->buf);
+		cap->f = NULL;
+		cap->buf = NULL;
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &cap->start);
+	pthread_mutex_init(&cap->lock, NULL);
+	cap->on = 1;
+	syslog(LOG_INFO, "Capturing traffic to %s\n", path);
+	return 0;
+}
+
+void capture_packet(struct capture* cap, uint32_t conn, const char* data, size_t len) {
+	if(!cap->on) return; //only main opens and closes it, around the workers
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct capture_record r;
+	r.t = (now.tv_sec - cap->start.tv_sec) * 1000000000LL + (now.tv_nsec - cap->start.tv_nsec);
+	r.conn = conn;
+	r.len = len;
+	
+	pthread_mutex_lock(&cap->lock);
+	if(cap->f) {
+		if(fwrite(&r, sizeof r, 1, cap->f) == 1 && (!len || fwrite(data, len, 1, cap->f) == 1))
+			cap->records++;
+		else {
+			syslog(LOG_ERR, "Failed to write capture, stopping it:%m\n");
+			fclose(cap->f);
+			cap->f = NULL;
+		}
+	}
+	pthread_mutex_unlock(&cap->lock);
+}
+
+void capture_close(struct capture* cap) {
+	if(!cap->on) return;
+	cap->on = 0;
+	pthread_mutex_lock(&cap->lock);
+	if(cap->f && fclose(cap->f) != 0)
+		syslog(LOG_ERR, "Failed to finish capture:%m\n");
+	cap->f = NULL;
+	pthread_mutex_unlock(&cap->lock);
+	syslog(LOG_INFO, "Captured %lu records\n", cap->records);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap->buf);
+	cap->buf = NULL;
+}
@@ -0,0 +1,80 @@
+/*
+ * capture.h
+ *
+ *  Traffic capture for offline replay. With -c every framed packet
+ *  a client sends (commands included) is appended to a binary trace
+ *  with the time it was framed and the connection it came on, and the
+ *  end of each connection is marked. The replay tool in the client
+ *  package drives a server with such a trace.
+ *
+ *  Trace layout, host byte order:
+ *   struct capture_header
+ *   then per packet a struct capture_record followed by len bytes,
+ *   len 0 marking that the connection was closed
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+//-------------------------INCLUDES-------------------------
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+//-------------------------DEFINES-------------------------
+#define CAPTURE_MAGIC "AZTR"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUF_SIZE (1 << 20) //stdio buffer, so packets don't cost a write each
+
+//-------------------------STRUCTS-------------------------
+struct capture_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t start; //CLOCK_REALTIME at the start of the capture, ns
+};
+
+struct capture_record {
+	uint64_t t; //ns since the start of the capture
+	uint32_t conn; //connection number, in accept order from 1
+	uint32_t len; //packet bytes that follow, 0 when the connection closed
+};
+
+struct capture {
+	int on; //1 from capture_open to capture_close
+	pthread_mutex_t lock; //orders records from all connections
+	FILE* f; //NULL after a write error
+	char* buf;
+	struct timespec start; //CLOCK_MONOTONIC
+	unsigned long records;
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* CAPTURE_OPEN
+ * Description: starts a trace at path, replacing any file there
+ * Input:
+ *  cap = capture to set up
+ *  path = trace file
+ * Output: 0 on success, -1 on error
+ */
+int capture_open(struct capture* cap, const char* path);
+
+/* CAPTURE_PACKET
+ * Description: appends a packet, or the end of a connection, to the
+ *   trace. Does nothing if the capture isn't open; a write error is
+ *   logged once and ends the capture.
+ * Input:
+ *  cap = capture
+ *  conn = connection number
+ *  data, len = packet, len 0 for the end of the connection
+ * Output: N/A
+ */
+void capture_packet(struct capture* cap, uint32_t conn, const char* data, size_t len);
+
+/* CAPTURE_CLOSE
+ * Description: flushes and closes the trace
+ * Input: cap = capture
+ * Output: N/A
+ */
+void capture_close(struct capture* cap);
+
+#endif /* CAPTURE_H_ */
@@ -0,0 +1,99 @@
+/* Configuration file
+ * Description:
+ *  The file is read whole into one buffer and cut into keys and values
+ *  in place, so the values stay valid for as long as the caller keeps
+ *  the buffer (the listen addresses and paths are kept until exit).
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//strips blanks from both ends of s, in place
+static char* trim(char* s) {
+	while(isspace((unsigned char)*s)) s++;
+	char* end = s + strlen(s);
+	while(end > s && isspace((unsigned char)end[-1])) end--;
+	*end = '\0';
+	return s;
+}
+
+/* APPLY_LINE
+ * Description: applies one line, cut up in place
+ * Output: 0 if applied or blank, -1 on error (logged)
+ */
+static int apply_line(const char* path, int n, char* line, const struct option* opts, config_fn fn, void* arg) {
+	char* hash = strchr(line, '#');
+	if(hash) *hash = '\0';
+	char* eq = strchr(line, '=');
+	if(eq) *eq = '\0';
+	char* key = trim(line);
+	char* value = eq ? trim(eq + 1) : NULL;
+	if(*key == '\0' && !eq) return 0;
+
+	const struct option* o = opts;
+	while(o->name && strcmp(o->name, key) != 0) o++;
+	if(!o->name) {
+		syslog(LOG_ERR, "%s:%d: unknown option %s\n", path, n, key);
+		return -1;
+	}
+	if(o->has_arg == no_argument) {
+		if(value && strcmp(value, "no") == 0) return 0;
+		if(value && strcmp(value, "yes") != 0) {
+			syslog(LOG_ERR, "%s:%d: %s takes yes or no\n", path, n, key);
+			return -1;
+		}
+		value = NULL;
+	}
+	else if(!value || *value == '\0') {
+		syslog(LOG_ERR, "%s:%d: %s needs a value\n", path, n, key);
+		return -1;
+	}
+	if(fn(arg, o->val, value) != 0) {
+		syslog(LOG_ERR, "%s:%d: bad value for %s\n", path, n, key);
+		return -1;
+	}
+	return 0;
+}
+
+char* config_read(const char* path, const struct option* opts, config_fn fn, void* arg) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+	if(fd == -1 || fstat(fd, &sb) == -1) {
+		syslog(LOG_ERR, "Failed to open config %s:%m\n", path);
+		if(fd != -1) close(fd);
+		return NULL;
+	}
+	char* buf = malloc(sb.st_size + 1);
+	ssize_t len = buf ? read(fd, buf, sb.st_size) : -1;
+	close(fd);
+	if(len != sb.st_size) {
+		syslog(LOG_ERR, "Failed to read config %s:%m\n", path);
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+
+	char* line = buf;
+	for(int n = 1; line; n++) {
+		char* next = strchr(line, '\n');
+		if(next) *next++ = '\0';
+		if(strlen(line) >= CONFIG_LINE_MAX) {
+			syslog(LOG_ERR, "%s:%d: line too long\n", path, n);
+			free(buf);
+			return NULL;
+		}
+		if(apply_line(path, n, line, opts, fn, arg) != 0) {
+			free(buf);
+			return NULL;
+		}
+		line = next;
+	}
+	return buf;
+}
@@ -0,0 +1,45 @@
+/*
+ * config.h
+ *
+ *  Configuration file (-f): the command line's long options, one per
+ *  line, so a site can tune the server without rebuilding it:
+ *
+ *   # comment
+ *   sync = ms:100
+ *   listen = 9000
+ *   listen = unix:/run/aesd.sock
+ *   keep
+ *
+ *  A flag is named alone (or "= yes", "= no" to leave it off). Options
+ *  given on the command line win over the file. SIGHUP reads the file
+ *  again and applies the options that are safe to change while running,
+ *  all of them or none if a line is bad.
+ */
+
+#ifndef CONFIG_H_
+#define CONFIG_H_
+//-------------------------INCLUDES-------------------------
+#include <getopt.h>
+
+//-------------------------DEFINES-------------------------
+#define CONFIG_LINE_MAX 1024 //longest line read
+
+//-------------------------STRUCTS-------------------------
+//applies an option found in the file: its getopt value and argument
+//(NULL for a flag), 0 on success, -1 if the argument is bad
+typedef int (*config_fn)(void* arg, int opt, const char* value);
+
+//-------------------------FUNCTIONS-------------------------
+/* CONFIG_READ
+ * Description: reads a configuration file, calling fn for each option
+ *   in it, in order. Errors are logged with their line.
+ * Input:
+ *  path = file
+ *  opts = the command line's long options, ending with a zeroed one
+ *  fn, arg = called for each option
+ * Output: buffer the values passed to fn point into, for the caller to
+ *   free once done with them, NULL on error
+ */
+char* config_read(const char* path, const struct option* opts, config_fn fn, void* arg);
+
+#endif /* CONFIG_H_ */
@@ -0,0 +1,248 @@
+/* Fan-out
+ * Description:
+ *  Publishing is a copy into the ring and a store of the new head; the
+ *  thread is only woken through the eventfd when it sleeps (the same
+ *  handshake as replication: set waiting, recheck, sleep). Nothing a
+ *  subscriber does can make a writer wait.
+ *
+ *  The thread sends each subscriber at most FANOUT_SEND_MAX bytes a
+ *  turn, straight from the ring, with non-blocking sends, and polls
+ *  the ones whose socket buffers are full. The bytes of a subscriber
+ *  less than FANOUT_LAG behind can't be written over during a send
+ *  unless FANOUT_RING - FANOUT_LAG more are published meanwhile: a
+ *  publish claims its bytes before copying them in, like a seqlock,
+ *  and a subscriber that may have been sent claimed bytes is dropped
+ *  right after the send.
+ */
+
+#define _GNU_SOURCE
+#include "fanout.h"
+#include "trace.h"
+#include "place.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+//closes a subscriber and takes it out of the array
+static void drop(struct fanout* f, size_t i) {
+	close(f->subs[i].fd);
+	f->subs[i] = f->subs[--f->nsubs];
+	pthread_mutex_lock(&f->lock);
+	f->total--;
+	pthread_mutex_unlock(&f->lock);
+}
+
+//takes on the subscribers that joined since the last turn
+static void adopt(struct fanout* f) {
+	pthread_mutex_lock(&f->lock);
+	if(f->njoining) {
+		memcpy(f->subs + f->nsubs, f->joining, f->njoining * sizeof *f->joining);
+		f->nsubs += f->njoining;
+		f->njoining = 0;
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+/* FEED
+ * Description: sends a subscriber its next piece of the ring
+ * Input:
+ *  f = fan-out state
+ *  s = subscriber, behind head
+ *  head = fanout head read this turn
+ * Output: 1 if it can take more right away, 0 if not, -1 to drop it
+ */
+static int feed(struct fanout* f, struct subscriber* s, uint64_t head) {
+	size_t at = s->pos % FANOUT_RING;
+	size_t len = head - s->pos;
+	if(len > FANOUT_RING - at) len = FANOUT_RING - at;
+	if(len > FANOUT_SEND_MAX) len = FANOUT_SEND_MAX;
+	ssize_t n = send(s->fd, f->ring + at, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(n == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			s->blocked = 1;
+			return 0;
+		}
+		if(errno == EINTR) return 1;
+		return -1;
+	}
+	//written over while it was being sent?
+	atomic_thread_fence(memory_order_acquire);
+	if(atomic_load_explicit(&f->claimed, memory_order_relaxed) - s->pos > FANOUT_RING) return -1;
+	s->pos += n;
+	return s->pos < head;
+}
+
+/* FANOUT_THREAD
+ * Description: sends the ring on to the subscribers until stopped
+ */
+static void* fanout_thread(void* arg) {
+	struct fanout* f = arg;
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	TRACE_THREAD("fanout", 0);
+	place_thread(PLACE_OTHER);
+
+	struct pollfd* p = malloc((FANOUT_MAX_SUBS + 1) * sizeof *p);
+	char sink[512]; //what subscribers send is read and ignored
+	while(p && !atomic_load(&f->stop)) {
+		adopt(f);
+		uint64_t head = atomic_load_explicit(&f->head, memory_order_acquire);
+
+		//a turn of sends, dropping the subscribers too far behind
+		int busy = 0;
+		for(size_t i = 0; i < f->nsubs; ) {
+			struct subscriber* s = &f->subs[i];
+			int rc = 0;
+			if(head - s->pos > FANOUT_LAG) {
+				f->dropped++;
+				syslog(LOG_INFO, "Dropped a subscriber %llu bytes behind\n", (unsigned long long)(head - s->pos));
+				rc = -1;
+			}
+			else if(s->pos < head && !s->blocked) rc = feed(f, s, head);
+			if(rc == -1) {
+				drop(f, i);
+				continue;
+			}
+			busy |= rc;
+			i++;
+		}
+
+		//sleep until a publish unless someone can take more, with the
+		//head rechecked after saying so
+		if(!busy) {
+			atomic_store(&f->waiting, 1);
+			if(atomic_load(&f->head) != head) {
+				atomic_store(&f->waiting, 0);
+				continue;
+			}
+		}
+		p[0].fd = f->efd;
+		p[0].events = POLLIN;
+		for(size_t i = 0; i < f->nsubs; i++) {
+			p[i + 1].fd = f->subs[i].fd;
+			p[i + 1].events = f->subs[i].blocked ? POLLIN | POLLOUT : POLLIN;
+		}
+		int rc = poll(p, f->nsubs + 1, busy ? 0 : -1);
+		atomic_store(&f->waiting, 0);
+		if(rc == -1 && errno != EINTR) {
+			syslog(LOG_ERR, "Failed to poll subscribers:%m\n");
+			break;
+		}
+		if(rc <= 0) continue;
+		if(p[0].revents) {
+			uint64_t n;
+			read(f->efd, &n, sizeof n);
+		}
+		//backwards, so dropping one doesn't move those still to look at
+		for(size_t i = f->nsubs; i-- > 0; ) {
+			short ev = p[i + 1].revents;
+			if(ev & POLLOUT) f->subs[i].blocked = 0;
+			if(ev & POLLIN) {
+				ssize_t n = recv(f->subs[i].fd, sink, sizeof sink, MSG_DONTWAIT);
+				if(n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) ev |= POLLHUP;
+			}
+			if(ev & (POLLERR | POLLHUP | POLLNVAL)) drop(f, i);
+		}
+	}
+	free(p);
+	while(f->nsubs) drop(f, f->nsubs - 1);
+	return NULL;
+}
+
+int fanout_open(struct fanout* f) {
+	memset(f, 0, sizeof *f);
+	pthread_mutex_init(&f->lock, NULL);
+	f->ring = malloc(FANOUT_RING);
+	f->subs = malloc(FANOUT_MAX_SUBS * sizeof *f->subs);
+	f->joining = malloc(FANOUT_MAX_SUBS * sizeof *f->joining);
+	f->efd = eventfd(0, EFD_CLOEXEC);
+	if(!f->ring || !f->subs || !f->joining || f->efd == -1) {
+		syslog(LOG_ERR, "Failed to set up the fan-out:%m\n");
+		fanout_close(f);
+		return -1;
+	}
+	if(pthread_create(&f->thread, NULL, fanout_thread, f) != 0) {
+		syslog(LOG_ERR, "Failed to create fan-out thread.\n");
+		fanout_close(f);
+		return -1;
+	}
+	f->running = 1;
+	return 0;
+}
+
+void fanout_publish(struct fanout* f, const char* data, size_t len) {
+	uint64_t head = atomic_load_explicit(&f->head, memory_order_relaxed);
+	if(len > FANOUT_RING) { //only the end of it can be kept
+		head += len - FANOUT_RING;
+		data += len - FANOUT_RING;
+		len = FANOUT_RING;
+	}
+	atomic_store_explicit(&f->claimed, head + len, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release); //claimed before the bytes, see feed
+	size_t at = head % FANOUT_RING;
+	size_t first = len < FANOUT_RING - at ? len : FANOUT_RING - at;
+	memcpy(f->ring + at, data, first);
+	memcpy(f->ring, data + first, len - first);
+	atomic_store_explicit(&f->head, head + len, memory_order_release);
+
+	uint64_t one = 1;
+	atomic_thread_fence(memory_order_seq_cst); //the new head before waiting, see fanout_thread
+	if(atomic_load_explicit(&f->waiting, memory_order_relaxed) && atomic_exchange(&f->waiting, 0))
+		write(f->efd, &one, sizeof one);
+}
+
+int fanout_subscribe(struct fanout* f, int fd, uint64_t pos) {
+	pthread_mutex_lock(&f->lock);
+	int ok = f->running && f->total < FANOUT_MAX_SUBS;
+	if(ok) {
+		f->joining[f->njoining++] = (struct subscriber){ fd, pos, 0 };
+		f->total++;
+	}
+	pthread_mutex_unlock(&f->lock);
+	if(!ok) {
+		syslog(LOG_ERR, "ERROR: subscriber refused, %d at most.\n", FANOUT_MAX_SUBS);
+		close(fd);
+		return -1;
+	}
+	uint64_t one = 1;
+	write(f->efd, &one, sizeof one);
+	return 0;
+}
+
+uint64_t fanout_head(struct fanout* f) {
+	return atomic_load_explicit(&f->head, memory_order_acquire);
+}
+
+void fanout_close(struct fanout* f) {
+	uint64_t one = 1;
+	atomic_store(&f->stop, 1);
+	if(f->running) {
+		write(f->efd, &one, sizeof one);
+		pthread_join(f->thread, NULL);
+	}
+	pthread_mutex_lock(&f->lock);
+	f->running = 0;
+	while(f->njoining) close(f->joining[--f->njoining].fd);
+	pthread_mutex_unlock(&f->lock);
+	if(f->efd != -1) close(f->efd);
+	f->efd = -1;
+	free(f->ring);
+	free(f->subs);
+	free(f->joining);
+	f->ring = NULL;
+	f->subs = f->joining = NULL;
+	pthread_mutex_destroy(&f->lock);
+}
@@ -0,0 +1,108 @@
+/*
+ * fanout.h
+ *
+ *  Live tail: "AESD_SUBSCRIBE\n" turns a connection into a subscriber,
+ *  answered with "AESD_SUBSCRIBE:ok\n" and from then on sent every
+ *  record stored after it, as it is stored, instead of echoes. Whatever
+ *  it sends afterwards is ignored. Only the default stream is carried,
+ *  a connection on a named stream is answered ":error".
+ *
+ *  Stored records are copied once into a shared ring, whatever the
+ *  backend, and one thread sends them on from there to every
+ *  subscriber, each with its own cursor into the ring. A subscriber
+ *  that falls FANOUT_LAG bytes behind the newest record is dropped
+ *  (disconnected) so it never holds up the writers or the others.
+ */
+
+#ifndef FANOUT_H_
+#define FANOUT_H_
+//-------------------------INCLUDES-------------------------
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//-------------------------DEFINES-------------------------
+#define FANOUT_RING (1 << 20) //bytes of the newest records kept for subscribers, a power of 2
+#define FANOUT_LAG (FANOUT_RING / 2) //a subscriber this far behind is dropped
+#define FANOUT_SEND_MAX 65536 //bytes sent to one subscriber per turn
+#define FANOUT_MAX_SUBS 1024 //subscribers at once, more are refused
+#define SUBSCRIBE_CMD "AESD_SUBSCRIBE" //answered with "AESD_SUBSCRIBE:ok\n" or ":error"
+#define SUBSCRIBE_CMD_L 14
+
+//-------------------------STRUCTS-------------------------
+struct subscriber {
+	int fd;
+	uint64_t pos; //next byte to send, counted like fanout.head
+	int blocked; //1 while its socket buffer is full
+};
+
+struct fanout {
+	char* ring; //byte n of the records at ring[n % FANOUT_RING]
+	_Atomic uint64_t head; //bytes published, ever
+	_Atomic uint64_t claimed; //head plus the bytes being copied in
+	int efd; //publishing, subscribing and stopping wake the thread
+	atomic_int waiting; //1 while the thread sleeps on efd
+	atomic_int stop;
+
+	//subscribers not yet taken on by the thread, under lock
+	pthread_mutex_t lock;
+	struct subscriber* joining;
+	size_t njoining;
+	size_t total; //subscribers joining or served
+
+	//only touched by the thread
+	struct subscriber* subs;
+	size_t nsubs;
+	unsigned long dropped; //subscribers dropped for falling behind
+
+	pthread_t thread;
+	int running;
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* FANOUT_OPEN
+ * Description: allocates the ring and starts the sending thread
+ * Input: f = fan-out state
+ * Output: 0 on success, -1 on error
+ */
+int fanout_open(struct fanout* f);
+
+/* FANOUT_PUBLISH
+ * Description: copies stored records into the ring for the subscribers,
+ *   waking the thread if it sleeps. Calls must be serialized, in the
+ *   order the records were stored (the store's append lock or the
+ *   char device's mutex), and must not be made before fanout_open.
+ * Input:
+ *  f = fan-out state
+ *  data, len = whole records just stored
+ * Output: N/A
+ */
+void fanout_publish(struct fanout* f, const char* data, size_t len);
+
+/* FANOUT_SUBSCRIBE
+ * Description: hands a connection over to the thread, which sends it
+ *   the records published from pos on and closes it when done
+ * Input:
+ *  f = fan-out state
+ *  fd = connection, taken over (closed here on failure)
+ *  pos = fanout_head() before the connection was told it subscribed
+ * Output: 0 on success, -1 if refused
+ */
+int fanout_subscribe(struct fanout* f, int fd, uint64_t pos);
+
+/* FANOUT_HEAD
+ * Description: where the next record published starts
+ * Input: f = fan-out state
+ * Output: bytes published so far
+ */
+uint64_t fanout_head(struct fanout* f);
+
+/* FANOUT_CLOSE
+ * Description: stops the thread and disconnects every subscriber
+ * Input: f = fan-out state
+ * Output: N/A
+ */
+void fanout_close(struct fanout* f);
+
+#endif /* FANOUT_H_ */
@@ -0,0 +1,176 @@
+/* Socket handoff
+ * Description:
+ *  A running aesdsocket listens on HANDOFF_PATH. A new aesdsocket started
+ *  with -t connects there and is sent the listening socket, so connections
+ *  keep queueing on the same socket while the old process drains.
+ *  With -T the old process also sends every client that went idle while
+ *  draining, so those connections survive the upgrade too.
+ *
+ *  Each message is a type byte and a peer name, with the fd as SCM_RIGHTS
+ *  ancillary data. Only processes of our own user are served, checked
+ *  with SO_PEERCRED, since they are given live sockets.
+ */
+
+#define _GNU_SOURCE
+#include "handoff.h"
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct handoff_msg {
+	char type;
+	char host[NI_MAXHOST];
+};
+
+//fills in a sockaddr_un, -1 if the path does not fit
+static int handoff_addr(const char* path, struct sockaddr_un* addr) {
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof addr->sun_path) {
+		syslog(LOG_ERR, "Handoff path too long:%s\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int handoff_listen(const char* path) {
+	struct sockaddr_un addr;
+	if(handoff_addr(path, &addr) != 0) return -1;
+	
+	int hfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(hfd == -1) {
+		syslog(LOG_ERR, "failed to create handoff socket:%m\n");
+		return -1;
+	}
+	unlink(path); //stale from a crash, or the old server's we just took over
+	if(bind(hfd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+		syslog(LOG_ERR, "Failed to bind handoff socket %s:%m\n", path);
+		close(hfd);
+		return -1;
+	}
+	if(listen(hfd, 1) != 0) {
+		syslog(LOG_ERR, "Failed to listen on handoff socket:%m\n");
+		close(hfd);
+		return -1;
+	}
+	return hfd;
+}
+
+int handoff_accept(int lsock) {
+	int sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+	if(sock == -1) {
+		syslog(LOG_ERR, "handoff accept fail:%m\n");
+		return -1;
+	}
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+	if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		syslog(LOG_ERR, "Failed to get handoff peer credentials:%m\n");
+		close(sock);
+		return -1;
+	}
+	if(cred.uid != geteuid()) {
+		syslog(LOG_ERR, "Refused handoff to pid %d of uid %u\n", (int)cred.pid, (unsigned)cred.uid);
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int handoff_connect(const char* path) {
+	struct sockaddr_un addr;
+	if(handoff_addr(path, &addr) != 0) return -1;
+	
+	int hfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(hfd == -1) {
+		syslog(LOG_ERR, "failed to create handoff socket:%m\n");
+		return -1;
+	}
+	if(connect(hfd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+		syslog(LOG_DEBUG, "No server to take over at %s:%m\n", path);
+		close(hfd);
+		return -1;
+	}
+	return hfd;
+}
+
+int handoff_send(int sock, char type, int fd, const char* host) {
+	struct handoff_msg msg;
+	memset(&msg, 0, sizeof msg);
+	msg.type = type;
+	if(host) strncpy(msg.host, host, NI_MAXHOST - 1);
+	
+	struct iovec iov = { &msg, sizeof msg };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr mh;
+	memset(&mh, 0, sizeof mh);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if(fd != -1) {
+		memset(&ctl, 0, sizeof ctl);
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = sizeof ctl.buf;
+		struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+	
+	ssize_t rc;
+	do {
+		rc = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while(rc == -1 && errno == EINTR);
+	if(rc != sizeof msg) {
+		syslog(LOG_ERR, "Failed to send handoff message:%m\n");
+		return -1;
+	}
+	return 0;
+}
+
+int handoff_recv(int sock, char* type, char* host, size_t hostlen) {
+	struct handoff_msg msg;
+	struct iovec iov = { &msg, sizeof msg };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr mh;
+	memset(&mh, 0, sizeof mh);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof ctl.buf;
+	
+	ssize_t rc;
+	do {
+		rc = recvmsg(sock, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	} while(rc == -1 && errno == EINTR);
+	if(rc == -1) {
+		syslog(LOG_ERR, "Failed to receive handoff message:%m\n");
+		return -2;
+	}
+	if(rc != sizeof msg) return -2; //closed by the other side
+	
+	int fd = -1;
+	for(struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+		if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	}
+	*type = msg.type;
+	if(host && hostlen) {
+		msg.host[NI_MAXHOST - 1] = '\0';
+		strncpy(host, msg.host, hostlen - 1);
+		host[hostlen - 1] = '\0';
+	}
+	return fd;
+}
@@ -0,0 +1,74 @@
+/*
+ * handoff.h
+ *
+ *  Passing open sockets between an old and a new aesdsocket
+ *  over a Unix domain socket (SCM_RIGHTS), for restarts that
+ *  never close the listening socket. The old process keeps the
+ *  connection until it has drained and closed its stores, and the
+ *  new one only opens them once told so with HANDOFF_END.
+ */
+
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+//-------------------------INCLUDES-------------------------
+#include <stddef.h>
+
+//-------------------------DEFINES-------------------------
+#define HANDOFF_PATH "/var/run/aesdsocket.handoff"
+
+//message types, one fd travels with each except HANDOFF_END
+#define HANDOFF_LISTENER 'L' //the listening socket
+#define HANDOFF_CLIENT   'C' //an accepted client, idle between packets
+#define HANDOFF_END      'E' //no more sockets follow and the sender's stores are closed
+
+//request types sent by the new process right after connecting
+#define HANDOFF_REQ_LISTENER 'l' //listening socket only
+#define HANDOFF_REQ_ALL      'a' //listening socket and live clients
+
+//-------------------------FUNCTIONS-------------------------
+/* HANDOFF_LISTEN
+ * Description: binds and listens on the handoff Unix socket,
+ *   replacing any socket file already at path.
+ * Input: path = filesystem path of the socket
+ * Output: listening socket, or -1 on error
+ */
+int handoff_listen(const char* path);
+
+/* HANDOFF_ACCEPT
+ * Description: accepts a connection on the handoff socket, refusing
+ *   peers that don't run as our effective uid
+ * Input: lsock = socket from handoff_listen
+ * Output: connected socket, or -1 on error or a refused peer
+ */
+int handoff_accept(int lsock);
+
+/* HANDOFF_CONNECT
+ * Description: connects to a running server's handoff socket
+ * Input: path = filesystem path of the socket
+ * Output: connected socket, or -1 if no server is listening
+ */
+int handoff_connect(const char* path);
+
+/* HANDOFF_SEND
+ * Description: sends one message, with fd attached unless fd is -1
+ * Input:
+ *  sock = connected handoff socket
+ *  type = message type
+ *  fd = file descriptor to pass, or -1
+ *  host = NUL-terminated peer name sent along with the fd (may be NULL)
+ * Output: 0 on success, -1 on error
+ */
+int handoff_send(int sock, char type, int fd, const char* host);
+
+/* HANDOFF_RECV
+ * Description: receives one message
+ * Input:
+ *  sock = connected handoff socket
+ *  type = set to the message type
+ *  host = buffer for the peer name, hostlen bytes long
+ * Output: received fd (-1 if none was attached),
+ *   -2 on error or when the peer closed the connection
+ */
+int handoff_recv(int sock, char* type, char* host, size_t hostlen);
+
+#endif /* HANDOFF_H_ */
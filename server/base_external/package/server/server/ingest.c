@@ -0,0 +1,236 @@
+/* Shared memory ingestion
+ * Description:
+ *  The ring is a memfd of one header page followed by the records.
+ *  Each side maps the header, then the records twice in a row (with
+ *  MAP_FIXED over a reserved range) so that head & (size - 1) always
+ *  starts a contiguous run of up to size bytes.
+ *  The producer owns head and the server owns tail; each publishes its
+ *  own with a release store and reads the other's with an acquire load.
+ *  Records are only ever published whole, so the server can hand the
+ *  whole tail..head range to the sink at once.
+ *  Sleeping uses the usual handshake: the server sets sleeping and then
+ *  rechecks head, the producer publishes head and then checks sleeping,
+ *  with a full fence in between on both sides so one of them sees the other.
+ */
+
+#define _GNU_SOURCE
+#include "ingest.h"
+#include "handoff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+//maps the header and the mirrored records of fd, whose records are size bytes
+static int map_ring(struct ingest_map* im, int fd, size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	if(size == 0 || size % page || (size & (size - 1))) {
+		syslog(LOG_ERR, "Bad ingest ring size %zu\n", size);
+		return -1;
+	}
+	
+	//reserve the whole range, then map the file over it
+	size_t len = page + 2 * size;
+	char* base = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED) {
+		syslog(LOG_ERR, "Failed to reserve ingest ring:%m\n");
+		return -1;
+	}
+	if(mmap(base, page + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	   mmap(base + page + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED) {
+		syslog(LOG_ERR, "Failed to map ingest ring:%m\n");
+		munmap(base, len);
+		return -1;
+	}
+	im->ring = (struct ingest_ring*)base;
+	im->data = base + page;
+	im->size = size;
+	im->map_len = len;
+	im->ring_fd = fd;
+	return 0;
+}
+
+static void unmap_ring(struct ingest_map* im) {
+	if(im->ring) munmap(im->ring, im->map_len);
+	im->ring = NULL;
+	if(im->ring_fd != -1) close(im->ring_fd);
+	if(im->bell != -1) close(im->bell);
+	im->ring_fd = im->bell = -1;
+}
+
+int ingest_connect(const char* path, struct ingest_map* im) {
+	memset(im, 0, sizeof *im);
+	im->ring_fd = im->bell = -1;
+	im->conn = handoff_connect(path);
+	if(im->conn == -1) return -1;
+	
+	//the ring, then the doorbell
+	char type = 0;
+	int fd = handoff_recv(im->conn, &type, NULL, 0);
+	int bell = -1;
+	if(fd >= 0 && type == INGEST_RING) bell = handoff_recv(im->conn, &type, NULL, 0);
+	if(bell < 0 || type != INGEST_DOORBELL) {
+		syslog(LOG_ERR, "Ingest server did not send a ring\n");
+		if(fd >= 0) close(fd);
+		if(bell >= 0) close(bell);
+		close(im->conn);
+		return -1;
+	}
+	im->bell = bell;
+	
+	struct stat sb;
+	size_t page = sysconf(_SC_PAGESIZE);
+	if(fstat(fd, &sb) == -1 || (size_t)sb.st_size <= page || map_ring(im, fd, sb.st_size - page) != 0) {
+		close(fd);
+		unmap_ring(im);
+		close(im->conn);
+		return -1;
+	}
+	return 0;
+}
+
+int ingest_put(struct ingest_map* im, const char* rec, size_t len) {
+	size_t need = len + (len == 0 || rec[len - 1] != '\n');
+	if(need > im->size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	uint64_t head = atomic_load_explicit(&im->ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&im->ring->tail, memory_order_acquire);
+	if(head + need - tail > im->size) {
+		errno = EAGAIN;
+		return -1;
+	}
+	
+	char* dst = im->data + (head & (im->size - 1));
+	memcpy(dst, rec, len);
+	if(need > len) dst[len] = '\n';
+	atomic_store_explicit(&im->ring->head, head + need, memory_order_release);
+	
+	//wake the server only if it went to sleep
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&im->ring->sleeping, memory_order_relaxed)) {
+		uint64_t one = 1;
+		if(write(im->bell, &one, sizeof one) == -1 && errno != EAGAIN) return -1;
+	}
+	return 0;
+}
+
+void ingest_close(struct ingest_map* im) {
+	unmap_ring(im);
+	if(im->conn != -1) close(im->conn);
+	im->conn = -1;
+}
+
+/* CREATE_RING
+ * Description: makes the memfd and doorbell for a new session and sends
+ *   them to the producer. The memfd is sealed so the producer cannot
+ *   shrink it under our mapping.
+ */
+static int create_ring(struct ingest_map* im, int conn, size_t size) {
+	memset(im, 0, sizeof *im);
+	im->ring_fd = im->bell = -1;
+	im->conn = conn;
+	
+	int fd = memfd_create("aesdsocket-ingest", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd == -1) {
+		syslog(LOG_ERR, "Failed to create ingest ring:%m\n");
+		return -1;
+	}
+	if(ftruncate(fd, sysconf(_SC_PAGESIZE) + size) == -1 ||
+	   fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+		syslog(LOG_ERR, "Failed to size ingest ring:%m\n");
+		close(fd);
+		return -1;
+	}
+	if(map_ring(im, fd, size) != 0) {
+		close(fd);
+		return -1;
+	}
+	im->bell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(im->bell == -1) {
+		syslog(LOG_ERR, "Failed to create ingest doorbell:%m\n");
+		unmap_ring(im);
+		return -1;
+	}
+	if(handoff_send(conn, INGEST_RING, fd, NULL) != 0 ||
+	   handoff_send(conn, INGEST_DOORBELL, im->bell, NULL) != 0) {
+		unmap_ring(im);
+		return -1;
+	}
+	return 0;
+}
+
+int ingest_serve(int conn, size_t size, int stop_fd, ingest_sink_t sink, void* arg) {
+	struct ingest_map im;
+	if(create_ring(&im, conn, size) != 0) return -1;
+	struct ingest_ring* r = im.ring;
+	
+	int result = 0;
+	int stopping = 0;
+	while(1) {
+		//store everything published so far
+		uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+		if(head - tail > im.size) { //only a broken producer gets here
+			syslog(LOG_ERR, "Ingest ring corrupted\n");
+			result = -1;
+			break;
+		}
+		if(head != tail) {
+			if(sink(arg, im.data + (tail & (im.size - 1)), head - tail) != 0) {
+				result = -1;
+				break;
+			}
+			atomic_store_explicit(&r->tail, head, memory_order_release);
+			continue;
+		}
+		if(stopping) break;
+		
+		//a busy producer is usually about to publish more, which is
+		//cheaper to wait for here than to be woken up for
+		int spins = 0;
+		while(spins < INGEST_SPIN && atomic_load_explicit(&r->head, memory_order_relaxed) == tail) {
+			sched_yield();
+			spins++;
+		}
+		if(spins < INGEST_SPIN) continue;
+		
+		//nothing left: go to sleep, unless something came in meanwhile
+		atomic_store_explicit(&r->sleeping, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if(atomic_load_explicit(&r->head, memory_order_relaxed) != tail) {
+			atomic_store_explicit(&r->sleeping, 0, memory_order_relaxed);
+			continue;
+		}
+		struct pollfd pfds[3] = {
+			{ im.bell, POLLIN, 0 },
+			{ conn, POLLIN, 0 },
+			{ stop_fd, POLLIN, 0 },
+		};
+		int rc = poll(pfds, 3, -1);
+		atomic_store_explicit(&r->sleeping, 0, memory_order_relaxed);
+		if(rc == -1 && errno != EINTR) {
+			syslog(LOG_ERR, "Failed to poll ingest ring:%m\n");
+			result = -1;
+			break;
+		}
+		if(pfds[0].revents) {
+			uint64_t n;
+			read(im.bell, &n, sizeof n); //just clears it
+		}
+		//the producer hung up or we are shutting down: drain, then end
+		if(pfds[1].revents || pfds[2].revents) stopping = 1;
+	}
+	
+	unmap_ring(&im);
+	return result;
+}
@@ -0,0 +1,96 @@
+/*
+ * ingest.h
+ *
+ *  Shared memory ingestion for producers on the same box. A producer
+ *  connects to the server's ingest Unix socket and is sent a ring
+ *  (a memfd) and a doorbell (an eventfd). It then appends records to
+ *  the ring with plain stores; the server stores whatever was
+ *  published, so there is no syscall per record. The doorbell is only
+ *  rung when the server went to sleep on an empty ring.
+ *  Producers build with ingest.c and handoff.c.
+ */
+
+#ifndef INGEST_H_
+#define INGEST_H_
+//-------------------------INCLUDES-------------------------
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//-------------------------DEFINES-------------------------
+#define INGEST_RING_SIZE (1 << 20) //record bytes per producer ring, a power of two
+#define INGEST_RING 'R' //handoff message type carrying the ring
+#define INGEST_DOORBELL 'B' //handoff message type carrying the doorbell
+#define INGEST_SPIN 4096 //empty checks before the server sleeps on the doorbell
+
+//-------------------------STRUCTS-------------------------
+//first page of the ring, the records follow on the next page
+struct ingest_ring {
+	_Atomic uint64_t head; //bytes published by the producer
+	char pad0[64 - sizeof(uint64_t)]; //head and tail on their own cache lines
+	_Atomic uint64_t tail; //bytes stored by the server
+	char pad1[64 - sizeof(uint64_t)];
+	_Atomic uint32_t sleeping; //1 while the server waits on the doorbell
+};
+
+//one side's view of a ring. The records are mapped twice back to back,
+//so a record wrapping past the end is still contiguous in memory.
+struct ingest_map {
+	struct ingest_ring* ring;
+	char* data;
+	size_t size; //record bytes, data is mapped for twice this
+	size_t map_len;
+	int ring_fd;
+	int bell; //doorbell eventfd
+	int conn; //control connection, closing it ends the session
+};
+
+//called by the server with every batch of records, whole records only
+typedef int (*ingest_sink_t)(void* arg, char* data, size_t len);
+
+//-------------------------FUNCTIONS-------------------------
+/* INGEST_CONNECT
+ * Description: producer side, connects to the server and maps the
+ *   ring it is given
+ * Input:
+ *  path = server's ingest socket
+ *  im = filled in with the mapped ring
+ * Output: 0 on success, -1 on error
+ */
+int ingest_connect(const char* path, struct ingest_map* im);
+
+/* INGEST_PUT
+ * Description: producer side, appends one record. A newline is added
+ *   if the record does not end with one. Not thread safe: one ring per
+ *   producing thread.
+ * Input:
+ *  im = connected ring
+ *  rec, len = record
+ * Output: 0 on success, -1 with errno EAGAIN if the ring is full for
+ *   now or EMSGSIZE if the record can never fit
+ */
+int ingest_put(struct ingest_map* im, const char* rec, size_t len);
+
+/* INGEST_CLOSE
+ * Description: producer side, disconnects. The server still stores
+ *   every record put before this.
+ * Input:
+ *  im = connected ring
+ * Output: none
+ */
+void ingest_close(struct ingest_map* im);
+
+/* INGEST_SERVE
+ * Description: server side, gives a ring to a producer that connected
+ *   and passes its records to sink until the producer disconnects or
+ *   stop_fd becomes readable. Either way the ring is drained first.
+ * Input:
+ *  conn = accepted control connection (left open)
+ *  size = record bytes for the ring, a power of two multiple of the page size
+ *  stop_fd = fd polled for shutdown (not read)
+ *  sink, arg = where records go
+ * Output: 0 when the session ended, -1 on error
+ */
+int ingest_serve(int conn, size_t size, int stop_fd, ingest_sink_t sink, void* arg);
+
+#endif /* INGEST_H_ */
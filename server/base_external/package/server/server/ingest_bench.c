@@ -0,0 +1,65 @@
+/* Shared memory ingestion benchmark
+ * Description:
+ *  A local producer for a running aesdsocket started with -i: puts
+ *  records into its ring as fast as the server takes them and times
+ *  until the server has stored the last one. One line per run:
+ *    ingest records=N size=BYTES rps=N mbps=N full_waits=N
+ *  Usage: ./ingestBench path [records, default 1000000] [size, default 32]
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ingest.h"
+
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s path [records] [size]\n", argv[0]);
+		return 1;
+	}
+	long records = argc > 2 ? atol(argv[2]) : 1000000;
+	size_t size = argc > 3 ? (size_t)atol(argv[3]) : 32;
+	if(size < 1) size = 1;
+	
+	struct ingest_map im;
+	if(ingest_connect(argv[1], &im) != 0) {
+		fprintf(stderr, "Cannot connect to %s\n", argv[1]);
+		return 1;
+	}
+	
+	char* rec = malloc(size);
+	if(!rec) return 1;
+	memset(rec, 'r', size);
+	rec[size - 1] = '\n';
+	
+	long full_waits = 0;
+	double t0 = now_s();
+	for(long i = 0; i < records; i++) {
+		while(ingest_put(&im, rec, size) != 0) {
+			if(errno != EAGAIN) {
+				perror("ingest_put");
+				return 1;
+			}
+			full_waits++;
+			sched_yield();
+		}
+	}
+	//done once the server stored everything
+	while(atomic_load(&im.ring->tail) != atomic_load(&im.ring->head)) sched_yield();
+	double t = now_s() - t0;
+	
+	printf("ingest records=%ld size=%zu rps=%.0f mbps=%.1f full_waits=%ld\n",
+	       records, size, records / t, records * size / t / 1e6, full_waits);
+	ingest_close(&im);
+	free(rec);
+	return 0;
+}
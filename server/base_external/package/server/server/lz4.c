@@ -0,0 +1,154 @@
+/* LZ4 block codec
+ * Description:
+ *  A block is a series of sequences: a token byte (literal count in the
+ *  high nibble, match length - 4 in the low one), extra length bytes when
+ *  a nibble is 15, the literals, then a 2 byte little endian match offset
+ *  and extra match length bytes. The last sequence is literals only.
+ *  The compressor is the greedy single hash table one: plenty for our
+ *  text records, where most of the win is repeated field names.
+ */
+
+#include "lz4.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MINMATCH 4
+#define HASH_LOG 12
+#define LASTLITERALS 5 //the format requires the block to end in literals
+#define MFLIMIT 12 //no match may start this close to the end
+#define MAX_DISTANCE 65535
+
+static uint32_t read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+	return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+//writes the extra bytes of a length that did not fit its nibble
+static uint8_t* put_len(uint8_t* op, size_t len) {
+	while(len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+int lz4_compress(const char* src, size_t srclen, char* dst, size_t dstcap) {
+	if(dstcap < LZ4_BOUND(srclen)) return -1;
+	
+	const uint8_t* base = (const uint8_t*)src;
+	const uint8_t* ip = base;
+	const uint8_t* anchor = base;
+	const uint8_t* end = base + srclen;
+	uint8_t* op = (uint8_t*)dst;
+	uint32_t table[1 << HASH_LOG];
+	memset(table, 0, sizeof table);
+	
+	if(srclen > MFLIMIT) {
+		const uint8_t* mflimit = end - MFLIMIT;
+		const uint8_t* matchlimit = end - LASTLITERALS;
+		while(ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash4(seq);
+			const uint8_t* ref = base + table[h];
+			table[h] = (uint32_t)(ip - base);
+			if(ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != seq) {
+				ip++;
+				continue;
+			}
+			
+			//extend the match backwards over pending literals, then forwards
+			while(ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			const uint8_t* mp = ip + MINMATCH;
+			const uint8_t* rp = ref + MINMATCH;
+			while(mp < matchlimit && *mp == *rp) {
+				mp++;
+				rp++;
+			}
+			
+			//emit literals then the match
+			size_t litlen = ip - anchor;
+			size_t mlen = mp - ip - MINMATCH;
+			uint8_t* token = op++;
+			*token = (uint8_t)((litlen >= 15 ? 15 : litlen) << 4);
+			if(litlen >= 15) op = put_len(op, litlen - 15);
+			memcpy(op, anchor, litlen);
+			op += litlen;
+			uint16_t off = (uint16_t)(ip - ref);
+			*op++ = off & 0xff;
+			*op++ = off >> 8;
+			*token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+			if(mlen >= 15) op = put_len(op, mlen - 15);
+			
+			ip = mp;
+			anchor = ip;
+		}
+	}
+	
+	//last literals
+	size_t litlen = end - anchor;
+	uint8_t* token = op++;
+	*token = (uint8_t)((litlen >= 15 ? 15 : litlen) << 4);
+	if(litlen >= 15) op = put_len(op, litlen - 15);
+	memcpy(op, anchor, litlen);
+	op += litlen;
+	return (int)(op - (uint8_t*)dst);
+}
+
+int lz4_decompress(const char* src, size_t srclen, char* dst, size_t dstcap) {
+	const uint8_t* ip = (const uint8_t*)src;
+	const uint8_t* iend = ip + srclen;
+	uint8_t* op = (uint8_t*)dst;
+	uint8_t* oend = op + dstcap;
+	
+	while(ip < iend) {
+		uint8_t token = *ip++;
+		
+		//literals
+		size_t litlen = token >> 4;
+		if(litlen == 15) {
+			uint8_t b;
+			do {
+				if(ip >= iend) return -1;
+				b = *ip++;
+				litlen += b;
+			} while(b == 255);
+		}
+		if(litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op)) return -1;
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+		if(ip == iend) break; //last sequence has no match
+		
+		//match
+		if(iend - ip < 2) return -1;
+		size_t off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(off == 0 || off > (size_t)(op - (uint8_t*)dst)) return -1;
+		size_t mlen = token & 15;
+		if(mlen == 15) {
+			uint8_t b;
+			do {
+				if(ip >= iend) return -1;
+				b = *ip++;
+				mlen += b;
+			} while(b == 255);
+		}
+		mlen += MINMATCH;
+		if(mlen > (size_t)(oend - op)) return -1;
+		
+		//byte by byte: the match may overlap what it produces
+		const uint8_t* match = op - off;
+		while(mlen--) *op++ = *match++;
+	}
+	return (int)(op - (uint8_t*)dst);
+}
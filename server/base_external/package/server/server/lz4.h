@@ -0,0 +1,39 @@
+/*
+ * lz4.h
+ *
+ *  Small LZ4 block format codec, vendored so the image needs no
+ *  external compression library. Output is readable by any LZ4
+ *  block decoder (LZ4_decompress_safe) and the decoder accepts any
+ *  valid LZ4 block.
+ */
+
+#ifndef LZ4_H_
+#define LZ4_H_
+//-------------------------INCLUDES-------------------------
+#include <stddef.h>
+
+//-------------------------DEFINES-------------------------
+//worst case compressed size of n input bytes
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+//-------------------------FUNCTIONS-------------------------
+/* LZ4_COMPRESS
+ * Description: compresses one block
+ * Input:
+ *  src, srclen = data to compress
+ *  dst, dstcap = output buffer, at least LZ4_BOUND(srclen) bytes
+ * Output: compressed size, -1 if dst is too small
+ */
+int lz4_compress(const char* src, size_t srclen, char* dst, size_t dstcap);
+
+/* LZ4_DECOMPRESS
+ * Description: decompresses one block, never writing past dstcap
+ *   or reading past srclen whatever the input
+ * Input:
+ *  src, srclen = compressed block
+ *  dst, dstcap = output buffer
+ * Output: decompressed size, -1 if the block is corrupt or too big
+ */
+int lz4_decompress(const char* src, size_t srclen, char* dst, size_t dstcap);
+
+#endif /* LZ4_H_ */
@@ -0,0 +1,193 @@
+/* Packet pipeline
+ * Description:
+ *  Bounded FIFOs of packets with a mutex and two condition variables
+ *  each, and a shared pool of packets. Packets small enough keep their
+ *  bytes inline, larger ones get a buffer from a free list per power
+ *  of two size, so the pool, once warm, serves them without malloc up
+ *  to the largest size.
+ */
+
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pkt_list pool = STAILQ_HEAD_INITIALIZER(pool);
+static size_t pool_len = 0;
+//idle large buffers by size class, linked through their first bytes
+static struct {
+	void* free;
+	size_t nfree;
+} classes[PKT_CLASSES];
+
+//size class holding len bytes and the NUL, -1 past the largest
+static int size_class(size_t len) {
+	size_t size = PKT_CLASS_MIN;
+	for(int c = 0; c < PKT_CLASSES; c++, size *= 2)
+		if(len < size) return c;
+	return -1;
+}
+
+//idle buffer of at least len bytes and the NUL, NULL if none. Either
+//way the capacity to allocate goes in *cap. lock held
+static char* buf_take(size_t len, size_t* cap) {
+	int c = size_class(len);
+	if(c == -1) {
+		*cap = len;
+		return NULL;
+	}
+	*cap = ((size_t)PKT_CLASS_MIN << c) - 1;
+	char* buf = classes[c].free;
+	if(!buf) return NULL;
+	classes[c].free = *(void**)buf;
+	classes[c].nfree--;
+	return buf;
+}
+
+//gives back a buffer from buf_take. lock held
+static void buf_give(char* buf, size_t cap) {
+	int c = size_class(cap);
+	if(c == -1 || (classes[c].nfree + 1) * (cap + 1) > PKT_CLASS_IDLE) {
+		free(buf);
+		return;
+	}
+	*(void**)buf = classes[c].free;
+	classes[c].free = buf;
+	classes[c].nfree++;
+}
+
+struct pkt* pkt_get(const char* data, size_t len) {
+	pthread_mutex_lock(&pool_lock);
+	struct pkt* p = STAILQ_FIRST(&pool);
+	if(p) {
+		STAILQ_REMOVE_HEAD(&pool, link);
+		pool_len--;
+	}
+	char* buf = NULL;
+	size_t cap = PKT_INLINE;
+	if(len > PKT_INLINE) buf = buf_take(len, &cap);
+	pthread_mutex_unlock(&pool_lock);
+	if(len > PKT_INLINE && !buf) buf = malloc(cap + 1);
+	if(!p) p = malloc(sizeof *p);
+	if(!p || (len > PKT_INLINE && !buf)) {
+		free(p);
+		free(buf);
+		return NULL;
+	}
+	
+	p->data = buf ? buf : p->inline_data;
+	p->cap = cap;
+	memcpy(p->data, data, len);
+	p->data[len] = '\0';
+	p->len = len;
+	p->conn = NULL;
+	p->end = -1;
+	p->echo = 0;
+	p->rc = 0;
+	return p;
+}
+
+void pkt_put(struct pkt* p) {
+	if(!p) return;
+	pthread_mutex_lock(&pool_lock);
+	if(p->data != p->inline_data) buf_give(p->data, p->cap);
+	if(pool_len < PKT_POOL_MAX) {
+		STAILQ_INSERT_HEAD(&pool, p, link);
+		pool_len++;
+		p = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	free(p);
+}
+
+void pkt_pool_destroy(void) {
+	pthread_mutex_lock(&pool_lock);
+	while(!STAILQ_EMPTY(&pool)) {
+		struct pkt* p = STAILQ_FIRST(&pool);
+		STAILQ_REMOVE_HEAD(&pool, link);
+		free(p);
+	}
+	pool_len = 0;
+	for(int c = 0; c < PKT_CLASSES; c++) {
+		while(classes[c].free) {
+			void* next = *(void**)classes[c].free;
+			free(classes[c].free);
+			classes[c].free = next;
+		}
+		classes[c].nfree = 0;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+int pkt_queue_init(struct pkt_queue* q, size_t cap, struct stage_stats* stats) {
+	if(pthread_mutex_init(&q->lock, NULL) != 0) return -1;
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	STAILQ_INIT(&q->items);
+	q->depth = 0;
+	q->cap = cap;
+	q->closed = 0;
+	q->stats = stats;
+	return 0;
+}
+
+void pkt_queue_destroy(struct pkt_queue* q) {
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
+}
+
+int pkt_queue_push(struct pkt_queue* q, struct pkt* p) {
+	pthread_mutex_lock(&q->lock);
+	if(q->depth >= q->cap && !q->closed) {
+		atomic_fetch_add(&q->stats->full_waits, 1);
+		while(q->depth >= q->cap && !q->closed) pthread_cond_wait(&q->not_full, &q->lock);
+	}
+	if(q->closed) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+	STAILQ_INSERT_TAIL(&q->items, p, link);
+	q->depth++;
+	long d = atomic_fetch_add(&q->stats->depth, 1) + 1;
+	long m = atomic_load(&q->stats->max_depth);
+	while(d > m && !atomic_compare_exchange_weak(&q->stats->max_depth, &m, d));
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+size_t pkt_queue_pop(struct pkt_queue* q, struct pkt** out, size_t max) {
+	pthread_mutex_lock(&q->lock);
+	while(q->depth == 0 && !q->closed) pthread_cond_wait(&q->not_empty, &q->lock);
+	size_t n = 0;
+	while(n < max && q->depth > 0) {
+		out[n] = STAILQ_FIRST(&q->items);
+		STAILQ_REMOVE_HEAD(&q->items, link);
+		q->depth--;
+		n++;
+	}
+	if(n) {
+		atomic_fetch_sub(&q->stats->depth, n);
+		atomic_fetch_add(&q->stats->items, n);
+		pthread_cond_broadcast(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+void pkt_queue_close(struct pkt_queue* q) {
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
+
+int stage_stats_format(struct stage_stats* s, char* buf, size_t len) {
+	return snprintf(buf, len, "%s depth=%ld max=%ld items=%ld full_waits=%ld",
+	                s->name, atomic_load(&s->depth), atomic_load(&s->max_depth),
+	                atomic_load(&s->items), atomic_load(&s->full_waits));
+}
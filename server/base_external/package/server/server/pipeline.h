@@ -0,0 +1,139 @@
+/*
+ * pipeline.h
+ *
+ *  Packets in flight between the stages of a connection: receive
+ *  (framing, the connection's thread), storage (one thread for every
+ *  connection on a stream, which lets it commit them together) and
+ *  reply (echoing).
+ *  Stages hand packets on through bounded queues, so a stage that falls
+ *  behind holds back the one before it instead of growing memory, and
+ *  each queue keeps depth metrics for its stage.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+//-------------------------INCLUDES-------------------------
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "queue.h"
+#include "place.h"
+
+//-------------------------DEFINES-------------------------
+#define PKT_INLINE 2048 //packets up to this size need no allocation
+#define PKT_POOL_MAX 256 //idle packets kept for reuse
+#define PKT_CLASS_MIN 4096 //smallest pooled buffer for packets past PKT_INLINE
+#define PKT_CLASSES 9 //buffer sizes pooled, doubling up to 1 MiB
+#define PKT_CLASS_IDLE (4 * 1024 * 1024) //idle bytes kept per size
+#define PIPE_STORE_DEPTH 64 //packets waiting for the storage stage
+#define PIPE_CONN_DEPTH 8 //packets of one connection in flight, by default
+#define PIPE_CONN_MAX 64 //most that can be asked for
+#define PIPE_BATCH 32 //packets the storage stage commits together at most (and by default)
+
+//-------------------------STRUCTS-------------------------
+struct pkt {
+	STAILQ_ENTRY(pkt) link;
+	void* conn; //connection it came from
+	char* data; //NUL terminated, inline_data or a pooled buffer
+	size_t len;
+	size_t cap; //bytes data holds, its NUL aside
+	off_t end; //store offset right after it once stored, -1 with the char device
+	int echo; //1 to echo once stored
+	int rc; //storage result, 0 or -1
+	char inline_data[PKT_INLINE + 1];
+};
+STAILQ_HEAD(pkt_list, pkt);
+
+//depth metrics of a stage, shared by all of its queues. Every push
+//and pop counts into them, so each stage's are on a line of their own.
+struct stage_stats {
+	_Alignas(CACHE_LINE) const char* name;
+	atomic_long depth; //packets queued now
+	atomic_long max_depth; //most ever queued at once
+	atomic_long items; //packets that went through
+	atomic_long full_waits; //pushes that had to wait for room
+};
+
+struct pkt_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct pkt_list items;
+	size_t depth;
+	size_t cap;
+	int closed;
+	struct stage_stats* stats;
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* PKT_GET
+ * Description: gets a packet and copies data into it (thread safe)
+ * Input:
+ *  data, len = packet bytes
+ * Output: the packet, NULL if out of memory
+ */
+struct pkt* pkt_get(const char* data, size_t len);
+
+/* PKT_PUT
+ * Description: gives a packet back (thread safe)
+ * Input: p = packet, NULL is ignored
+ * Output: none
+ */
+void pkt_put(struct pkt* p);
+
+/* PKT_POOL_DESTROY
+ * Description: frees every idle packet and buffer, once no stage is running
+ */
+void pkt_pool_destroy(void);
+
+/* PKT_QUEUE_INIT
+ * Description: sets up an empty queue
+ * Input:
+ *  q = queue
+ *  cap = most packets it holds
+ *  stats = stage metrics it counts into
+ * Output: 0 on success, -1 on error
+ */
+int pkt_queue_init(struct pkt_queue* q, size_t cap, struct stage_stats* stats);
+
+/* PKT_QUEUE_DESTROY
+ * Description: releases a queue, which must be empty
+ */
+void pkt_queue_destroy(struct pkt_queue* q);
+
+/* PKT_QUEUE_PUSH
+ * Description: appends a packet, waiting while the queue is full
+ * Input:
+ *  q = queue
+ *  p = packet
+ * Output: 0 on success, -1 if the queue was closed
+ */
+int pkt_queue_push(struct pkt_queue* q, struct pkt* p);
+
+/* PKT_QUEUE_POP
+ * Description: takes up to max packets from the front, waiting for
+ *   the first one
+ * Input:
+ *  q = queue
+ *  out = array of at least max
+ *  max = most packets to take
+ * Output: packets taken, 0 once the queue is closed and empty
+ */
+size_t pkt_queue_pop(struct pkt_queue* q, struct pkt** out, size_t max);
+
+/* PKT_QUEUE_CLOSE
+ * Description: refuses further pushes and lets pop return 0 once empty
+ */
+void pkt_queue_close(struct pkt_queue* q);
+
+/* STAGE_STATS_FORMAT
+ * Description: one line of metrics, "name depth=N max=N items=N full_waits=N"
+ * Input:
+ *  s = metrics
+ *  buf, len = destination
+ * Output: as snprintf
+ */
+int stage_stats_format(struct stage_stats* s, char* buf, size_t len);
+
+#endif /* PIPELINE_H_ */
@@ -0,0 +1,146 @@
+/* Thread placement
+ * Description:
+ *  The roles are filled in while the options are read, before any
+ *  thread is started, and only read afterwards, so threads placing
+ *  themselves need no lock. Priorities go through pthread_setschedparam
+ *  and nice levels through setpriority on the thread's id, which Linux
+ *  applies to that thread alone.
+ */
+
+#define _GNU_SOURCE
+#include "place.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+struct place {
+	int cpus_set; //1 if -C named the role
+	cpu_set_t cpus;
+	int prio_set; //1 if -p named the role
+	int policy; //SCHED_OTHER or SCHED_FIFO
+	int prio; //SCHED_FIFO priority
+	int nice; //SCHED_OTHER nice level
+};
+
+static const char* place_names[PLACE_ROLES] = {
+	"listen", "conn", "storage", "commit", "reply", "other"
+};
+
+static struct place roles[PLACE_ROLES];
+static int placing; //1 once any role has CPUs
+static int prioritizing; //1 once any role has a priority
+static cpu_set_t start_cpus; //what the process started with
+static int start_nice;
+
+void place_init(void) {
+	memset(roles, 0, sizeof roles);
+	placing = 0;
+	prioritizing = 0;
+	if(sched_getaffinity(0, sizeof start_cpus, &start_cpus) != 0) {
+		CPU_ZERO(&start_cpus);
+		for(int i = 0; i < CPU_SETSIZE; i++) CPU_SET(i, &start_cpus);
+	}
+	errno = 0;
+	start_nice = getpriority(PRIO_PROCESS, 0);
+	if(errno) start_nice = 0;
+}
+
+//the role arg names, its value after the '=' in *value
+static struct place* find_role(const char* arg, const char** value) {
+	const char* eq = strchr(arg, '=');
+	if(!eq) return NULL;
+	for(int i = 0; i < PLACE_ROLES; i++) {
+		if(strlen(place_names[i]) == (size_t)(eq - arg) && strncmp(arg, place_names[i], eq - arg) == 0) {
+			*value = eq + 1;
+			return &roles[i];
+		}
+	}
+	return NULL;
+}
+
+int place_parse_cpus(const char* arg) {
+	const char* s;
+	struct place* p = find_role(arg, &s);
+	if(!p || *s == '\0') return -1;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	while(*s) {
+		char* end;
+		long lo = strtol(s, &end, 10);
+		long hi = lo;
+		if(end == s) return -1;
+		if(*end == '-') {
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+			if(end == s) return -1;
+		}
+		if(lo < 0 || hi < lo || hi >= CPU_SETSIZE) return -1;
+		for(long c = lo; c <= hi; c++) CPU_SET(c, &cpus);
+		if(*end == ',') end++;
+		else if(*end != '\0') return -1;
+		s = end;
+	}
+	p->cpus = cpus;
+	p->cpus_set = 1;
+	placing = 1;
+	return 0;
+}
+
+int place_parse_prio(const char* arg) {
+	const char* s;
+	struct place* p = find_role(arg, &s);
+	if(!p) return -1;
+	char* end;
+	long n;
+	if(strncmp(s, "fifo:", 5) == 0) {
+		n = strtol(s + 5, &end, 10);
+		if(end == s + 5 || *end != '\0' || n < 1 || n > PLACE_FIFO_MAX) return -1;
+		p->policy = SCHED_FIFO;
+		p->prio = n;
+	}
+	else if(strncmp(s, "nice:", 5) == 0) {
+		n = strtol(s + 5, &end, 10);
+		if(end == s + 5 || *end != '\0' || n < -20 || n > 19) return -1;
+		p->policy = SCHED_OTHER;
+		p->nice = n;
+	}
+	else return -1;
+	p->prio_set = 1;
+	prioritizing = 1;
+	return 0;
+}
+
+void place_thread(enum place_role role) {
+	struct place* p = &roles[role];
+	int rc;
+	if(placing) {
+		const cpu_set_t* cpus = p->cpus_set ? &p->cpus : &start_cpus;
+		rc = pthread_setaffinity_np(pthread_self(), sizeof *cpus, cpus);
+		if(rc != 0) {
+			errno = rc;
+			syslog(LOG_ERR, "Failed to set CPUs of %s thread:%m\n", place_names[role]);
+		}
+	}
+	if(!prioritizing) return;
+	int policy = p->prio_set ? p->policy : SCHED_OTHER;
+	struct sched_param sp;
+	memset(&sp, 0, sizeof sp);
+	if(policy == SCHED_FIFO) sp.sched_priority = p->prio;
+	rc = pthread_setschedparam(pthread_self(), policy, &sp);
+	if(rc != 0) {
+		errno = rc;
+		syslog(LOG_ERR, "Failed to set scheduling of %s thread:%m\n", place_names[role]);
+	}
+	if(policy == SCHED_OTHER) {
+		int nice = p->prio_set ? p->nice : start_nice;
+		if(setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) != 0)
+			syslog(LOG_ERR, "Failed to set nice level of %s thread:%m\n", place_names[role]);
+	}
+}
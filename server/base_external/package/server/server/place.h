@@ -0,0 +1,71 @@
+/*
+ * place.h
+ *
+ *  Thread placement: which CPUs each kind of thread may run on (-C)
+ *  and how it is scheduled (-p), so the write path can be kept off
+ *  the cores taking the network interrupts and ahead of the rest:
+ *
+ *   -C listen=0 -C conn=1-2 -C storage=3 -C commit=3
+ *   -p storage=fifo:10 -p commit=fifo:10 -p conn=nice:-5
+ *
+ *  Every thread places itself when it starts. Threads inherit their
+ *  creator's CPUs and policy, so once any role is placed the others
+ *  are put back to what the process was started with. SCHED_FIFO and
+ *  negative nice levels need CAP_SYS_NICE; without it the failure is
+ *  logged and the thread runs as before.
+ *  Also the cache line size the hot shared structures are aligned to.
+ */
+
+#ifndef PLACE_H_
+#define PLACE_H_
+//-------------------------INCLUDES-------------------------
+#include <stddef.h>
+
+//-------------------------DEFINES-------------------------
+#define CACHE_LINE 64 //bytes, Cortex-A72 and x86 alike
+#define PLACE_FIFO_MAX 99 //highest SCHED_FIFO priority accepted
+
+//kinds of threads, see place_names in place.c
+enum place_role {
+	PLACE_LISTEN,  //main: accepts, timestamps, shutdown
+	PLACE_CONN,    //a connection's receive path, and ingest producers
+	PLACE_STORAGE, //a stream's storage stage
+	PLACE_COMMIT,  //a store's committer (syncs)
+	PLACE_REPLY,   //the reply scheduler
+	PLACE_OTHER,   //live tails, replication and search indexing
+	PLACE_ROLES
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* PLACE_INIT
+ * Description: remembers the CPUs and nice level the process started
+ *   with, for the roles left unplaced. Called before any option.
+ * Output: N/A
+ */
+void place_init(void);
+
+/* PLACE_PARSE_CPUS
+ * Description: parses a -C argument, role=list where list is a CPU
+ *   list as in taskset -c ("1-2,4")
+ * Input: arg = option argument
+ * Output: 0 on success, -1 if it is malformed
+ */
+int place_parse_cpus(const char* arg);
+
+/* PLACE_PARSE_PRIO
+ * Description: parses a -p argument, role=fifo:N (1..PLACE_FIFO_MAX)
+ *   or role=nice:N (-20..19)
+ * Input: arg = option argument
+ * Output: 0 on success, -1 if it is malformed
+ */
+int place_parse_prio(const char* arg);
+
+/* PLACE_THREAD
+ * Description: applies the role's placement to the calling thread,
+ *   nothing if no role was placed. Failures are logged, not fatal.
+ * Input: role = what the thread is
+ * Output: N/A
+ */
+void place_thread(enum place_role role);
+
+#endif /* PLACE_H_ */
@@ -0,0 +1,98 @@
+/* Connection allocators
+ * Description:
+ *  The slab carves chunks of SLAB_CHUNK_OBJS objects out of a single
+ *  aligned allocation each; the chunk itself starts with the link to
+ *  the previous chunk so slab_destroy can find them all. Every object
+ *  takes whole cache lines, so no two objects share one. Free objects
+ *  and idle buffers are kept on intrusive lists, so taking or returning
+ *  one is a couple of pointer moves.
+ */
+
+#include "pool.h"
+#include "place.h"
+
+#include <stdlib.h>
+
+//chunk header, padded so the objects after it stay aligned
+#define CHUNK_HDR CACHE_LINE
+
+void slab_init(struct slab* sl, size_t obj_size) {
+	if(obj_size < sizeof(void*)) obj_size = sizeof(void*);
+	sl->obj_size = (obj_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+	sl->free = NULL;
+	sl->chunks = NULL;
+	sl->in_use = 0;
+	sl->total = 0;
+}
+
+void* slab_alloc(struct slab* sl) {
+	if(!sl->free) {
+		char* chunk = aligned_alloc(CACHE_LINE, CHUNK_HDR + SLAB_CHUNK_OBJS * sl->obj_size);
+		if(!chunk) return NULL;
+		*(void**)chunk = sl->chunks;
+		sl->chunks = chunk;
+		//thread the new objects onto the free list
+		for(int i = SLAB_CHUNK_OBJS - 1; i >= 0; i--) {
+			void* obj = chunk + CHUNK_HDR + i * sl->obj_size;
+			*(void**)obj = sl->free;
+			sl->free = obj;
+		}
+		sl->total += SLAB_CHUNK_OBJS;
+	}
+	void* obj = sl->free;
+	sl->free = *(void**)obj;
+	sl->in_use++;
+	return obj;
+}
+
+void slab_free(struct slab* sl, void* obj) {
+	if(!obj) return;
+	*(void**)obj = sl->free;
+	sl->free = obj;
+	sl->in_use--;
+}
+
+void slab_destroy(struct slab* sl) {
+	while(sl->chunks) {
+		void* next = *(void**)sl->chunks;
+		free(sl->chunks);
+		sl->chunks = next;
+	}
+	sl->free = NULL;
+	sl->in_use = 0;
+	sl->total = 0;
+}
+
+void buf_pool_init(struct buf_pool* bp, size_t size) {
+	bp->size = size;
+	bp->free = NULL;
+	bp->nfree = 0;
+}
+
+char* buf_get(struct buf_pool* bp) {
+	if(!bp->free) return malloc(bp->size);
+	char* buf = bp->free;
+	bp->free = *(void**)buf;
+	bp->nfree--;
+	return buf;
+}
+
+void buf_put(struct buf_pool* bp, char* buf, size_t cap) {
+	if(!buf) return;
+	if(cap != bp->size || bp->nfree >= BUF_POOL_MAX) {
+		free(buf);
+		return;
+	}
+	*(void**)buf = bp->free;
+	bp->free = buf;
+	bp->nfree++;
+}
+
+void buf_pool_destroy(struct buf_pool* bp) {
+	while(bp->free) {
+		void* next = *(void**)bp->free;
+		free(bp->free);
+		bp->free = next;
+	}
+	bp->nfree = 0;
+}
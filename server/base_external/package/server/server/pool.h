@@ -0,0 +1,111 @@
+/*
+ * pool.h
+ *
+ *  Allocators for what every connection needs: a slab of fixed size
+ *  objects for the per-connection structures, and a pool of receive
+ *  buffers recycled from one connection to the next. Memory is only
+ *  taken from malloc when the high-water mark grows, and is never
+ *  given back before exit, so a long running server settles at a
+ *  fixed footprint instead of fragmenting the heap.
+ *  Neither is thread safe: only main allocates and frees from them.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+//-------------------------INCLUDES-------------------------
+#include <stddef.h>
+
+//-------------------------DEFINES-------------------------
+#define SLAB_CHUNK_OBJS 16 //objects malloc'ed at a time when a slab runs dry
+#define BUF_POOL_MAX 64 //idle buffers kept for reuse
+
+//-------------------------STRUCTS-------------------------
+struct slab {
+	size_t obj_size; //rounded up to whole cache lines
+	void* free; //free objects, linked through their first bytes
+	void* chunks; //every chunk malloc'ed, freed only by slab_destroy
+	size_t in_use;
+	size_t total;
+};
+
+struct buf_pool {
+	size_t size; //size of every pooled buffer
+	void* free; //idle buffers, linked through their first bytes
+	size_t nfree;
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* SLAB_INIT
+ * Description: sets up an empty slab, nothing is allocated yet
+ * Input:
+ *  sl = slab to set up
+ *  obj_size = size of the objects it hands out
+ * Output: none
+ */
+void slab_init(struct slab* sl, size_t obj_size);
+
+/* SLAB_ALLOC
+ * Description: hands out an object, growing the slab by SLAB_CHUNK_OBJS
+ *  objects when none is free. The contents are not cleared.
+ * Input:
+ *  sl = slab
+ * Output: the object, NULL if out of memory
+ */
+void* slab_alloc(struct slab* sl);
+
+/* SLAB_FREE
+ * Description: puts an object back for the next slab_alloc
+ * Input:
+ *  sl = slab it came from
+ *  obj = object, NULL is ignored
+ * Output: none
+ */
+void slab_free(struct slab* sl, void* obj);
+
+/* SLAB_DESTROY
+ * Description: gives every chunk back to the system, objects still
+ *  handed out become invalid
+ * Input:
+ *  sl = slab
+ * Output: none
+ */
+void slab_destroy(struct slab* sl);
+
+/* BUF_POOL_INIT
+ * Description: sets up an empty buffer pool
+ * Input:
+ *  bp = pool to set up
+ *  size = size of the buffers it hands out
+ * Output: none
+ */
+void buf_pool_init(struct buf_pool* bp, size_t size);
+
+/* BUF_GET
+ * Description: hands out a buffer of the pool's size, reusing an idle one
+ * Input:
+ *  bp = pool
+ * Output: the buffer, NULL if out of memory
+ */
+char* buf_get(struct buf_pool* bp);
+
+/* BUF_PUT
+ * Description: takes a buffer back. Buffers that were grown past the
+ *  pool's size for an oversized packet, or that would take the pool
+ *  past BUF_POOL_MAX idle ones, are freed instead.
+ * Input:
+ *  bp = pool
+ *  buf = buffer, NULL is ignored
+ *  cap = its current size
+ * Output: none
+ */
+void buf_put(struct buf_pool* bp, char* buf, size_t cap);
+
+/* BUF_POOL_DESTROY
+ * Description: frees every idle buffer
+ * Input:
+ *  bp = pool
+ * Output: none
+ */
+void buf_pool_destroy(struct buf_pool* bp);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,372 @@
+/* Record index
+ * Description:
+ *  Appends are scanned for newlines to count records, and every
+ *  REC_INDEX_EVERY-th record's start is stored into the mapped
+ *  sidecar (growing it now and then). The kernel writes the sidecar
+ *  back along with the data, so a restart only indexes what was
+ *  appended after the last checkpoint. A lookup starts at the
+ *  checkpoint at or before the record and reads the store forward.
+ *
+ *  Retention moves the oldest record number on by counting the records
+ *  between the last checkpoint and the new start, and rewrites the
+ *  sidecar without the checkpoints it no longer needs once they are
+ *  most of it. The sidecar is never shrunk in place, as a process
+ *  taking over from us maps the same file.
+ */
+
+#include "recindex.h"
+#include "scan.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REC_SCAN_BUF 8192 //bytes read at a time to count records
+#define REC_CATCH_UP_BUF 65536 //bytes read at a time to index the store on open
+
+//checkpoint offsets, right after the header
+static uint64_t* cps(struct rec_index* ix) {
+	return (uint64_t*)(ix->map + 1);
+}
+
+static size_t map_len(size_t cap) {
+	return sizeof(struct rec_index_header) + cap * sizeof(uint64_t);
+}
+
+//turns record queries off after something the index can't follow
+static void set_broken(struct rec_index* ix, const char* why) {
+	if(!ix->broken) syslog(LOG_ERR, "Record index %s, record queries are off\n", why);
+	ix->broken = 1;
+}
+
+/* MAP_SIDECAR
+ * Description: grows the sidecar to cap entries and maps it.
+ *   lock held.
+ * Output: 0 on success, -1 on error (the old mapping stays)
+ */
+static int map_sidecar(struct rec_index* ix, size_t cap) {
+	struct stat sb;
+	if(fstat(ix->fd, &sb) != 0) return -1;
+	if((off_t)map_len(cap) > sb.st_size && ftruncate(ix->fd, map_len(cap)) != 0) return -1;
+	void* m = mmap(NULL, map_len(cap), PROT_READ | PROT_WRITE, MAP_SHARED, ix->fd, 0);
+	if(m == MAP_FAILED) return -1;
+	if(ix->map) munmap(ix->map, map_len(ix->cap));
+	ix->map = m;
+	ix->cap = cap;
+	return 0;
+}
+
+//adds the checkpoint for record total, lock held
+static void add_checkpoint(struct rec_index* ix, off_t off) {
+	uint64_t n = ix->map->count;
+	if(n == ix->cap && map_sidecar(ix, ix->cap * 2) != 0) {
+		set_broken(ix, "can't grow");
+		return;
+	}
+	cps(ix)[n] = off;
+	ix->map->count = n + 1;
+}
+
+//indexes appended bytes, lock held
+static void index_bytes(struct rec_index* ix, const char* data, size_t len) {
+	const char* p = data;
+	const char* end = data + len;
+	const char* eol;
+	while(!ix->broken && (eol = scan_newline(p, end - p)) != NULL) {
+		ix->total++;
+		ix->last_end = ix->scanned + (eol - data) + 1;
+		if(ix->total % REC_INDEX_EVERY == 0) add_checkpoint(ix, ix->last_end);
+		p = eol + 1;
+	}
+	ix->scanned += len;
+}
+
+/* COUNT_RECORDS
+ * Description: counts the newlines in store bytes [from, to)
+ * Output: 0 on success, -1 if the store couldn't be read
+ */
+static int count_records(struct rec_index* ix, off_t from, off_t to, uint64_t* n) {
+	char buf[REC_SCAN_BUF];
+	*n = 0;
+	while(from < to) {
+		size_t want = to - from < (off_t)sizeof buf ? (size_t)(to - from) : sizeof buf;
+		ssize_t len = ix->read(ix->arg, buf, want, from);
+		if(len <= 0) return -1;
+		const char* p = buf;
+		const char* eol;
+		while((eol = scan_newline(p, buf + len - p)) != NULL) {
+			(*n)++;
+			p = eol + 1;
+		}
+		from += len;
+	}
+	return 0;
+}
+
+/* SKIP_RECORDS
+ * Description: finds where the record n records after the one
+ *   starting at off starts
+ * Output: 0 on success, -1 if the store couldn't be read
+ */
+static int skip_records(struct rec_index* ix, off_t off, uint64_t n, off_t* out) {
+	char buf[REC_SCAN_BUF];
+	while(n > 0) {
+		ssize_t len = ix->read(ix->arg, buf, sizeof buf, off);
+		if(len <= 0) return -1;
+		const char* p = buf;
+		const char* eol;
+		while(n > 0 && (eol = scan_newline(p, buf + len - p)) != NULL) {
+			n--;
+			p = eol + 1;
+		}
+		off += n == 0 ? p - buf : len;
+	}
+	*out = off;
+	return 0;
+}
+
+//closest record start known at or before record x: record n at off. lock held
+static void closest(struct rec_index* ix, uint64_t x, uint64_t* n, off_t* off) {
+	*n = ix->first;
+	*off = ix->start;
+	uint64_t c = x / REC_INDEX_EVERY;
+	if(c * REC_INDEX_EVERY > ix->first && c >= ix->map->base && c - ix->map->base < ix->map->count) {
+		*n = c * REC_INDEX_EVERY;
+		*off = cps(ix)[c - ix->map->base];
+	}
+}
+
+//indexes the store from where the index stopped up to size
+static int catch_up(struct rec_index* ix, off_t size) {
+	char* buf = malloc(REC_CATCH_UP_BUF);
+	while(buf && !ix->broken && ix->scanned < size) {
+		size_t want = size - ix->scanned < REC_CATCH_UP_BUF ? (size_t)(size - ix->scanned) : REC_CATCH_UP_BUF;
+		ssize_t len = ix->read(ix->arg, buf, want, ix->scanned);
+		if(len <= 0) break;
+		index_bytes(ix, buf, len);
+	}
+	free(buf);
+	return ix->scanned == size && !ix->broken ? 0 : -1;
+}
+
+/* RESUME
+ * Description: picks up from the checkpoints in the sidecar if they
+ *   match the store: in order, none past its end, the last one just
+ *   after a newline and inside what is kept
+ * Output: 0 on success, -1 if the index has to be rebuilt
+ */
+static int resume(struct rec_index* ix, off_t start, off_t size) {
+	struct rec_index_header* h = ix->map;
+	if(memcmp(h->magic, REC_INDEX_MAGIC, sizeof h->magic) != 0 || h->every != REC_INDEX_EVERY ||
+	  h->count == 0 || h->count > ix->cap)
+		return -1;
+	uint64_t* e = cps(ix);
+	for(uint64_t i = 1; i < h->count; i++)
+		if(e[i] < e[i - 1]) return -1;
+	while(h->count > 0 && e[h->count - 1] > (uint64_t)size) h->count--; //the store was recovered
+	if(h->count == 0 || e[h->count - 1] < (uint64_t)start) return -1;
+	off_t last = e[h->count - 1];
+	char c;
+	if(last > start && (ix->read(ix->arg, &c, 1, last - 1) != 1 || c != '\n')) return -1;
+
+	//the oldest kept record is numbered back from the first checkpoint kept
+	uint64_t lo = 0, hi = h->count - 1;
+	while(lo < hi) {
+		uint64_t mid = (lo + hi) / 2;
+		if(e[mid] >= (uint64_t)start) hi = mid;
+		else lo = mid + 1;
+	}
+	uint64_t n;
+	if(count_records(ix, start, e[lo], &n) != 0 || (h->base + lo) * REC_INDEX_EVERY < n) return -1;
+	ix->first = (h->base + lo) * REC_INDEX_EVERY - n;
+	ix->start = start;
+	ix->total = (h->base + h->count - 1) * REC_INDEX_EVERY;
+	ix->last_end = last;
+	ix->scanned = last;
+	return catch_up(ix, size);
+}
+
+void rec_index_open(struct rec_index* ix, const char* path, off_t start, off_t size, rec_reader_t read, void* arg) {
+	memset(ix, 0, sizeof *ix);
+	pthread_mutex_init(&ix->lock, NULL);
+	ix->read = read;
+	ix->arg = arg;
+	ix->path = strdup(path);
+	ix->fd = ix->path ? open(path, O_CREAT | O_RDWR | O_CLOEXEC, 00666) : -1;
+	struct stat sb;
+	if(ix->fd == -1 || fstat(ix->fd, &sb) != 0) {
+		set_broken(ix, "can't be opened");
+		return;
+	}
+	size_t have = sb.st_size > (off_t)sizeof(struct rec_index_header) ?
+	  (sb.st_size - sizeof(struct rec_index_header)) / sizeof(uint64_t) : 0;
+	if(map_sidecar(ix, have > REC_INDEX_GROW ? have : REC_INDEX_GROW) != 0) {
+		set_broken(ix, "can't be mapped");
+		return;
+	}
+	if(resume(ix, start, size) == 0) return;
+
+	//start over from what the store holds, numbering from its oldest byte
+	if(size > start) syslog(LOG_INFO, "Rebuilding record index %s\n", path);
+	memset(ix->map, 0, sizeof *ix->map);
+	memcpy(ix->map->magic, REC_INDEX_MAGIC, sizeof ix->map->magic);
+	ix->map->every = REC_INDEX_EVERY;
+	ix->total = ix->first = 0;
+	ix->start = ix->last_end = ix->scanned = start;
+	add_checkpoint(ix, start);
+	if(catch_up(ix, size) != 0) set_broken(ix, "can't be rebuilt");
+}
+
+long rec_index_add(struct rec_index* ix, const char* data, size_t len, uint64_t* first) {
+	pthread_mutex_lock(&ix->lock);
+	*first = ix->total;
+	if(!ix->broken) index_bytes(ix, data, len);
+	long result = ix->broken ? -1 : (long)(ix->total - *first);
+	pthread_mutex_unlock(&ix->lock);
+	return result;
+}
+
+/* COMPACT
+ * Description: rewrites the sidecar without the checkpoints of dropped
+ *   records once they are most of it, via a new file and a rename like
+ *   the manifest. lock held.
+ */
+static void compact(struct rec_index* ix) {
+	uint64_t dead = ix->first / REC_INDEX_EVERY;
+	if(dead <= ix->map->base) return;
+	dead -= ix->map->base;
+	if(dead < REC_INDEX_COMPACT || dead < ix->map->count / 2) return;
+
+	char tmp[PATH_MAX + 4];
+	snprintf(tmp, sizeof tmp, "%s.new", ix->path);
+	struct rec_index_header h = *ix->map;
+	h.base += dead;
+	h.count -= dead;
+	ssize_t len = h.count * sizeof(uint64_t);
+	int fd = open(tmp, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 00666);
+	if(fd == -1 || pwrite(fd, &h, sizeof h, 0) != sizeof h ||
+	  pwrite(fd, cps(ix) + dead, len, sizeof h) != len || rename(tmp, ix->path) != 0) {
+		syslog(LOG_ERR, "Failed to compact record index:%m\n"); //the old one carries on
+		if(fd != -1) close(fd);
+		unlink(tmp);
+		return;
+	}
+	munmap(ix->map, map_len(ix->cap));
+	close(ix->fd);
+	ix->map = NULL;
+	ix->fd = fd;
+	if(map_sidecar(ix, h.count + REC_INDEX_GROW) != 0) set_broken(ix, "can't be mapped");
+}
+
+uint64_t rec_index_trim(struct rec_index* ix, off_t start) {
+	pthread_mutex_lock(&ix->lock);
+	if(ix->broken || start <= ix->start) {
+		uint64_t first = ix->first;
+		pthread_mutex_unlock(&ix->lock);
+		return first;
+	}
+
+	//count on from the last checkpoint at or before start
+	uint64_t n = ix->first;
+	off_t off = ix->start;
+	uint64_t* e = cps(ix);
+	uint64_t lo = 0, hi = ix->map->count;
+	while(lo < hi) {
+		uint64_t mid = (lo + hi) / 2;
+		if(e[mid] <= (uint64_t)start) lo = mid + 1;
+		else hi = mid;
+	}
+	if(lo > 0 && (ix->map->base + lo - 1) * REC_INDEX_EVERY > n) {
+		n = (ix->map->base + lo - 1) * REC_INDEX_EVERY;
+		off = e[lo - 1];
+	}
+	uint64_t dropped;
+	if(count_records(ix, off, start, &dropped) != 0)
+		set_broken(ix, "lost count of dropped records");
+	else {
+		ix->first = n + dropped;
+		ix->start = start;
+		if(ix->last_end < start) ix->last_end = start;
+		compact(ix);
+	}
+	uint64_t first = ix->first;
+	pthread_mutex_unlock(&ix->lock);
+	return first;
+}
+
+/* FIND_SPAN
+ * Description: finds the bytes of records [ra, rb) (absolute numbers,
+ *   within the ones kept) and fills in s. Called with lock held,
+ *   released here before reading the store, without holding up appends.
+ * Output: 0 on success, -1 if a read failed
+ */
+static int find_span(struct rec_index* ix, uint64_t ra, uint64_t rb, struct rec_span* s) {
+	//where to start looking for both ends
+	uint64_t an, bn;
+	off_t ao, bo;
+	closest(ix, ra, &an, &ao);
+	closest(ix, rb, &bn, &bo);
+	if(ra == ix->total) {
+		an = ra;
+		ao = ix->last_end;
+	}
+	if(rb == ix->total) {
+		bn = rb;
+		bo = ix->last_end;
+	}
+	s->base = ix->first;
+	s->first = ra - ix->first;
+	s->count = rb - ra;
+	pthread_mutex_unlock(&ix->lock);
+
+	if(skip_records(ix, ao, ra - an, &s->from) != 0) return -1;
+	if(bn <= ra) { //the other end is closer to this one
+		bn = ra;
+		bo = s->from;
+	}
+	return skip_records(ix, bo, rb - bn, &s->to);
+}
+
+int rec_index_span(struct rec_index* ix, long a, long b, struct rec_span* s) {
+	pthread_mutex_lock(&ix->lock);
+	if(ix->broken) {
+		pthread_mutex_unlock(&ix->lock);
+		return -1;
+	}
+	long count = ix->total - ix->first;
+	if(a < 0) a = count + a > 0 ? count + a : 0;
+	if(a > count) a = count;
+	if(b > count) b = count;
+	if(b < a) b = a;
+	return find_span(ix, ix->first + a, ix->first + b, s);
+}
+
+int rec_index_span_at(struct rec_index* ix, uint64_t a, uint64_t b, struct rec_span* s) {
+	pthread_mutex_lock(&ix->lock);
+	if(ix->broken) {
+		pthread_mutex_unlock(&ix->lock);
+		return -1;
+	}
+	if(a < ix->first) a = ix->first;
+	if(a > ix->total) a = ix->total;
+	if(b > ix->total) b = ix->total;
+	if(b < a) b = a;
+	return find_span(ix, a, b, s);
+}
+
+void rec_index_close(struct rec_index* ix, int remove) {
+	if(ix->map) munmap(ix->map, map_len(ix->cap));
+	ix->map = NULL;
+	if(ix->fd != -1) close(ix->fd);
+	ix->fd = -1;
+	if(remove && ix->path) unlink(ix->path);
+	free(ix->path);
+	ix->path = NULL;
+	pthread_mutex_destroy(&ix->lock);
+}
@@ -0,0 +1,140 @@
+/*
+ * recindex.h
+ *
+ *  Record index of the user space store: a sparse table of where
+ *  every REC_INDEX_EVERY-th newline terminated record starts, kept in
+ *  a sidecar file next to the store and used through mmap, so finding
+ *  a record is a lookup plus a read of fewer than REC_INDEX_EVERY
+ *  records, however big the store. Records are numbered from the
+ *  oldest one kept, as the driver numbers its entries for
+ *  AESDCHAR_IOCSEEKTO.
+ *
+ *  Sidecar layout, host byte order:
+ *   struct rec_index_header
+ *   then count uint64_t offsets, entry i being where record
+ *   (base + i) * REC_INDEX_EVERY starts (counting every record the
+ *   store was ever given)
+ */
+
+#ifndef RECINDEX_H_
+#define RECINDEX_H_
+//-------------------------INCLUDES-------------------------
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//-------------------------DEFINES-------------------------
+#define REC_INDEX_MAGIC "AZIX"
+#define REC_INDEX_EVERY 64 //records per checkpoint
+#define REC_INDEX_GROW 4096 //checkpoints the sidecar grows by at first
+#define REC_INDEX_COMPACT 4096 //dropped checkpoints worth rewriting the sidecar for
+
+//-------------------------STRUCTS-------------------------
+//reads store bytes at a logical offset, like store_read
+typedef ssize_t (*rec_reader_t)(void* arg, char* buf, size_t len, off_t off);
+
+struct rec_index_header {
+	char magic[4];
+	uint32_t every; //REC_INDEX_EVERY it was written with
+	uint64_t base; //checkpoint number of entry 0
+	uint64_t count; //entries in use
+};
+
+struct rec_index {
+	pthread_mutex_t lock;
+	char* path; //sidecar
+	int fd;
+	struct rec_index_header* map; //the sidecar, entries right after the header
+	size_t cap; //entries the mapping has room for
+	rec_reader_t read;
+	void* arg;
+	uint64_t total; //complete records appended, ever
+	uint64_t first; //number of the oldest kept one
+	off_t start; //where it starts
+	off_t last_end; //just past the newest one
+	off_t scanned; //store offset indexed up to
+	int broken; //1 once the index can't be trusted, queries are off
+};
+
+//records [first, first + count) of the store, bytes [from, to)
+struct rec_span {
+	uint64_t base; //absolute number of record 0, the oldest kept
+	long first;
+	long count;
+	off_t from;
+	off_t to;
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* REC_INDEX_OPEN
+ * Description: opens the sidecar of a store and catches up with the
+ *   store: a sidecar that matches it only has the records appended
+ *   after its last checkpoint indexed, anything else (none, torn,
+ *   stale) is rebuilt from the store. Failing that, the index is
+ *   marked broken and the store runs on without record queries.
+ * Input:
+ *  ix = index
+ *  path = sidecar file
+ *  start, size = logical offsets of the store's oldest byte and end
+ *  read, arg = how to read the store
+ * Output: N/A
+ */
+void rec_index_open(struct rec_index* ix, const char* path, off_t start, off_t size, rec_reader_t read, void* arg);
+
+/* REC_INDEX_ADD
+ * Description: indexes bytes appended to the store, which must
+ *   follow what was indexed before
+ * Input:
+ *  ix = index
+ *  data, len = appended bytes
+ *  first = set to the absolute number of the first record they end
+ * Output: how many records they end, -1 if the index is broken
+ */
+long rec_index_add(struct rec_index* ix, const char* data, size_t len, uint64_t* first);
+
+/* REC_INDEX_TRIM
+ * Description: forgets the records retention is dropping from the
+ *   store, which must still be readable up to start.
+ *   A record cut in two keeps its part from start on.
+ * Input:
+ *  ix = index
+ *  start = new logical offset of the store's oldest byte
+ * Output: absolute number of the oldest record kept
+ */
+uint64_t rec_index_trim(struct rec_index* ix, off_t start);
+
+/* REC_INDEX_SPAN
+ * Description: finds records [a, b), clamped to the ones kept.
+ *   A negative a counts from the newest record (-1 is the last one).
+ *   Reads the store, without holding up appends.
+ * Input:
+ *  ix = index
+ *  a, b = record numbers
+ *  s = filled in
+ * Output: 0 on success, -1 if the index is broken or a read failed
+ */
+int rec_index_span(struct rec_index* ix, long a, long b, struct rec_span* s);
+
+/* REC_INDEX_SPAN_AT
+ * Description: rec_index_span by absolute record numbers, counting
+ *   every record the store was given, which stay the same when
+ *   retention drops older ones
+ * Input:
+ *  ix = index
+ *  a, b = absolute record numbers
+ *  s = filled in
+ * Output: 0 on success, -1 if the index is broken or a read failed
+ */
+int rec_index_span_at(struct rec_index* ix, uint64_t a, uint64_t b, struct rec_span* s);
+
+/* REC_INDEX_CLOSE
+ * Description: writes the sidecar out and closes it
+ * Input:
+ *  ix = index
+ *  remove = 1 to delete the sidecar, along with the store
+ * Output: N/A
+ */
+void rec_index_close(struct rec_index* ix, int remove);
+
+#endif /* RECINDEX_H_ */
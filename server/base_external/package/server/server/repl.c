@@ -0,0 +1,502 @@
+/* Replication
+ * Description:
+ *  The leader thread serves one follower at a time: after the
+ *  handshake it reads the store from the follower's end on, a frame at
+ *  a time, and sends while the window allows, reading acks in between.
+ *  With nothing left to send it sleeps in poll; the store's append hook
+ *  wakes it through an eventfd, which costs the append path a load,
+ *  and a write only when the thread is asleep (the same handshake as
+ *  the shared memory rings: set waiting, recheck, sleep).
+ *
+ *  The follower thread appends each frame as it arrives, then acks
+ *  the batch of frames it found waiting as received, waits for its
+ *  store's sync policy and acks it again as durable.
+ *
+ *  Writers only wait under an ack policy, once per write (or storage
+ *  stage batch), on a condition the leader thread signals for each ack.
+ *  A write that times out marks the follower lagging: writes then stop
+ *  waiting until its acks catch up with the store.
+ */
+
+#define _GNU_SOURCE
+#include "repl.h"
+#include "trace.h"
+#include "place.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define REPL_HELLO_LEN 12 //magic, u64
+#define REPL_FRAME_HDR 12 //u32, u64
+#define REPL_ACK_LEN 16 //u64, u64
+
+static void put64(char* p, uint64_t v) {
+	v = htobe64(v);
+	memcpy(p, &v, sizeof v);
+}
+
+static uint64_t get64(const char* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return be64toh(v);
+}
+
+int repl_parse_leader(const char* arg, struct repl_opts* o) {
+	char* copy = strdup(arg);
+	if(!copy) return -1;
+	int result = 0;
+	char* save = NULL;
+	char* tok = strtok_r(copy, ",", &save);
+	if(!tok) result = -1;
+	else {
+		free(o->listen);
+		o->listen = strdup(tok);
+		if(!o->listen) result = -1;
+	}
+	if(o->timeout_ms == 0) o->timeout_ms = REPL_TIMEOUT_MS;
+	while(!result && (tok = strtok_r(NULL, ",", &save))) {
+		char* eq = strchr(tok, '=');
+		if(!eq) {
+			result = -1;
+			break;
+		}
+		*eq = '\0';
+		const char* val = eq + 1;
+		if(strcmp(tok, "ack") == 0) {
+			if(strcmp(val, "none") == 0) o->ack = REPL_ACK_NONE;
+			else if(strcmp(val, "received") == 0) o->ack = REPL_ACK_RECEIVED;
+			else if(strcmp(val, "durable") == 0) o->ack = REPL_ACK_DURABLE;
+			else result = -1;
+		}
+		else if(strcmp(tok, "timeout") == 0) {
+			char* end = NULL;
+			long ms = strtol(val, &end, 10);
+			if(*end != '\0' || ms <= 0) result = -1;
+			else o->timeout_ms = ms;
+		}
+		else result = -1;
+	}
+	free(copy);
+	return result;
+}
+
+//replication threads leave the signals to main
+static void block_signals(void) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGALRM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+//a peer that stops reading or writing for REPL_IO_TIMEOUT_MS is dropped
+static void set_timeouts(int fd) {
+	struct timeval tv = { REPL_IO_TIMEOUT_MS / 1000, REPL_IO_TIMEOUT_MS % 1000 * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes); //frames are batched already
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof yes);
+}
+
+static int send_full(int fd, const char* data, size_t len) {
+	while(len) {
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if(n == -1 && errno == EINTR) continue;
+		if(n <= 0) return -1;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* RECV_FULL
+ * Description: reads len bytes, as long as it takes until efd is
+ *   readable (shutdown or promotion), or without efd (-1) for at most
+ *   REPL_IO_TIMEOUT_MS
+ * Output: 0 on success, -1 on error, timeout, end of stream or efd
+ */
+static int recv_full(int fd, int efd, char* buf, size_t len) {
+	while(len) {
+		struct pollfd p[2] = { { fd, POLLIN, 0 }, { efd, POLLIN, 0 } };
+		int rc = poll(p, efd == -1 ? 1 : 2, efd == -1 ? REPL_IO_TIMEOUT_MS : -1);
+		if(rc == -1 && errno == EINTR) continue;
+		if(rc <= 0 || p[1].revents) return -1;
+		ssize_t n = recv(fd, buf, len, 0);
+		if(n == -1 && errno == EINTR) continue;
+		if(n <= 0) return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void store_appended(void* arg, const char* data, size_t len, off_t end) {
+	struct repl* r = arg;
+	uint64_t one = 1;
+	atomic_thread_fence(memory_order_seq_cst); //the new size before waiting, see leader_thread
+	if(atomic_load_explicit(&r->waiting, memory_order_relaxed) && atomic_exchange(&r->waiting, 0))
+		write(r->wake_efd, &one, sizeof one);
+}
+
+//what the ack policy waits for, lock held
+static off_t acked(struct repl* r) {
+	return r->opts.ack == REPL_ACK_DURABLE ? r->durable : r->received;
+}
+
+static void take_ack(struct repl* r, const char* a) {
+	off_t received = get64(a);
+	off_t durable = get64(a + 8);
+	pthread_mutex_lock(&r->lock);
+	if(received > r->received) r->received = received;
+	if(durable > r->durable) r->durable = durable;
+	if(r->lagging && acked(r) >= store_size(r->st)) {
+		r->lagging = 0;
+		syslog(LOG_INFO, "Follower caught up at %lld\n", (long long)acked(r));
+	}
+	pthread_cond_broadcast(&r->acked);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* SERVE_FOLLOWER
+ * Description: handshake with a follower, then streams the store to it
+ *   until it goes away or replication stops
+ * Input:
+ *  r = replication state
+ *  fd = follower's connection
+ *  buf = REPL_FRAME_HDR + REPL_BATCH bytes
+ * Output: N/A
+ */
+static void serve_follower(struct repl* r, int fd, char* buf) {
+	set_timeouts(fd);
+	char hello[REPL_HELLO_LEN];
+	if(recv_full(fd, -1, hello, sizeof hello) != 0 || memcmp(hello, REPL_MAGIC, 4) != 0) {
+		syslog(LOG_ERR, "Bad follower handshake\n");
+		return;
+	}
+	off_t sent = get64(hello + 4);
+	off_t start = store_start(r->st);
+	off_t size = store_size(r->st);
+	int ok = sent >= start && sent <= size;
+	memcpy(hello, REPL_MAGIC, 4);
+	put64(hello + 4, ok ? (uint64_t)sent : UINT64_MAX);
+	if(send_full(fd, hello, sizeof hello) != 0 || !ok) {
+		if(!ok) syslog(LOG_ERR, "Follower at %lld can't follow [%lld, %lld], give it a copy of the store\n",
+		  (long long)sent, (long long)start, (long long)size);
+		return;
+	}
+	syslog(LOG_INFO, "Follower attached at %lld\n", (long long)sent);
+	pthread_mutex_lock(&r->lock);
+	r->attached = 1;
+	r->lagging = 0;
+	r->received = sent;
+	r->durable = sent;
+	pthread_mutex_unlock(&r->lock);
+
+	char ack[REPL_ACK_LEN];
+	size_t alen = 0;
+	off_t received = sent; //the leader thread's own copy
+	while(!atomic_load(&r->stop)) {
+		size = store_size(r->st);
+		int window = sent - received < REPL_WINDOW; //else wait for acks
+		int can_send = window && sent < size;
+		if(window && !can_send) {
+			//sleep until an append, with the size rechecked after saying so
+			atomic_store(&r->waiting, 1);
+			if(store_size(r->st) != size) {
+				atomic_store(&r->waiting, 0);
+				continue;
+			}
+		}
+		struct pollfd p[2] = { { fd, POLLIN, 0 }, { r->wake_efd, POLLIN, 0 } };
+		int rc = poll(p, 2, can_send ? 0 : -1);
+		atomic_store(&r->waiting, 0);
+		if(rc == -1 && errno != EINTR) break;
+		if(p[1].revents) {
+			uint64_t n;
+			read(r->wake_efd, &n, sizeof n);
+		}
+
+		//acks, a piece at a time as they come
+		if(p[0].revents) {
+			ssize_t n = recv(fd, ack + alen, sizeof ack - alen, MSG_DONTWAIT);
+			if(n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+				syslog(LOG_INFO, "Follower went away at %lld\n", (long long)received);
+				break;
+			}
+			if(n > 0 && (alen += n) == sizeof ack) {
+				take_ack(r, ack);
+				received = get64(ack);
+				alen = 0;
+			}
+		}
+		if(!can_send) continue;
+
+		//the next frame, ending with a record when it can
+		size_t len = size - sent < REPL_BATCH ? size - sent : REPL_BATCH;
+		ssize_t n = store_read(r->st, buf + REPL_FRAME_HDR, len, sent);
+		if(n <= 0) {
+			syslog(LOG_ERR, "Follower fell behind retention at %lld\n", (long long)sent);
+			break;
+		}
+		const char* eol = memrchr(buf + REPL_FRAME_HDR, '\n', n);
+		if(eol) n = eol - (buf + REPL_FRAME_HDR) + 1;
+		uint32_t n32 = htonl(n);
+		memcpy(buf, &n32, sizeof n32);
+		put64(buf + 4, sent);
+		if(send_full(fd, buf, REPL_FRAME_HDR + n) != 0) {
+			syslog(LOG_ERR, "Failed to send to follower:%m\n");
+			break;
+		}
+		sent += n;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	r->attached = 0;
+	pthread_cond_broadcast(&r->acked);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* LEADER_THREAD
+ * Description: accepts followers one at a time and serves them
+ */
+static void* leader_thread(void* arg) {
+	struct repl* r = arg;
+	block_signals();
+	TRACE_THREAD("leader", 0);
+	place_thread(PLACE_OTHER);
+	char* buf = malloc(REPL_FRAME_HDR + REPL_BATCH);
+	while(buf && !atomic_load(&r->stop)) {
+		struct pollfd p[2] = { { r->lfd, POLLIN, 0 }, { r->wake_efd, POLLIN, 0 } };
+		if(poll(p, 2, -1) == -1 && errno != EINTR) break;
+		if(p[1].revents) {
+			uint64_t n;
+			read(r->wake_efd, &n, sizeof n);
+		}
+		if(!(p[0].revents & POLLIN)) continue;
+		int fd = accept(r->lfd, NULL, NULL);
+		if(fd == -1) continue;
+		serve_follower(r, fd, buf);
+		close(fd);
+	}
+	free(buf);
+	return NULL;
+}
+
+//connects to "host:port" ("[v6 addr]:port"), -1 on error
+static int connect_leader(const char* spec) {
+	char host[NI_MAXHOST];
+	const char* colon = strrchr(spec, ':');
+	if(!colon) return -1;
+	const char* h = spec;
+	size_t hlen = colon - spec;
+	if(hlen >= 2 && h[0] == '[' && h[hlen - 1] == ']') {
+		h++;
+		hlen -= 2;
+	}
+	if(hlen == 0 || hlen >= sizeof host) return -1;
+	memcpy(host, h, hlen);
+	host[hlen] = '\0';
+
+	struct addrinfo hint;
+	memset(&hint, 0, sizeof hint);
+	hint.ai_socktype = SOCK_STREAM;
+	struct addrinfo* addr;
+	if(getaddrinfo(host, colon + 1, &hint, &addr) != 0) return -1;
+	int fd = -1;
+	for(struct addrinfo* rp = addr; rp && fd == -1; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+		if(fd != -1 && connect(fd, rp->ai_addr, rp->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addr);
+	return fd;
+}
+
+/* FOLLOW
+ * Description: handshake with the leader, then appends its frames to
+ *   the store until the connection ends, or replication stops
+ * Input:
+ *  r = replication state
+ *  fd = connection to the leader
+ *  buf = REPL_BATCH bytes
+ * Output: N/A
+ */
+static void follow(struct repl* r, int fd, char* buf) {
+	set_timeouts(fd);
+	char msg[REPL_ACK_LEN];
+	off_t end = store_size(r->st);
+	memcpy(msg, REPL_MAGIC, 4);
+	put64(msg + 4, end);
+	if(send_full(fd, msg, REPL_HELLO_LEN) != 0 || recv_full(fd, r->follow_efd, msg, REPL_HELLO_LEN) != 0 ||
+	  memcmp(msg, REPL_MAGIC, 4) != 0)
+		return;
+	if(get64(msg + 4) != (uint64_t)end) {
+		syslog(LOG_ERR, "Leader %s can't be followed from %lld\n", r->opts.leader, (long long)end);
+		return;
+	}
+	syslog(LOG_INFO, "Following %s from %lld\n", r->opts.leader, (long long)end);
+	off_t durable = end; //what this side acked as durable
+
+	while(1) {
+		//every frame already here, then one ack for them
+		do {
+			char hdr[REPL_FRAME_HDR];
+			if(recv_full(fd, r->follow_efd, hdr, sizeof hdr) != 0) return;
+			uint32_t len;
+			memcpy(&len, hdr, sizeof len);
+			len = ntohl(len);
+			if(len == 0 || len > REPL_BATCH || get64(hdr + 4) != (uint64_t)end) {
+				syslog(LOG_ERR, "Bad frame from leader at %lld\n", (long long)end);
+				return;
+			}
+			if(recv_full(fd, r->follow_efd, buf, len) != 0) return;
+			if(!atomic_load(&r->following)) return; //promoted meanwhile
+			end = store_write(r->st, buf, len);
+			if(end == -1) return;
+		} while(recv(fd, msg, 1, MSG_PEEK | MSG_DONTWAIT) > 0);
+
+		put64(msg, end);
+		put64(msg + 8, durable);
+		if(send_full(fd, msg, sizeof msg) != 0) return;
+		store_wait_durable(r->st, end);
+		durable = end;
+		put64(msg + 8, durable);
+		if(send_full(fd, msg, sizeof msg) != 0) return;
+	}
+}
+
+/* FOLLOWER_THREAD
+ * Description: follows the leader, reconnecting every REPL_RETRY_MS
+ *   until promoted
+ */
+static void* follower_thread(void* arg) {
+	struct repl* r = arg;
+	block_signals();
+	TRACE_THREAD("follower", 0);
+	place_thread(PLACE_OTHER);
+	char* buf = malloc(REPL_BATCH);
+	while(buf && atomic_load(&r->following) && !atomic_load(&r->stop)) {
+		int fd = connect_leader(r->opts.leader);
+		if(fd != -1) {
+			follow(r, fd, buf);
+			close(fd);
+		}
+		struct pollfd p = { r->follow_efd, POLLIN, 0 };
+		if(poll(&p, 1, REPL_RETRY_MS) > 0) break;
+	}
+	free(buf);
+	return NULL;
+}
+
+int repl_start(struct repl* r, const struct repl_opts* o, struct store* st, int lfd) {
+	memset(r, 0, sizeof *r);
+	r->opts = *o;
+	r->st = st;
+	r->lfd = lfd;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&r->acked, &ca);
+	pthread_condattr_destroy(&ca);
+	r->wake_efd = eventfd(0, EFD_CLOEXEC);
+	r->follow_efd = eventfd(0, EFD_CLOEXEC);
+	if(r->wake_efd == -1 || r->follow_efd == -1) {
+		syslog(LOG_ERR, "Failed to create replication eventfd:%m\n");
+		return -1;
+	}
+
+	if(o->leader) {
+		atomic_store(&r->following, 1);
+		if(pthread_create(&r->follower, NULL, follower_thread, r) != 0) {
+			syslog(LOG_ERR, "Failed to create follower thread.\n");
+			return -1;
+		}
+		r->follower_running = 1;
+	}
+	if(lfd != -1) {
+		if(store_add_hook(st, store_appended, r) != 0) return -1;
+		if(pthread_create(&r->leader, NULL, leader_thread, r) != 0) {
+			syslog(LOG_ERR, "Failed to create leader thread.\n");
+			return -1;
+		}
+		r->leader_running = 1;
+	}
+	return 0;
+}
+
+int repl_following(struct repl* r) {
+	return atomic_load_explicit(&r->following, memory_order_relaxed);
+}
+
+int repl_active(struct repl* r) {
+	return r->st != NULL;
+}
+
+void repl_wait(struct repl* r, off_t end) {
+	if(r->opts.ack == REPL_ACK_NONE) return;
+	pthread_mutex_lock(&r->lock);
+	if(r->attached && !r->lagging && acked(r) < end) {
+		struct timespec due;
+		clock_gettime(CLOCK_MONOTONIC, &due);
+		due.tv_sec += r->opts.timeout_ms / 1000;
+		due.tv_nsec += r->opts.timeout_ms % 1000 * 1000000L;
+		if(due.tv_nsec >= 1000000000L) {
+			due.tv_sec++;
+			due.tv_nsec -= 1000000000L;
+		}
+		while(r->attached && !r->lagging && acked(r) < end) {
+			if(pthread_cond_timedwait(&r->acked, &r->lock, &due) == ETIMEDOUT) {
+				r->lagging = 1;
+				syslog(LOG_WARNING, "Follower is lagging at %lld, writes stop waiting on it\n", (long long)acked(r));
+			}
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+off_t repl_promote(struct repl* r) {
+	if(!atomic_exchange(&r->following, 0)) return -1;
+	uint64_t one = 1;
+	write(r->follow_efd, &one, sizeof one);
+	pthread_join(r->follower, NULL);
+	r->follower_running = 0;
+	syslog(LOG_INFO, "Promoted, taking packets from %lld\n", (long long)store_size(r->st));
+	return store_size(r->st);
+}
+
+void repl_stop(struct repl* r) {
+	uint64_t one = 1;
+	atomic_store(&r->stop, 1);
+	if(r->wake_efd != -1) write(r->wake_efd, &one, sizeof one);
+	if(r->follow_efd != -1) write(r->follow_efd, &one, sizeof one);
+	if(r->leader_running) pthread_join(r->leader, NULL);
+	if(r->follower_running && atomic_exchange(&r->following, 0)) pthread_join(r->follower, NULL);
+	r->leader_running = r->follower_running = 0;
+	if(r->st) store_remove_hook(r->st, store_appended, r);
+	if(r->lfd != -1) close(r->lfd);
+	if(r->wake_efd != -1) close(r->wake_efd);
+	if(r->follow_efd != -1) close(r->follow_efd);
+	r->lfd = r->wake_efd = r->follow_efd = -1;
+	pthread_cond_destroy(&r->acked);
+	pthread_mutex_destroy(&r->lock);
+}
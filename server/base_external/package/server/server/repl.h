@@ -0,0 +1,142 @@
+/*
+ * repl.h
+ *
+ *  Replication of the user space store to a follower aesdsocket, so
+ *  a second box holds the data when the leader's SD card dies.
+ *  The leader (-R) takes one follower at a time on its own port and
+ *  streams what is appended to its store; the follower (-F) appends
+ *  it to its own store at the same offsets and answers queries, but
+ *  takes no packets of its own until promoted with "AESD_PROMOTE\n".
+ *  A follower can itself be the leader of another one.
+ *
+ *  Wire format, integers in network byte order:
+ *   follower hello: REPL_MAGIC, u64 end of its store
+ *   leader welcome: REPL_MAGIC, u64 offset the stream starts at
+ *     (the follower's end), all ones if the follower can't follow
+ *     from there (ahead of the leader or behind its retention)
+ *   frames: u32 length, u64 offset, then that many store bytes
+ *   acks from the follower: u64 received, u64 durable offsets
+ *  Frames go out without waiting for acks, up to REPL_WINDOW bytes
+ *  past the received offset.
+ */
+
+#ifndef REPL_H_
+#define REPL_H_
+//-------------------------INCLUDES-------------------------
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "store.h"
+
+//-------------------------DEFINES-------------------------
+#define REPL_MAGIC "AZRP"
+#define REPL_BATCH 65536 //store bytes per frame at most, cut at a record end when there is one
+#define REPL_WINDOW (4 << 20) //bytes sent past what the follower received
+#define REPL_TIMEOUT_MS 1000 //longest a write waits on the follower by default
+#define REPL_RETRY_MS 1000 //between a follower's tries to reach its leader
+#define REPL_IO_TIMEOUT_MS 5000 //a peer this slow is dropped
+#define PROMOTE_CMD "AESD_PROMOTE" //answered with "AESD_PROMOTE:end\n" or ":error"
+#define PROMOTE_CMD_L 12
+
+//-------------------------STRUCTS-------------------------
+//what a write waits for from the follower before it is echoed
+enum repl_ack {
+	REPL_ACK_NONE = 0, //nothing, replication runs behind
+	REPL_ACK_RECEIVED, //the follower appended it
+	REPL_ACK_DURABLE   //the follower's sync policy covered it
+};
+
+struct repl_opts {
+	char* listen; //-R address followers connect to, NULL if none
+	const char* leader; //-F host:port to follow, NULL if none
+	enum repl_ack ack;
+	int timeout_ms; //then the follower is lagging and writes stop waiting
+};
+
+struct repl {
+	struct repl_opts opts;
+	struct store* st;
+	int lfd; //listening for followers, -1 if none
+	int wake_efd; //appends and shutdown wake the leader thread
+	int follow_efd; //shutdown and promotion wake the follower thread
+	atomic_int waiting; //1 while the leader thread sleeps on wake_efd
+	atomic_int following; //1 while following a leader
+	atomic_int stop;
+
+	//the follower's acks, under lock
+	pthread_mutex_t lock;
+	pthread_cond_t acked; //wakes writers waiting on the follower
+	int attached; //1 while a follower is connected
+	int lagging; //1 once a write timed out, until the follower catches up
+	off_t received;
+	off_t durable;
+
+	pthread_t leader;
+	pthread_t follower;
+	int leader_running;
+	int follower_running;
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* REPL_PARSE_LEADER
+ * Description: parses -R: where to listen (as for -l), then
+ *   optionally ",ack=none|received|durable" and ",timeout=ms"
+ * Input:
+ *  arg = option argument
+ *  o = filled in
+ * Output: 0 on success, -1 if malformed
+ */
+int repl_parse_leader(const char* arg, struct repl_opts* o);
+
+/* REPL_START
+ * Description: starts leading on lfd and/or following o->leader
+ *   for the store, which must outlive replication
+ * Input:
+ *  r = replication state
+ *  o = options, copied
+ *  st = open store
+ *  lfd = listening socket for followers, -1 if none
+ * Output: 0 on success, -1 on error
+ */
+int repl_start(struct repl* r, const struct repl_opts* o, struct store* st, int lfd);
+
+/* REPL_FOLLOWING
+ * Description: whether the store only takes its leader's records
+ * Input: r = replication state
+ * Output: 1 while following, 0 otherwise
+ */
+int repl_following(struct repl* r);
+
+/* REPL_ACTIVE
+ * Description: whether replication was started, as leader or follower
+ * Input: r = replication state
+ * Output: 1 if it was, 0 otherwise
+ */
+int repl_active(struct repl* r);
+
+/* REPL_WAIT
+ * Description: waits until the follower acknowledged the store up to
+ *   end as the ack policy asks, at most the timeout. Returns right
+ *   away with no follower, or one found lagging.
+ * Input:
+ *  r = replication state
+ *  end = offset just past the write
+ * Output: N/A
+ */
+void repl_wait(struct repl* r, off_t end);
+
+/* REPL_PROMOTE
+ * Description: stops following, so the store takes packets again
+ * Input: r = replication state
+ * Output: end of the store then, -1 if it wasn't following
+ */
+off_t repl_promote(struct repl* r);
+
+/* REPL_STOP
+ * Description: stops replication, closing the connections
+ * Input: r = replication state
+ * Output: N/A
+ */
+void repl_stop(struct repl* r);
+
+#endif /* REPL_H_ */
@@ -0,0 +1,142 @@
+/* Newline scanner
+ * Description:
+ *  Every received byte has to be checked for the packet delimiter, so
+ *  this compares four vector registers' worth of bytes per step with a
+ *  single branch, and only once a step matched turns the comparison into
+ *  a bit mask whose lowest set bit is the answer.
+ *  The heads and tails shorter than a vector go through the scalar
+ *  version, which checks 8 bytes per step with the usual
+ *  "has zero byte" trick on the word xor'ed with '\n' repeated.
+ */
+
+#include "scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCAN_NEON 1
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define NLS   (ONES * '\n')
+
+const char* scan_newline_scalar(const char* p, size_t len) {
+	size_t i = 0;
+	for(; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, sizeof w);
+		w ^= NLS; //newline bytes become zero
+		if((w - ONES) & ~w & HIGHS) break; //one of these 8 is it
+	}
+	for(; i < len; i++)
+		if(p[i] == '\n') return p + i;
+	return NULL;
+}
+
+#ifdef SCAN_NEON
+static const char* scan_neon(const char* p, size_t len) {
+	const uint8x16_t nl = vdupq_n_u8('\n');
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64) {
+		uint8x16_t a = vceqq_u8(vld1q_u8((const uint8_t*)p + i), nl);
+		uint8x16_t b = vceqq_u8(vld1q_u8((const uint8_t*)p + i + 16), nl);
+		uint8x16_t c = vceqq_u8(vld1q_u8((const uint8_t*)p + i + 32), nl);
+		uint8x16_t d = vceqq_u8(vld1q_u8((const uint8_t*)p + i + 48), nl);
+		uint8x16_t any = vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d));
+		uint8x8_t fold = vorr_u8(vget_low_u8(any), vget_high_u8(any));
+		if(vget_lane_u64(vreinterpret_u64_u8(fold), 0)) break;
+	}
+	for(; i + 16 <= len; i += 16) {
+		uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*)p + i), nl);
+		//narrow each byte to a nibble: 64 bit mask, 4 bits per byte
+		uint8x8_t nib = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+		uint64_t m = vget_lane_u64(vreinterpret_u64_u8(nib), 0);
+		if(m) return p + i + (__builtin_ctzll(m) >> 2);
+	}
+	return scan_newline_scalar(p + i, len - i);
+}
+#endif
+
+#ifdef SCAN_X86
+static const char* scan_sse2(const char* p, size_t len) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64) {
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), nl);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 16)), nl);
+		__m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 32)), nl);
+		__m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 48)), nl);
+		__m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if(_mm_movemask_epi8(any)) break;
+	}
+	for(; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+		unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		if(m) return p + i + __builtin_ctz(m);
+	}
+	return scan_newline_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_avx2(const char* p, size_t len) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i = 0;
+	//4 vectors per step with one branch, located only once something matched
+	for(; i + 128 <= len; i += 128) {
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), nl);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 32)), nl);
+		__m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 64)), nl);
+		__m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 96)), nl);
+		__m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+		if(_mm256_movemask_epi8(any)) break;
+	}
+	for(; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+		unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		if(m) return p + i + __builtin_ctz(m);
+	}
+	return scan_sse2(p + i, len - i);
+}
+#endif
+
+#if defined(SCAN_X86)
+//chosen once at load, before main and any receive thread, and only
+//read afterwards
+static const char* (*scan_fn)(const char*, size_t) = scan_sse2;
+
+__attribute__((constructor))
+static void scan_select(void) {
+	__builtin_cpu_init(); //constructors may run before the CPU model is set up
+	if(__builtin_cpu_supports("avx2")) scan_fn = scan_avx2;
+}
+
+const char* scan_newline(const char* p, size_t len) {
+	return scan_fn(p, len);
+}
+
+const char* scan_impl(void) {
+	return __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+}
+#elif defined(SCAN_NEON)
+const char* scan_newline(const char* p, size_t len) {
+	return scan_neon(p, len);
+}
+
+const char* scan_impl(void) {
+	return "neon";
+}
+#else
+const char* scan_newline(const char* p, size_t len) {
+	return scan_newline_scalar(p, len);
+}
+
+const char* scan_impl(void) {
+	return "scalar";
+}
+#endif
@@ -0,0 +1,34 @@
+/*
+ * scan.h
+ *
+ *  Newline search used to find packet boundaries in received data,
+ *  vectorized for the targets we build on.
+ */
+
+#ifndef SCAN_H_
+#define SCAN_H_
+//-------------------------INCLUDES-------------------------
+#include <stddef.h>
+
+//-------------------------FUNCTIONS-------------------------
+/* SCAN_NEWLINE
+ * Description: finds the first '\n'
+ *   NEON on ARM (the Pi 4 Cortex-A72), AVX2 or SSE2 on x86
+ *   (AVX2 picked at runtime), 8 bytes at a time otherwise.
+ * Input:
+ *  p, len = bytes to search
+ * Output: pointer to the first newline, NULL if there is none
+ */
+const char* scan_newline(const char* p, size_t len);
+
+/* SCAN_NEWLINE_SCALAR
+ * Description: the portable version, exposed for the benchmark
+ */
+const char* scan_newline_scalar(const char* p, size_t len);
+
+/* SCAN_IMPL
+ * Description: name of the implementation scan_newline uses
+ */
+const char* scan_impl(void);
+
+#endif /* SCAN_H_ */
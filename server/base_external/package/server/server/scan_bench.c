@@ -0,0 +1,68 @@
+/* Newline scanner micro-benchmark
+ * Description:
+ *  Times scan_newline against the scalar version, memchr and a plain
+ *  byte loop on buffers with the newline at the very end, which is what
+ *  framing a large packet costs. One line per case:
+ *    scan impl=NAME size=BYTES mbps=N
+ *  Usage: ./scanBench [total MB per case, default 256]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scan.h"
+
+typedef const char* (*scan_t)(const char*, size_t);
+
+static const char* scan_memchr(const char* p, size_t len) {
+	return memchr(p, '\n', len);
+}
+
+static const char* scan_bytes(const char* p, size_t len) {
+	for(size_t i = 0; i < len; i++)
+		if(p[i] == '\n') return p + i;
+	return NULL;
+}
+
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+	size_t total = (argc > 1 ? atol(argv[1]) : 256) << 20;
+	const size_t sizes[] = { 64, 1024, 65536, 1 << 20 };
+	struct { const char* name; scan_t fn; } impls[] = {
+		{ scan_impl(), scan_newline },
+		{ "scalar", scan_newline_scalar },
+		{ "memchr", scan_memchr },
+		{ "bytes", scan_bytes },
+	};
+	
+	char* buf = malloc(sizes[3]);
+	if(!buf) return 1;
+	for(size_t i = 0; i < sizes[3]; i++) buf[i] = 'a' + i % 26;
+	
+	for(size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+		size_t len = sizes[s];
+		buf[len - 1] = '\n';
+		size_t iters = total / len;
+		for(size_t k = 0; k < sizeof impls / sizeof impls[0]; k++) {
+			volatile size_t sink = 0;
+			double t0 = now_s();
+			for(size_t i = 0; i < iters; i++)
+				sink += impls[k].fn(buf, len) - buf;
+			double t = now_s() - t0;
+			if(sink != iters * (len - 1)) {
+				printf("scan impl=%s size=%zu error=wrong_offset\n", impls[k].name, len);
+				return 1;
+			}
+			printf("scan impl=%s size=%zu mbps=%.0f\n", impls[k].name, len, iters * len / t / 1e6);
+		}
+		buf[len - 1] = 'a';
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,353 @@
+/* Trigram search
+ * Description:
+ *  Blocks are numbered like records, from every record the store was
+ *  given (block n holds records n * SEARCH_BLOCK_RECORDS on), so a
+ *  block keeps its number when retention drops older ones. The indexer
+ *  reads a complete block without any lock, then adds its trigrams to
+ *  the table under the index lock; as blocks only ever get added at
+ *  the end, every posting list stays sorted and a block number is
+ *  stored as the (mostly one byte) varint of its distance from the one
+ *  before it.
+ *
+ *  Dropped blocks stay in the lists until they are most of what is
+ *  indexed, then the index is cleared and rebuilt from the oldest block
+ *  kept, like the record index is compacted. Searches skip them.
+ *
+ *  A search takes the list of the text's rarest trigram and walks the
+ *  others through it, keeping the blocks found in all of them. Those
+ *  blocks, then the ones not indexed yet, are read and checked record
+ *  by record with memmem, as trigrams only narrow the blocks down.
+ */
+
+#define _GNU_SOURCE
+#include "search.h"
+#include "scan.h"
+#include "trace.h"
+#include "place.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+//store bytes read at once, grown to a block as needed
+struct block_buf {
+	char* data;
+	size_t cap;
+	size_t len;
+};
+
+static uint32_t gram_at(const char* p) {
+	return (uint32_t)(uint8_t)p[0] << 16 | (uint32_t)(uint8_t)p[1] << 8 | (uint8_t)p[2];
+}
+
+//the slot of gram, or the free one it would go in. lock held
+static struct posting* find_posting(struct posting* table, size_t slots, uint32_t gram) {
+	size_t mask = slots - 1;
+	size_t i = (uint32_t)(gram * 2654435761u) >> 8;
+	for(;; i++) {
+		struct posting* p = &table[i & mask];
+		if(p->key == 0 || p->key == gram + 1) return p;
+	}
+}
+
+//doubles the table, lock held
+static int grow_table(struct search_index* sx) {
+	size_t slots = sx->slots ? sx->slots * 2 : SEARCH_TABLE_SLOTS;
+	struct posting* table = calloc(slots, sizeof *table);
+	if(!table) return -1;
+	for(size_t i = 0; i < sx->slots; i++)
+		if(sx->table[i].key) *find_posting(table, slots, sx->table[i].key - 1) = sx->table[i];
+	free(sx->table);
+	sx->table = table;
+	sx->slots = slots;
+	return 0;
+}
+
+//drops everything indexed, lock held
+static void clear_table(struct search_index* sx) {
+	for(size_t i = 0; i < sx->slots; i++) free(sx->table[i].data);
+	free(sx->table);
+	sx->table = NULL;
+	sx->slots = 0;
+	sx->used = 0;
+	sx->bytes = 0;
+}
+
+//adds block blk to the list of gram, lock held
+static int add_gram(struct search_index* sx, uint32_t gram, uint64_t blk) {
+	if(sx->used * 2 >= sx->slots && grow_table(sx) != 0) return -1;
+	struct posting* p = find_posting(sx->table, sx->slots, gram);
+	if(p->key == 0) {
+		p->key = gram + 1;
+		sx->used++;
+	}
+	else if(p->last == blk) return 0;
+
+	if(p->len + 10 > p->cap) { //room for the longest varint
+		uint32_t cap = p->cap ? p->cap * 2 : 8;
+		uint8_t* data = realloc(p->data, cap);
+		if(!data) return -1;
+		p->data = data;
+		p->cap = cap;
+	}
+	uint64_t d = blk - p->last;
+	uint32_t len = p->len;
+	do {
+		uint8_t c = d & 0x7f;
+		d >>= 7;
+		p->data[p->len++] = c | (d ? 0x80 : 0);
+	} while(d);
+	sx->bytes += p->len - len;
+	p->last = blk;
+	return 0;
+}
+
+//next block number of a list, from the one before. *i at the end means none
+static uint64_t next_block(const struct posting* p, uint32_t* i, uint64_t prev) {
+	uint64_t d = 0;
+	int shift = 0;
+	uint8_t c;
+	do {
+		c = p->data[(*i)++];
+		d |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while(c & 0x80);
+	return prev + d;
+}
+
+/* READ_BLOCK
+ * Description: reads the complete records of block blk into b
+ * Output: 0 on success (b->len may be 0, the block being gone or not
+ *   started), -1 if the store couldn't be read
+ */
+static int read_block(struct store* st, uint64_t blk, struct block_buf* b) {
+	struct rec_span s;
+	b->len = 0;
+	if(store_records_at(st, blk * SEARCH_BLOCK_RECORDS, (blk + 1) * SEARCH_BLOCK_RECORDS, &s) != 0) return -1;
+	size_t len = s.to - s.from;
+	if(len > b->cap) {
+		char* data = realloc(b->data, len);
+		if(!data) return -1;
+		b->data = data;
+		b->cap = len;
+	}
+	while(b->len < len) {
+		ssize_t n = store_read(st, b->data + b->len, len - b->len, s.from + b->len);
+		if(n <= 0) return -1;
+		b->len += n;
+	}
+	return 0;
+}
+
+//indexes the trigrams of the records in b as block blk, lock held
+static int index_block(struct search_index* sx, const struct block_buf* b, uint64_t blk) {
+	const char* p = b->data;
+	const char* end = b->data + b->len;
+	const char* eol;
+	while((eol = scan_newline(p, end - p)) != NULL) {
+		for(; p + 3 <= eol; p++)
+			if(add_gram(sx, gram_at(p), blk) != 0) return -1;
+		p = eol + 1;
+	}
+	return 0;
+}
+
+/* INDEXER
+ * Description: thread indexing each block of the store once it is
+ *   complete, and rebuilding the index once retention dropped most of
+ *   the blocks in it
+ */
+static void* indexer(void* arg) {
+	struct search_index* sx = arg;
+	struct block_buf b = { NULL, 0, 0 };
+	TRACE_THREAD("indexer", 0);
+	place_thread(PLACE_OTHER);
+
+	pthread_mutex_lock(&sx->lock);
+	while(!sx->stop) {
+		pthread_mutex_unlock(&sx->lock);
+		struct rec_span s = { 0 };
+		int ok = store_records_at(sx->st, 0, UINT64_MAX, &s) == 0;
+		uint64_t total = s.base + s.count;
+		pthread_mutex_lock(&sx->lock);
+
+		uint64_t kept = ok ? s.base / SEARCH_BLOCK_RECORDS : 0; //oldest block kept
+		uint64_t dead = kept > sx->from ? kept - sx->from : 0;
+		uint64_t live = sx->to > kept ? sx->to - kept : 0;
+		if(ok && dead > 0 && dead >= live) {
+			clear_table(sx);
+			sx->from = kept;
+			sx->to = kept;
+			sx->broken = 0; //memory may have been freed since
+		}
+
+		//one block at a time, searches get the lock in between
+		while(ok && !sx->stop && !sx->broken && (sx->to + 1) * SEARCH_BLOCK_RECORDS <= total) {
+			uint64_t blk = sx->to;
+			pthread_mutex_unlock(&sx->lock);
+			int rc = read_block(sx->st, blk, &b);
+			pthread_mutex_lock(&sx->lock);
+			if(rc != 0) {
+				syslog(LOG_ERR, "Failed to read records to index\n");
+				break;
+			}
+			if(index_block(sx, &b, blk) != 0) {
+				syslog(LOG_ERR, "Search index out of memory at %zu bytes, searches read every record\n", sx->bytes);
+				clear_table(sx);
+				sx->broken = 1;
+				sx->from = sx->to = kept;
+				break;
+			}
+			sx->to = blk + 1;
+		}
+
+		struct timespec due;
+		clock_gettime(CLOCK_MONOTONIC, &due);
+		due.tv_sec += SEARCH_POLL_MS / 1000;
+		due.tv_nsec += SEARCH_POLL_MS % 1000 * 1000000L;
+		if(due.tv_nsec >= 1000000000L) {
+			due.tv_sec++;
+			due.tv_nsec -= 1000000000L;
+		}
+		while(!sx->stop && pthread_cond_timedwait(&sx->wake, &sx->lock, &due) != ETIMEDOUT);
+	}
+	pthread_mutex_unlock(&sx->lock);
+	free(b.data);
+	return NULL;
+}
+
+int search_open(struct search_index* sx, struct store* st) {
+	memset(sx, 0, sizeof *sx);
+	sx->st = st;
+	pthread_mutex_init(&sx->lock, NULL);
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&sx->wake, &ca);
+	pthread_condattr_destroy(&ca);
+	if(pthread_create(&sx->indexer, NULL, indexer, sx) != 0) {
+		syslog(LOG_ERR, "Failed to create search indexer thread.\n");
+		return -1;
+	}
+	sx->running = 1;
+	return 0;
+}
+
+/* CANDIDATES
+ * Description: the indexed blocks that may hold text: those listing
+ *   every trigram of it. lock held.
+ * Output: number of blocks in *out (to be freed), -1 if out of memory
+ */
+static long candidates(struct search_index* sx, const char* text, size_t len, uint64_t** out) {
+	*out = NULL;
+	if(!sx->table) return 0;
+
+	//start from the shortest list
+	struct posting* rare = NULL;
+	for(size_t i = 0; i + 3 <= len; i++) {
+		struct posting* p = find_posting(sx->table, sx->slots, gram_at(text + i));
+		if(p->key == 0) return 0; //in no block
+		if(!rare || p->len < rare->len) rare = p;
+	}
+	uint64_t* c = malloc(rare->len * sizeof *c); //at least a byte per block
+	if(!c) return -1;
+	long n = 0;
+	uint64_t blk = 0;
+	for(uint32_t i = 0; i < rare->len; ) c[n++] = blk = next_block(rare, &i, blk);
+
+	//keep the blocks every other list has too
+	for(size_t t = 0; n > 0 && t + 3 <= len; t++) {
+		struct posting* p = find_posting(sx->table, sx->slots, gram_at(text + t));
+		if(p == rare) continue;
+		long kept = 0;
+		uint32_t i = 0;
+		blk = 0;
+		int more = p->len > 0;
+		if(more) blk = next_block(p, &i, 0);
+		for(long k = 0; k < n && more; k++) {
+			while(blk < c[k] && (more = i < p->len)) blk = next_block(p, &i, blk);
+			if(more && blk == c[k]) c[kept++] = c[k];
+		}
+		n = kept;
+	}
+	*out = c;
+	return n;
+}
+
+//adds the records of b holding text to r, up to SEARCH_MAX_MATCHES
+static int match_block(const struct block_buf* b, const char* text, size_t len, struct search_result* r) {
+	const char* p = b->data;
+	const char* end = b->data + b->len;
+	const char* eol;
+	while(r->count < SEARCH_MAX_MATCHES && (eol = scan_newline(p, end - p)) != NULL) {
+		size_t rlen = eol + 1 - p;
+		if(memmem(p, rlen - 1, text, len)) {
+			if(SEARCH_HEADROOM + r->len + rlen > r->cap) {
+				size_t cap = r->cap ? r->cap : 4096;
+				while(SEARCH_HEADROOM + r->len + rlen > cap) cap *= 2;
+				char* data = realloc(r->data, cap);
+				if(!data) return -1;
+				r->data = data;
+				r->cap = cap;
+			}
+			memcpy(r->data + SEARCH_HEADROOM + r->len, p, rlen);
+			r->len += rlen;
+			r->count++;
+		}
+		p = eol + 1;
+	}
+	return 0;
+}
+
+int search_run(struct search_index* sx, const char* text, size_t len, struct search_result* r) {
+	memset(r, 0, sizeof *r);
+	r->data = malloc(SEARCH_HEADROOM);
+	if(!r->data) return -1;
+	r->cap = SEARCH_HEADROOM;
+
+	//which blocks to read: the candidates among the indexed ones, then the rest
+	uint64_t* c = NULL;
+	long n = 0;
+	pthread_mutex_lock(&sx->lock);
+	uint64_t rest = 0;
+	if(len >= 3 && !sx->broken) {
+		n = candidates(sx, text, len, &c);
+		rest = sx->to;
+	}
+	pthread_mutex_unlock(&sx->lock);
+
+	struct rec_span s = { 0 };
+	struct block_buf b = { NULL, 0, 0 };
+	int rc = n >= 0 && store_records_at(sx->st, 0, UINT64_MAX, &s) == 0 ? 0 : -1;
+	uint64_t kept = s.base / SEARCH_BLOCK_RECORDS;
+	for(long k = 0; rc == 0 && k < n && r->count < SEARCH_MAX_MATCHES; k++)
+		if(c[k] >= kept && (rc = read_block(sx->st, c[k], &b)) == 0)
+			rc = match_block(&b, text, len, r);
+	if(rest < kept) rest = kept;
+	for(uint64_t blk = rest; rc == 0 && blk * SEARCH_BLOCK_RECORDS < s.base + s.count && r->count < SEARCH_MAX_MATCHES; blk++)
+		if((rc = read_block(sx->st, blk, &b)) == 0)
+			rc = match_block(&b, text, len, r);
+	free(b.data);
+	free(c);
+	if(rc != 0) {
+		free(r->data);
+		r->data = NULL;
+	}
+	return rc;
+}
+
+void search_close(struct search_index* sx) {
+	if(sx->running) {
+		pthread_mutex_lock(&sx->lock);
+		sx->stop = 1;
+		pthread_cond_signal(&sx->wake);
+		pthread_mutex_unlock(&sx->lock);
+		pthread_join(sx->indexer, NULL);
+		sx->running = 0;
+	}
+	clear_table(sx);
+	pthread_cond_destroy(&sx->wake);
+	pthread_mutex_destroy(&sx->lock);
+}
@@ -0,0 +1,95 @@
+/*
+ * search.h
+ *
+ *  Substring search over the user space store's records, backed by a
+ *  trigram index kept in memory. Records are indexed a block of
+ *  SEARCH_BLOCK_RECORDS at a time, once the block is complete, by a
+ *  thread of its own, so appends never wait on it. For every trigram
+ *  (three bytes in a row within a record) the index lists the blocks
+ *  holding it; a search only reads the blocks listing every trigram of
+ *  the text, plus the records appended since the last complete block,
+ *  instead of the whole store.
+ */
+
+#ifndef SEARCH_H_
+#define SEARCH_H_
+//-------------------------INCLUDES-------------------------
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "store.h"
+
+//-------------------------DEFINES-------------------------
+#define SEARCH_BLOCK_RECORDS 1024 //records per indexed block, a multiple of REC_INDEX_EVERY
+#define SEARCH_POLL_MS 1000 //how often the indexer looks for complete blocks
+#define SEARCH_TABLE_SLOTS 4096 //trigram slots at first, a power of two
+#define SEARCH_MAX_MATCHES 1000 //records a search returns at most
+#define SEARCH_HEADROOM 64 //bytes left before the matches for a header line
+
+//-------------------------STRUCTS-------------------------
+//blocks holding one trigram, in increasing order
+struct posting {
+	uint32_t key; //trigram + 1, 0 for a free slot
+	uint32_t len; //bytes of data in use
+	uint32_t cap;
+	uint64_t last; //newest block in the list
+	uint8_t* data; //block numbers as varint deltas from the one before
+};
+
+struct search_index {
+	pthread_mutex_t lock; //the table and the blocks indexed
+	pthread_cond_t wake; //stop, for the indexer
+	struct posting* table; //open addressing by trigram
+	size_t slots; //a power of two
+	size_t used;
+	size_t bytes; //posting data in use, for the log
+	uint64_t from; //blocks [from, to) are indexed, by absolute record number / SEARCH_BLOCK_RECORDS
+	uint64_t to;
+	int broken; //1 once out of memory, searches read every block
+	struct store* st;
+	pthread_t indexer;
+	int running;
+	int stop;
+};
+
+//records found by search_run
+struct search_result {
+	char* data; //SEARCH_HEADROOM free bytes, then the records, newlines included
+	size_t len; //bytes of records
+	size_t cap;
+	long count; //records
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* SEARCH_OPEN
+ * Description: starts indexing a store, from the records it holds.
+ *   Until the indexer has caught up, searches read the blocks it
+ *   hasn't got to.
+ * Input:
+ *  sx = index
+ *  st = open store, outliving the index
+ * Output: 0 on success, -1 if the indexer can't be started
+ */
+int search_open(struct search_index* sx, struct store* st);
+
+/* SEARCH_RUN
+ * Description: finds the records containing text, oldest first, up
+ *   to SEARCH_MAX_MATCHES of them. Reads the store without holding up
+ *   appends or the indexer.
+ * Input:
+ *  sx = index
+ *  text, len = bytes to look for, no newline
+ *  r = filled in, r->data to be freed by the caller
+ * Output: 0 on success, -1 if the store's records can't be read
+ */
+int search_run(struct search_index* sx, const char* text, size_t len, struct search_result* r);
+
+/* SEARCH_CLOSE
+ * Description: stops the indexer and frees the index
+ * Input:
+ *  sx = index
+ * Output: N/A
+ */
+void search_close(struct search_index* sx);
+
+#endif /* SEARCH_H_ */
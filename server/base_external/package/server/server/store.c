@@ -0,0 +1,1013 @@
+/* User space store
+ * Description:
+ *  Appends packets to the data file and reads them back for echoes.
+ *  Durability is handled by a committer thread so no writer calls
+ *  fdatasync itself: writers append, note their end offset and wait for
+ *  the committer to report that offset durable. Every writer that arrives
+ *  while a sync is running is covered by the next one, so under load one
+ *  fdatasync acknowledges a whole batch of packets.
+ *
+ *  With segments the store is a series of files PATH.00000001, ...
+ *  listed with their starting offsets in PATH.manifest. Offsets handed
+ *  out by the store are logical: they keep growing across segments, and
+ *  a read only opens the segment that holds its offset. Retention drops
+ *  whole segments from the old end, so cutting history is an unlink
+ *  instead of a rewrite.
+ *
+ *  Sealed segments can be compressed (see lz4.c) in COMPRESS_BLOCK_SIZE
+ *  blocks, written next to the raw file as PATH.00000001.lz4 and swapped
+ *  in for it. Reads decompress only the block holding their offset and
+ *  keep it in a small LRU cache, since echoes read blocks sequentially
+ *  in many short reads.
+ *
+ *  Readers never lock against writers. An append publishes the new
+ *  size of its segment only once the write is complete, so a read sees
+ *  whole packets or none of one. The segment table is a snapshot that
+ *  is never changed in place: rotation, retention and compression build
+ *  a new one and swap it in, and a reader just pins whichever table is
+ *  current. Old tables and dropped segments (whose fds a pinned reader
+ *  may still be using) are freed once no reader is left.
+ *
+ *  Appends also feed the record index (recindex.c) and the time index
+ *  (timeindex.c), kept next to the data in PATH.index and PATH.times,
+ *  which retention trims along with the segments.
+ */
+
+#include "store.h"
+#include "lz4.h"
+#include "trace.h"
+#include "place.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int store_parse_sync(const char* arg, struct store_opts* opts) {
+	char* end = NULL;
+	if(strcmp(arg, "none") == 0) {
+		opts->sync = STORE_SYNC_NONE;
+		opts->sync_arg = 0;
+		return 0;
+	}
+	if(strcmp(arg, "packet") == 0) {
+		opts->sync = STORE_SYNC_PACKET;
+		opts->sync_arg = 0;
+		return 0;
+	}
+	if(strncmp(arg, "ms:", 3) == 0) {
+		opts->sync = STORE_SYNC_INTERVAL;
+		opts->sync_arg = strtol(arg + 3, &end, 10);
+	}
+	else if(strncmp(arg, "bytes:", 6) == 0) {
+		opts->sync = STORE_SYNC_BYTES;
+		opts->sync_arg = strtol(arg + 6, &end, 10);
+	}
+	if(!end || *end != '\0' || opts->sync_arg <= 0) return -1;
+	return 0;
+}
+
+int store_parse_segments(const char* arg, struct store_opts* opts) {
+	char* copy = strdup(arg);
+	if(!copy) return -1;
+	int result = 0;
+	char* save = NULL;
+	for(char* tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char* eq = strchr(tok, '=');
+		if(!eq) {
+			result = -1;
+			break;
+		}
+		*eq = '\0';
+		char* end = NULL;
+		long long val = strtoll(eq + 1, &end, 10);
+		if(*end != '\0' || val < 0) {
+			result = -1;
+			break;
+		}
+		if(strcmp(tok, "size") == 0) opts->seg_size = val;
+		else if(strcmp(tok, "age") == 0) opts->seg_age = val;
+		else if(strcmp(tok, "keep_segs") == 0) opts->ret_segs = val;
+		else if(strcmp(tok, "keep_bytes") == 0) opts->ret_bytes = val;
+		else if(strcmp(tok, "keep_age") == 0) opts->ret_age = val;
+		else if(strcmp(tok, "compress") == 0) opts->compress = val != 0;
+		else {
+			result = -1;
+			break;
+		}
+	}
+	free(copy);
+	return result;
+}
+
+static int segmented(const struct store* st) {
+	return st->opts.seg_size > 0 || st->opts.seg_age > 0;
+}
+
+//the current table, for the thread holding table_lock
+static struct seg_table* current(struct store* st) {
+	return atomic_load(&st->table);
+}
+
+//closes and frees a segment nobody can reach any more
+static void release_segment(struct segment* seg) {
+	close(seg->fd);
+	free(seg->blocks);
+	free(seg);
+}
+
+/* RECLAIM
+ * Description: frees retired tables and segments if no reader is
+ *   pinned. Everything on the lists was unpublished before it got there,
+ *   so a reader pinning from now on can't pick it up. table_lock held.
+ */
+static void reclaim(struct store* st) {
+	if(!atomic_load(&st->retired) || atomic_load(&st->readers) != 0) return;
+	while(st->old_tables) {
+		struct seg_table* t = st->old_tables;
+		st->old_tables = t->retired;
+		free(t);
+	}
+	while(st->old_segs) {
+		struct segment* seg = st->old_segs;
+		st->old_segs = seg->retired;
+		release_segment(seg);
+	}
+	atomic_store(&st->retired, 0);
+}
+
+/* PIN / UNPIN
+ * Description: bracket a reader's use of the current table, which
+ *   stays valid until the unpin. The last reader out frees what was
+ *   retired meanwhile, unless a publisher is busy and will do it.
+ */
+static struct seg_table* pin(struct store* st) {
+	atomic_fetch_add(&st->readers, 1);
+	return atomic_load(&st->table);
+}
+
+static void unpin(struct store* st) {
+	if(atomic_fetch_sub(&st->readers, 1) == 1 && atomic_load(&st->retired) &&
+	  pthread_mutex_trylock(&st->table_lock) == 0) {
+		reclaim(st);
+		pthread_mutex_unlock(&st->table_lock);
+	}
+}
+
+//a table with room for nsegs segments, NULL on error
+static struct seg_table* new_table(int nsegs) {
+	struct seg_table* t = malloc(sizeof *t + nsegs * sizeof t->segs[0]);
+	if(!t) syslog(LOG_ERR, "Failed to allocate segment table\n");
+	else t->nsegs = nsegs;
+	return t;
+}
+
+/* PUBLISH
+ * Description: makes t the current table and retires the old one.
+ *   table_lock held.
+ */
+static void publish(struct store* st, struct seg_table* t) {
+	t->retired = NULL;
+	t->start = t->nsegs ? t->segs[0]->base : 0;
+	struct seg_table* old = atomic_exchange(&st->table, t);
+	if(old) {
+		old->retired = st->old_tables;
+		st->old_tables = old;
+		atomic_store(&st->retired, 1);
+	}
+}
+
+//puts a segment left out of the current table on the retire list
+static void retire_segment(struct store* st, struct segment* seg) {
+	seg->retired = st->old_segs;
+	st->old_segs = seg;
+	atomic_store(&st->retired, 1);
+}
+
+/* SYNC_RANGE
+ * Description: fdatasyncs the segments holding offsets from to to: the
+ *   active one and any sealed since the last sync, which rotation leaves
+ *   to the committer. Compressed ones were synced when written, and
+ *   dropped ones are gone anyway.
+ */
+static int sync_range(struct store* st, off_t from, off_t to) {
+	struct seg_table* t = pin(st);
+	int rc = 0;
+	for(int i = t->nsegs - 1; i >= 0; i--) {
+		struct segment* seg = t->segs[i];
+		if(seg->base >= to) continue; //rotated to after to was taken
+		if(!seg->blocks && fdatasync(seg->fd) != 0) rc = -1;
+		if(seg->base <= from) break;
+	}
+	unpin(st);
+	return rc;
+}
+
+//adds ms to a CLOCK_MONOTONIC time
+static void add_ms(struct timespec* ts, long ms) {
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if(ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int before(const struct timespec* a, const struct timespec* b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* COMMITTER
+ * Description: thread that syncs the data file according to the policy.
+ *   Waits for enough pending data (or time), syncs without holding any
+ *   lock, then publishes the new durable offset to waiting writers.
+ *   On stop it syncs whatever is left before exiting.
+ */
+static void* committer(void* arg) {
+	struct store* st = (struct store*)arg;
+	struct timespec last, now, due;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	TRACE_THREAD("committer", 0);
+	place_thread(PLACE_COMMIT);
+	
+	pthread_mutex_lock(&st->sync_lock);
+	while(1) {
+		off_t pending = st->size - st->durable;
+		if(st->stop && pending == 0) break;
+		if(pending == 0) {
+			pthread_cond_wait(&st->work_cond, &st->sync_lock);
+			//time the interval from the first pending write
+			if(st->size != st->durable) clock_gettime(CLOCK_MONOTONIC, &last);
+			continue;
+		}
+		
+		//anything pending: decide whether it is time to sync
+		if(!st->stop && !st->flush && st->opts.sync != STORE_SYNC_PACKET) {
+			due = last;
+			if(st->opts.sync == STORE_SYNC_INTERVAL)
+				add_ms(&due, st->opts.sync_arg);
+			else
+				add_ms(&due, SYNC_MAX_DELAY_MS);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int full = st->opts.sync == STORE_SYNC_BYTES && pending >= st->opts.sync_arg;
+			if(!full && before(&now, &due)) {
+				pthread_cond_timedwait(&st->work_cond, &st->sync_lock, &due);
+				continue;
+			}
+		}
+		
+		//sync everything appended so far
+		off_t from = st->durable;
+		off_t target = st->size;
+		pthread_mutex_unlock(&st->sync_lock);
+		TRACE_BEGIN(TR_SYNC, 0, target - from);
+		int rc = sync_range(st, from, target);
+		TRACE_END(TR_SYNC, 0, 0);
+		if(rc != 0) syslog(LOG_ERR, "Failed to sync data file:%m\n");
+		clock_gettime(CLOCK_MONOTONIC, &last);
+		pthread_mutex_lock(&st->sync_lock);
+		
+		//a failed sync still releases the writers, it is logged above
+		st->durable = target;
+		pthread_cond_broadcast(&st->durable_cond);
+	}
+	pthread_mutex_unlock(&st->sync_lock);
+	return NULL;
+}
+
+/* RECOVER
+ * Description: cuts a trailing partial record left by a crash
+ *   so the next append starts on a record boundary.
+ * Output: size of the recovered file, -1 on error
+ */
+static off_t recover(int fd) {
+	off_t size = lseek(fd, 0, SEEK_END);
+	if(size <= 0) return size;
+	
+	char buf[512];
+	off_t end = size;
+	while(end > 0) {
+		off_t start = end > (off_t)sizeof buf ? end - (off_t)sizeof buf : 0;
+		ssize_t n = pread(fd, buf, end - start, start);
+		if(n != end - start) {
+			syslog(LOG_ERR, "Failed to read data file for recovery:%m\n");
+			return -1;
+		}
+		for(ssize_t i = n - 1; i >= 0; i--) {
+			if(buf[i] == '\n') {
+				off_t good = start + i + 1;
+				if(good != size) {
+					syslog(LOG_INFO, "Recovered data file, dropped %ld torn bytes\n", (long)(size - good));
+					if(ftruncate(fd, good) != 0) return -1;
+				}
+				return good;
+			}
+		}
+		end = start;
+	}
+	//no complete record at all
+	syslog(LOG_INFO, "Recovered data file, dropped %ld torn bytes\n", (long)size);
+	if(ftruncate(fd, 0) != 0) return -1;
+	return 0;
+}
+
+//file name of a segment, the data file itself when not segmented
+static void segment_path(const struct store* st, unsigned seq, char* buf, size_t len) {
+	if(segmented(st)) snprintf(buf, len, SEGMENT_NAME, st->path, seq);
+	else snprintf(buf, len, "%s", st->path);
+}
+
+/* SYNC_DIR
+ * Description: syncs the directory holding the store, so files created
+ *   or renamed in it are still there after a power loss
+ * Output: 0 on success, -1 on error (logged)
+ */
+static int sync_dir(const struct store* st) {
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof dir, "%s", st->path);
+	char* slash = strrchr(dir, '/');
+	if(!slash) snprintf(dir, sizeof dir, ".");
+	else if(slash == dir) dir[1] = '\0';
+	else *slash = '\0';
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int rc = fd == -1 ? -1 : fsync(fd);
+	if(rc != 0) syslog(LOG_ERR, "Failed to sync directory %s:%m\n", dir);
+	if(fd != -1) close(fd);
+	return rc;
+}
+
+/* WRITE_MANIFEST
+ * Description: rewrites the manifest to match the segment table,
+ *   via a temporary file and rename so a crash leaves the old or the new
+ *   one, with the directory synced after under a sync policy
+ */
+static int write_manifest(struct store* st) {
+	if(!segmented(st)) return 0;
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	snprintf(path, sizeof path, MANIFEST_NAME, st->path);
+	snprintf(tmp, sizeof tmp, "%s.new", path);
+	
+	FILE* f = fopen(tmp, "w");
+	if(!f) {
+		syslog(LOG_ERR, "Failed to write manifest:%m\n");
+		return -1;
+	}
+	struct seg_table* t = current(st);
+	for(int i = 0; i < t->nsegs; i++)
+		fprintf(f, "%u %lld\n", t->segs[i]->seq, (long long)t->segs[i]->base);
+	int rc = fflush(f);
+	if(rc == 0 && st->opts.sync != STORE_SYNC_NONE) rc = fdatasync(fileno(f));
+	if(fclose(f) != 0) rc = -1;
+	if(rc == 0) rc = rename(tmp, path);
+	if(rc != 0) {
+		syslog(LOG_ERR, "Failed to write manifest:%m\n");
+		unlink(tmp);
+		return rc;
+	}
+	if(st->opts.sync != STORE_SYNC_NONE) rc = sync_dir(st);
+	return rc;
+}
+
+/* LOAD_COMPRESSED
+ * Description: reads the header and block table of a compressed segment
+ * Output: 0 on success, -1 if fd is not a compressed segment
+ */
+static int load_compressed(struct segment* seg, int fd) {
+	struct segment_header h;
+	if(pread(fd, &h, sizeof h, 0) != sizeof h ||
+	  memcmp(h.magic, SEGMENT_MAGIC, sizeof h.magic) != 0 ||
+	  h.block_size != COMPRESS_BLOCK_SIZE)
+		return -1;
+	
+	size_t tlen = h.nblocks * sizeof(struct block_ref);
+	seg->blocks = malloc(tlen ? tlen : 1);
+	if(!seg->blocks) return -1;
+	if(pread(fd, seg->blocks, tlen, sizeof h) != (ssize_t)tlen) {
+		free(seg->blocks);
+		seg->blocks = NULL;
+		return -1;
+	}
+	seg->nblocks = h.nblocks;
+	seg->size = h.raw_size;
+	return 0;
+}
+
+/* ADD_SEGMENT
+ * Description: opens segment seq starting at base and publishes it as
+ *   the new active one, preferring its compressed file when there is one.
+ *   table_lock held.
+ * Output: 0 on success, -1 on error
+ */
+static int add_segment(struct store* st, unsigned seq, off_t base) {
+	struct seg_table* old = current(st);
+	int n = old ? old->nsegs : 0;
+	struct seg_table* t = new_table(n + 1);
+	struct segment* seg = calloc(1, sizeof *seg);
+	if(!t || !seg) {
+		syslog(LOG_ERR, "Failed to grow segment table\n");
+		free(t);
+		free(seg);
+		return -1;
+	}
+	
+	char path[PATH_MAX];
+	seg->seq = seq;
+	seg->base = base;
+	seg->fd = -1;
+	if(segmented(st)) {
+		snprintf(path, sizeof path, COMPRESSED_NAME, st->path, seq);
+		int cfd = open(path, O_RDONLY | O_CLOEXEC);
+		if(cfd != -1) {
+			struct stat sb;
+			if(fstat(cfd, &sb) == 0 && load_compressed(seg, cfd) == 0) {
+				seg->fd = cfd;
+				seg->created = seg->written = sb.st_mtime;
+				//a crash after the rename can leave the raw file behind
+				segment_path(st, seq, path, sizeof path);
+				unlink(path);
+			}
+			else {
+				syslog(LOG_ERR, "Ignoring bad compressed segment %s\n", path);
+				close(cfd);
+			}
+		}
+	}
+	
+	if(seg->fd == -1) {
+		segment_path(st, seq, path, sizeof path);
+		seg->fd = open(path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 00666);
+		struct stat sb;
+		if(seg->fd == -1 || fstat(seg->fd, &sb) != 0) {
+			syslog(LOG_ERR, "ERROR opening file %s:%m\n", path);
+			if(seg->fd != -1) close(seg->fd);
+			free(seg);
+			free(t);
+			return -1;
+		}
+		seg->size = sb.st_size;
+		seg->created = time(NULL);
+		seg->written = sb.st_size ? sb.st_mtime : seg->created;
+		//an empty file may just have been created, its records are only
+		//durable once its directory entry is
+		if(!sb.st_size && st->opts.sync != STORE_SYNC_NONE && sync_dir(st) != 0) {
+			close(seg->fd);
+			free(seg);
+			free(t);
+			return -1;
+		}
+	}
+	
+	if(n) memcpy(t->segs, old->segs, n * sizeof t->segs[0]);
+	t->segs[n] = seg;
+	publish(st, t);
+	st->active = seg;
+	return 0;
+}
+
+/* DROP_OLDEST
+ * Description: deletes the oldest segment and retires it, readers
+ *   still on it keep its fd until they are done. table_lock held.
+ * Output: 0 on success, -1 on error
+ */
+static int drop_oldest(struct store* st) {
+	struct seg_table* old = current(st);
+	struct seg_table* t = new_table(old->nsegs - 1);
+	if(!t) return -1;
+	memcpy(t->segs, old->segs + 1, t->nsegs * sizeof t->segs[0]);
+	
+	struct segment* seg = old->segs[0];
+	char path[PATH_MAX];
+	if(seg->blocks)
+		snprintf(path, sizeof path, COMPRESSED_NAME, st->path, seg->seq);
+	else
+		segment_path(st, seg->seq, path, sizeof path);
+	time_index_trim(&st->times, rec_index_trim(&st->index, t->segs[0]->base)); //still readable
+	unlink(path);
+	syslog(LOG_DEBUG, "Dropped segment %u\n", seg->seq);
+	publish(st, t);
+	retire_segment(st, seg);
+	return 0;
+}
+
+/* APPLY_RETENTION
+ * Description: drops old segments past any retention limit,
+ *   never the active one. Append lock and table_lock held.
+ * Output: 1 if something was dropped
+ */
+static int apply_retention(struct store* st, time_t now) {
+	int dropped = 0;
+	struct seg_table* t;
+	while((t = current(st))->nsegs > 1) {
+		struct segment* old = t->segs[0];
+		off_t kept = st->active->base + st->active->size - old->base;
+		if(((st->opts.ret_segs && t->nsegs > st->opts.ret_segs) ||
+		  (st->opts.ret_bytes && kept > st->opts.ret_bytes) ||
+		  (st->opts.ret_age && now - old->written > st->opts.ret_age)) &&
+		  drop_oldest(st) == 0)
+			dropped = 1;
+		else break;
+	}
+	return dropped;
+}
+
+/* ROTATE
+ * Description: seals the active segment and starts a new one,
+ *   then applies retention. Called with the append lock held. The
+ *   sealed segment's tail is synced by the committer, which covers
+ *   every segment up to the offset it reports durable.
+ */
+static int rotate(struct store* st) {
+	pthread_mutex_lock(&st->table_lock);
+	struct segment* seal = st->active;
+	int rc = add_segment(st, seal->seq + 1, seal->base + seal->size);
+	if(rc == 0) {
+		syslog(LOG_DEBUG, "Rotated to segment %u\n", st->active->seq);
+		apply_retention(st, time(NULL));
+		rc = write_manifest(st);
+	}
+	reclaim(st);
+	pthread_mutex_unlock(&st->table_lock);
+	return rc;
+}
+
+/* LOAD_MANIFEST
+ * Description: reopens the segments listed in the manifest, if any
+ * Output: 0 on success (including no manifest), -1 on error
+ */
+static int load_manifest(struct store* st) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof path, MANIFEST_NAME, st->path);
+	FILE* f = fopen(path, "r");
+	if(!f) return 0; //new store
+	
+	unsigned seq;
+	long long base;
+	int result = 0;
+	while(fscanf(f, "%u %lld", &seq, &base) == 2) {
+		if(add_segment(st, seq, base) != 0) {
+			result = -1;
+			break;
+		}
+	}
+	fclose(f);
+	return result;
+}
+
+//reads the store for its record index
+static ssize_t index_read(void* arg, char* buf, size_t len, off_t off) {
+	return store_read(arg, buf, len, off);
+}
+
+int store_open(struct store* st, const char* path, const struct store_opts* opts) {
+	memset(st, 0, sizeof *st);
+	st->opts = *opts;
+	st->path = strdup(path);
+	if(!st->path) return -1;
+	pthread_mutex_init(&st->table_lock, NULL);
+	
+	//reopen what is there, or start with a first empty segment
+	int rc = segmented(st) ? load_manifest(st) : 0;
+	if(rc == 0 && !current(st)) {
+		rc = add_segment(st, 1, 0);
+		if(rc == 0) rc = write_manifest(st);
+	}
+	reclaim(st); //the tables built along the way
+	if(rc != 0) goto fail;
+	
+	struct segment* seg = st->active;
+	if(opts->keep) {
+		seg->size = recover(seg->fd);
+		if(seg->size == -1) goto fail;
+	}
+	st->size = seg->base + seg->size;
+	st->durable = st->size;
+	
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_mutex_init(&st->cache.lock, NULL);
+	pthread_mutex_init(&st->sync_lock, NULL);
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&st->work_cond, &ca);
+	pthread_condattr_destroy(&ca);
+	pthread_cond_init(&st->durable_cond, NULL);
+	
+	if(opts->sync != STORE_SYNC_NONE) {
+		int rc = pthread_create(&st->committer, NULL, committer, st);
+		if(rc != 0) {
+			syslog(LOG_ERR, "Failed to create committer thread.\n");
+			goto fail;
+		}
+		st->committer_running = 1;
+	}
+	char ipath[PATH_MAX];
+	snprintf(ipath, sizeof ipath, INDEX_NAME, st->path);
+	rec_index_open(&st->index, ipath, store_start(st), st->size, index_read, st);
+	snprintf(ipath, sizeof ipath, TIMES_NAME, st->path);
+	time_index_open(&st->times, ipath, st->index.first, st->index.total);
+	return 0;
+	
+fail:
+	if(current(st)) {
+		struct seg_table* t = current(st);
+		for(int i = 0; i < t->nsegs; i++) release_segment(t->segs[i]);
+		free(t);
+	}
+	pthread_mutex_destroy(&st->table_lock);
+	free(st->path);
+	return -1;
+}
+
+off_t store_write(struct store* st, const char* data, size_t len) {
+	if(len == 0) return store_size(st);
+	
+	TRACE_BEGIN(TR_LOCK, 0, 0);
+	int result = pthread_mutex_lock(&st->lock);
+	TRACE_END(TR_LOCK, 0, 0);
+	if(result != 0) { //failure
+		syslog(LOG_ERR, "ERROR mutex lock:%d\n", result);
+		return -1;
+	}
+	
+	//only appends change the active segment, so no table lock for the write
+	struct segment* seg = st->active;
+	TRACE_BEGIN(TR_WRITE, 0, 0);
+	ssize_t rc = write(seg->fd, data, len);
+	TRACE_END(TR_WRITE, 0, rc > 0 ? rc : 0);
+	
+	//publish the new size while appends are still ordered, readers
+	//clamp to it so they see the packet whole or not at all
+	off_t end = -1;
+	if(rc > 0) {
+		atomic_fetch_add_explicit(&seg->size, rc, memory_order_release);
+		seg->written = time(NULL);
+		uint64_t first;
+		if(rec_index_add(&st->index, data, rc, &first) > 0) time_index_add(&st->times, first);
+		
+		pthread_mutex_lock(&st->sync_lock);
+		st->size += rc;
+		end = st->size;
+		if(st->committer_running) pthread_cond_signal(&st->work_cond);
+		pthread_mutex_unlock(&st->sync_lock);
+		for(int i = 0; i < st->hooks; i++) st->appended[i](st->hook_arg[i], data, rc, end);
+		
+		//the next packet starts a new segment once this one is full
+		if(st->opts.seg_size && seg->size >= st->opts.seg_size)
+			rotate(st);
+	}
+	
+	result = pthread_mutex_unlock(&st->lock);
+	if(result != 0) { //failure
+		syslog(LOG_ERR, "ERROR mutex unlock:%d\n", result);
+	}
+	
+	if(rc == -1) { //failure to write!
+		syslog(LOG_ERR, "Failed to file write:%m\n");
+		return -1;
+	}
+	if((size_t)rc != len) {
+		syslog(LOG_ERR, "failed to write full message\n");
+		return -1;
+	}
+	return end;
+}
+
+int store_add_hook(struct store* st, store_hook_t fn, void* arg) {
+	if(st->hooks == STORE_HOOKS) {
+		syslog(LOG_ERR, "No room for another store hook\n");
+		return -1;
+	}
+	st->appended[st->hooks] = fn;
+	st->hook_arg[st->hooks++] = arg;
+	return 0;
+}
+
+void store_remove_hook(struct store* st, store_hook_t fn, void* arg) {
+	for(int i = 0; i < st->hooks; i++) {
+		if(st->appended[i] != fn || st->hook_arg[i] != arg) continue;
+		st->hooks--;
+		memmove(st->appended + i, st->appended + i + 1, (st->hooks - i) * sizeof *st->appended);
+		memmove(st->hook_arg + i, st->hook_arg + i + 1, (st->hooks - i) * sizeof *st->hook_arg);
+		return;
+	}
+}
+
+void store_wait_durable(struct store* st, off_t end) {
+	if(!st->committer_running) return;
+	pthread_mutex_lock(&st->sync_lock);
+	while(st->durable < end)
+		pthread_cond_wait(&st->durable_cond, &st->sync_lock);
+	pthread_mutex_unlock(&st->sync_lock);
+}
+
+/* COMPRESS_SEGMENT
+ * Description: writes a sealed segment out as a compressed file and
+ *   swaps it in for the raw one. Runs without the append lock: the
+ *   segment no longer changes, and reading through our own dup of its
+ *   fd stays safe even if retention drops it meanwhile.
+ * Input:
+ *  st = store
+ *  seq = segment number
+ *  raw_fd = dup of the segment's fd, closed here
+ *  raw_size = size of the segment
+ * Output: 0 on success, -1 on error
+ */
+static int compress_segment(struct store* st, unsigned seq, int raw_fd, off_t raw_size) {
+	int result = -1;
+	uint32_t nblocks = (raw_size + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE;
+	struct block_ref* blocks = calloc(nblocks ? nblocks : 1, sizeof *blocks);
+	char* raw = malloc(COMPRESS_BLOCK_SIZE);
+	char* comp = malloc(LZ4_BOUND(COMPRESS_BLOCK_SIZE));
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	snprintf(path, sizeof path, COMPRESSED_NAME, st->path, seq);
+	snprintf(tmp, sizeof tmp, "%s.new", path);
+	int cfd = -1;
+	if(!blocks || !raw || !comp) goto out;
+	
+	cfd = open(tmp, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 00666);
+	if(cfd == -1) {
+		syslog(LOG_ERR, "Failed to create %s:%m\n", tmp);
+		goto out;
+	}
+	
+	//blocks go after the header and table, which are written last
+	off_t out = sizeof(struct segment_header) + nblocks * sizeof(struct block_ref);
+	for(uint32_t b = 0; b < nblocks; b++) {
+		off_t in = (off_t)b * COMPRESS_BLOCK_SIZE;
+		size_t want = raw_size - in < COMPRESS_BLOCK_SIZE ? raw_size - in : COMPRESS_BLOCK_SIZE;
+		if(pread(raw_fd, raw, want, in) != (ssize_t)want) goto out;
+		
+		const char* data = comp;
+		int clen = lz4_compress(raw, want, comp, LZ4_BOUND(COMPRESS_BLOCK_SIZE));
+		if(clen < 0 || (size_t)clen >= want) { //store incompressible blocks as is
+			data = raw;
+			clen = want;
+		}
+		if(pwrite(cfd, data, clen, out) != clen) goto out;
+		blocks[b].off = out;
+		blocks[b].len = clen;
+		blocks[b].raw_len = want;
+		out += clen;
+	}
+	
+	struct segment_header h;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, SEGMENT_MAGIC, sizeof h.magic);
+	h.block_size = COMPRESS_BLOCK_SIZE;
+	h.nblocks = nblocks;
+	h.raw_size = raw_size;
+	size_t tlen = nblocks * sizeof *blocks;
+	if(pwrite(cfd, &h, sizeof h, 0) != sizeof h ||
+	  pwrite(cfd, blocks, tlen, sizeof h) != (ssize_t)tlen) goto out;
+	
+	//the raw copy is deleted next, so this one has to be on disk first
+	if(fdatasync(cfd) != 0 || rename(tmp, path) != 0 || sync_dir(st) != 0) goto out;
+	syslog(LOG_DEBUG, "Compressed segment %u: %lld -> %lld bytes\n", seq, (long long)raw_size, (long long)out);
+	
+	//swap in a compressed copy of the segment, the raw one is retired
+	pthread_mutex_lock(&st->table_lock);
+	struct seg_table* old = current(st);
+	int at = -1;
+	for(int i = 0; i < old->nsegs; i++)
+		if(old->segs[i]->seq == seq) at = i;
+	tmp[0] = '\0';
+	if(at == -1 || old->segs[at]->blocks) { //dropped by retention meanwhile
+		unlink(path);
+		result = 0;
+	}
+	else {
+		struct segment* seg = malloc(sizeof *seg);
+		struct seg_table* t = new_table(old->nsegs);
+		if(seg && t) {
+			*seg = *old->segs[at];
+			seg->fd = cfd;
+			seg->blocks = blocks;
+			seg->nblocks = nblocks;
+			cfd = -1;
+			blocks = NULL;
+			memcpy(t->segs, old->segs, t->nsegs * sizeof t->segs[0]);
+			t->segs[at] = seg;
+			retire_segment(st, old->segs[at]);
+			publish(st, t);
+			char rpath[PATH_MAX];
+			segment_path(st, seq, rpath, sizeof rpath);
+			unlink(rpath);
+			result = 0;
+		}
+		else {
+			free(seg);
+			free(t);
+			unlink(path);
+		}
+	}
+	reclaim(st);
+	pthread_mutex_unlock(&st->table_lock);
+	
+out:
+	if(result != 0) syslog(LOG_ERR, "Failed to compress segment %u:%m\n", seq);
+	if(cfd != -1) close(cfd);
+	if(tmp[0]) unlink(tmp);
+	close(raw_fd);
+	free(blocks);
+	free(raw);
+	free(comp);
+	return result;
+}
+
+/* READ_COMPRESSED
+ * Description: reads from a compressed segment through the block cache,
+ *   stopping at the end of the block. Table pinned.
+ * Output: bytes read, -1 on error
+ */
+static ssize_t read_compressed(struct store* st, struct segment* seg, char* buf, size_t len, off_t rel) {
+	struct block_cache* c = &st->cache;
+	uint32_t b = rel / COMPRESS_BLOCK_SIZE;
+	size_t in = rel % COMPRESS_BLOCK_SIZE;
+	
+	pthread_mutex_lock(&c->lock);
+	int hit = -1, victim = 0;
+	for(int i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+		if(c->slot[i].seq == seg->seq && c->slot[i].block == b) {
+			hit = i;
+			break;
+		}
+		if(c->slot[i].used < c->slot[victim].used) victim = i;
+	}
+	
+	if(hit == -1) { //miss: decompress into the least recently used slot
+		struct block_ref* br = &seg->blocks[b];
+		if(!c->scratch) c->scratch = malloc(LZ4_BOUND(COMPRESS_BLOCK_SIZE));
+		if(!c->slot[victim].data) c->slot[victim].data = malloc(COMPRESS_BLOCK_SIZE);
+		char* dst = c->slot[victim].data;
+		c->slot[victim].seq = 0; //empty until filled
+		
+		ssize_t n = -1;
+		if(dst && c->scratch && br->len <= LZ4_BOUND(COMPRESS_BLOCK_SIZE)) {
+			if(br->len == br->raw_len)
+				n = pread(seg->fd, dst, br->len, br->off);
+			else if(pread(seg->fd, c->scratch, br->len, br->off) == br->len)
+				n = lz4_decompress(c->scratch, br->len, dst, COMPRESS_BLOCK_SIZE);
+		}
+		if(n != br->raw_len) {
+			pthread_mutex_unlock(&c->lock);
+			syslog(LOG_ERR, "Failed to read block %u of segment %u\n", b, seg->seq);
+			return -1;
+		}
+		c->slot[victim].seq = seg->seq;
+		c->slot[victim].block = b;
+		c->slot[victim].len = n;
+		hit = victim;
+	}
+	
+	c->slot[hit].used = ++c->tick;
+	if(len > c->slot[hit].len - in) len = c->slot[hit].len - in;
+	memcpy(buf, c->slot[hit].data + in, len);
+	pthread_mutex_unlock(&c->lock);
+	return len;
+}
+
+ssize_t store_read(struct store* st, char* buf, size_t len, off_t off) {
+	struct seg_table* t = pin(st);
+	if(off < t->start) {
+		unpin(st);
+		syslog(LOG_ERR, "Read at %lld, before the oldest kept segment\n", (long long)off);
+		return -1;
+	}
+	
+	//binary search for the last segment starting at or before off
+	int lo = 0, hi = t->nsegs - 1;
+	while(lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if(t->segs[mid]->base <= off) lo = mid;
+		else hi = mid - 1;
+	}
+	struct segment* seg = t->segs[lo];
+	off_t size = atomic_load_explicit(&seg->size, memory_order_acquire);
+	ssize_t rc = 0;
+	off_t rel = off - seg->base;
+	if(rel < size) {
+		if((off_t)len > size - rel) len = size - rel;
+		if(seg->blocks) rc = read_compressed(st, seg, buf, len, rel);
+		else rc = pread(seg->fd, buf, len, rel);
+	}
+	unpin(st);
+	return rc;
+}
+
+off_t store_start(struct store* st) {
+	off_t start = pin(st)->start;
+	unpin(st);
+	return start;
+}
+
+off_t store_size(struct store* st) {
+	return atomic_load(&st->size);
+}
+
+int store_records(struct store* st, long a, long b, struct rec_span* s) {
+	return rec_index_span(&st->index, a, b, s);
+}
+
+int store_records_at(struct store* st, uint64_t a, uint64_t b, struct rec_span* s) {
+	return rec_index_span_at(&st->index, a, b, s);
+}
+
+int store_records_between(struct store* st, int64_t from_ms, int64_t to_ms, struct rec_span* s) {
+	uint64_t a = time_index_find(&st->times, from_ms);
+	uint64_t b = time_index_find(&st->times, to_ms);
+	return rec_index_span_at(&st->index, a, b, s);
+}
+
+void store_maintain(struct store* st) {
+	if(!segmented(st)) return;
+	time_t now = time(NULL);
+	
+	pthread_mutex_lock(&st->lock);
+	struct segment* seg = st->active;
+	if(st->opts.seg_age && seg->size && now - seg->created >= st->opts.seg_age)
+		rotate(st);
+	else {
+		pthread_mutex_lock(&st->table_lock);
+		if(apply_retention(st, now)) write_manifest(st);
+		reclaim(st);
+		pthread_mutex_unlock(&st->table_lock);
+	}
+	pthread_mutex_unlock(&st->lock);
+	
+	//compress sealed segments, oldest first
+	while(st->opts.compress) {
+		unsigned seq = 0;
+		int fd = -1;
+		off_t size = 0;
+		struct seg_table* t = pin(st);
+		for(int i = 0; i < t->nsegs - 1; i++) {
+			if(!t->segs[i]->blocks) {
+				seq = t->segs[i]->seq;
+				size = t->segs[i]->size;
+				fd = dup(t->segs[i]->fd);
+				break;
+			}
+		}
+		unpin(st);
+		if(fd == -1 || compress_segment(st, seq, fd, size) != 0) break;
+	}
+}
+
+void store_flush(struct store* st) {
+	if(!st->committer_running) return;
+	pthread_mutex_lock(&st->sync_lock);
+	st->flush = 1;
+	pthread_cond_signal(&st->work_cond);
+	pthread_mutex_unlock(&st->sync_lock);
+}
+
+void store_close(struct store* st, int remove) {
+	if(st->committer_running) {
+		pthread_mutex_lock(&st->sync_lock);
+		st->stop = 1;
+		pthread_cond_signal(&st->work_cond);
+		pthread_mutex_unlock(&st->sync_lock);
+		pthread_join(st->committer, NULL);
+		st->committer_running = 0;
+	}
+	//no reader is left by now
+	reclaim(st);
+	char path[PATH_MAX];
+	struct seg_table* t = current(st);
+	for(int i = 0; i < t->nsegs; i++) {
+		if(remove) { //remove file
+			if(t->segs[i]->blocks)
+				snprintf(path, sizeof path, COMPRESSED_NAME, st->path, t->segs[i]->seq);
+			else
+				segment_path(st, t->segs[i]->seq, path, sizeof path);
+			unlink(path);
+		}
+		release_segment(t->segs[i]);
+	}
+	if(remove && segmented(st)) {
+		snprintf(path, sizeof path, MANIFEST_NAME, st->path);
+		unlink(path);
+	}
+	free(t);
+	st->table = NULL;
+	st->active = NULL;
+	
+	pthread_cond_destroy(&st->work_cond);
+	pthread_cond_destroy(&st->durable_cond);
+	pthread_mutex_destroy(&st->sync_lock);
+	for(int i = 0; i < BLOCK_CACHE_SLOTS; i++) free(st->cache.slot[i].data);
+	free(st->cache.scratch);
+	pthread_mutex_destroy(&st->cache.lock);
+	rec_index_close(&st->index, remove);
+	time_index_close(&st->times, remove);
+	pthread_mutex_destroy(&st->table_lock);
+	pthread_mutex_destroy(&st->lock);
+	free(st->path);
+	st->path = NULL;
+}
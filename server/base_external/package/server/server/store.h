@@ -0,0 +1,310 @@
+/*
+ * store.h
+ *
+ *  User space backend: the data file behind FILENAME when the
+ *  aesd char device is not used, with its sync policy and
+ *  optional split into rotated segments, which can be compressed
+ *  once sealed, and the indexes of its records and their write times.
+ */
+
+#ifndef STORE_H_
+#define STORE_H_
+//-------------------------INCLUDES-------------------------
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "recindex.h"
+#include "timeindex.h"
+
+//-------------------------DEFINES-------------------------
+#define SYNC_MAX_DELAY_MS 1000 //longest a write waits under the bytes policy
+#define SEGMENT_NAME "%s.%08u" //data file path, segment number
+#define MANIFEST_NAME "%s.manifest" //data file path
+#define COMPRESSED_NAME "%s.%08u.lz4" //data file path, segment number
+#define INDEX_NAME "%s.index" //data file path, see recindex.h
+#define TIMES_NAME "%s.times" //data file path, see timeindex.h
+#define COMPRESS_BLOCK_SIZE 65536 //sealed segments are compressed in blocks of this
+#define BLOCK_CACHE_SLOTS 8 //decompressed blocks kept for reads
+#define STORE_HOOKS 4 //append hooks a store takes
+#define SEGMENT_MAGIC "AZ4S"
+
+//-------------------------STRUCTS-------------------------
+//told each append, its bytes and the new end of the store, under the append lock
+typedef void (*store_hook_t)(void* arg, const char* data, size_t len, off_t end);
+
+//when appended data is made durable
+enum store_sync {
+	STORE_SYNC_NONE = 0, //leave it to the page cache
+	STORE_SYNC_PACKET,   //before every echo (concurrent writers share a sync)
+	STORE_SYNC_INTERVAL, //every sync_arg ms
+	STORE_SYNC_BYTES     //every sync_arg bytes, or SYNC_MAX_DELAY_MS at the latest
+};
+
+struct store_opts {
+	enum store_sync sync;
+	long sync_arg; //ms or bytes depending on sync
+	int keep; //1 to keep the file on close and recover it on open
+	//segments, all 0 (off) keeps everything in the one file
+	off_t seg_size; //rotate once the active segment reaches this size
+	long seg_age; //or once it is this many seconds old
+	int ret_segs; //keep at most this many segments
+	off_t ret_bytes; //or this many bytes
+	long ret_age; //or segments written to in the last ret_age seconds
+	int compress; //1 to LZ4 compress segments once sealed
+};
+
+//where one compressed block of a sealed segment lives
+struct block_ref {
+	uint64_t off; //in the compressed file
+	uint32_t len; //compressed, equal to raw_len if stored as is
+	uint32_t raw_len;
+};
+
+//on disk header of a compressed segment, the block table follows it
+struct segment_header {
+	char magic[4];
+	uint32_t block_size;
+	uint32_t nblocks;
+	uint32_t pad;
+	uint64_t raw_size;
+};
+
+//one file of the store, holding logical offsets [base, base + size)
+struct segment {
+	unsigned seq;
+	int fd;
+	off_t base;
+	_Atomic off_t size; //only grows once an append is complete
+	time_t created;
+	time_t written; //time of the last append
+	struct block_ref* blocks; //compressed segments only, NULL otherwise
+	uint32_t nblocks;
+	struct segment* retired; //next on the retire list
+};
+
+//snapshot of the segment table, oldest first, the last one takes appends.
+//Never changed once published: rotation, retention and compression
+//publish a new one and retire the old.
+struct seg_table {
+	struct seg_table* retired; //next on the retire list
+	off_t start; //logical offset of the oldest byte still kept
+	int nsegs;
+	struct segment* segs[];
+};
+
+//recently decompressed blocks, shared by all readers
+struct block_cache {
+	pthread_mutex_t lock;
+	unsigned long tick;
+	struct {
+		unsigned seq; //segment, 0 for an empty slot
+		uint32_t block;
+		uint32_t len;
+		unsigned long used;
+		char* data;
+	} slot[BLOCK_CACHE_SLOTS];
+	char* scratch; //compressed block being read
+};
+
+struct store {
+	char* path;
+	struct store_opts opts;
+	pthread_mutex_t lock; //serializes appends
+	struct segment* active; //the one taking appends, changed under lock
+	
+	//readers pin the current table through readers and never lock,
+	//table_lock only orders the threads publishing new tables.
+	//Retired tables and segments (with their fds) are freed once
+	//readers is seen at 0, as nobody can pick them up any more.
+	pthread_mutex_t table_lock;
+	_Atomic(struct seg_table*) table;
+	atomic_int readers;
+	atomic_int retired; //1 while something waits on the lists
+	struct seg_table* old_tables;
+	struct segment* old_segs;
+	struct block_cache cache;
+	struct rec_index index; //appended to under lock, like the data
+	struct time_index times; //likewise
+	store_hook_t appended[STORE_HOOKS]; //added before appends start
+	void* hook_arg[STORE_HOOKS];
+	int hooks;
+	
+	//durability, all under sync_lock
+	pthread_mutex_t sync_lock;
+	pthread_cond_t work_cond; //wakes the committer
+	pthread_cond_t durable_cond; //wakes writers waiting on a sync
+	_Atomic off_t size; //bytes appended so far, read without the lock too
+	off_t durable; //bytes known to be on disk
+	int stop;
+	int flush; //sync pending data right away from now on
+	int committer_running;
+	pthread_t committer;
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* STORE_PARSE_SYNC
+ * Description: parses a sync policy: none, packet, ms:N or bytes:N
+ * Input:
+ *  arg = policy string
+ *  opts = sync and sync_arg are filled in
+ * Output: 0 on success, -1 if arg is not a policy
+ */
+int store_parse_sync(const char* arg, struct store_opts* opts);
+
+/* STORE_PARSE_SEGMENTS
+ * Description: parses segment settings, a comma separated list of
+ *   size=BYTES, age=SECS (rotation),
+ *   keep_segs=N, keep_bytes=BYTES, keep_age=SECS (retention) and
+ *   compress=0|1 (sealed segments)
+ * Input:
+ *  arg = settings string
+ *  opts = segment fields are filled in
+ * Output: 0 on success, -1 on a bad setting
+ */
+int store_parse_segments(const char* arg, struct store_opts* opts);
+
+/* STORE_OPEN
+ * Description: opens (creating if needed) the data file and starts
+ *   the committer thread for any sync policy other than none.
+ *   With segments, path is the prefix of the segment files and the
+ *   segments listed in its manifest are reopened.
+ *   With opts->keep an existing file is recovered: a record torn by
+ *   a crash (no trailing newline) is cut off.
+ *   The record index (INDEX_NAME) picks up where it was left, or is
+ *   rebuilt from the data if it doesn't match. The time index
+ *   (TIMES_NAME) can't be rebuilt: records older than it have no time.
+ * Input:
+ *  st = store to set up
+ *  path = data file
+ *  opts = options, copied
+ * Output: 0 on success, -1 on error
+ */
+int store_open(struct store* st, const char* path, const struct store_opts* opts);
+
+/* STORE_WRITE
+ * Description: appends data to the store, rotating to a new
+ *   segment afterwards if the active one is full.
+ *   A packet never spans two segments.
+ * Input:
+ *  st = store
+ *  data, len = bytes to append
+ * Output: offset just past the data, -1 on error
+ */
+off_t store_write(struct store* st, const char* data, size_t len);
+
+/* STORE_ADD_HOOK
+ * Description: has fn called after every append, with nothing held
+ *   but the append lock, so it must be quick. Added before any append.
+ * Input:
+ *  st = store
+ *  fn, arg = hook
+ * Output: 0 on success, -1 if there are STORE_HOOKS already
+ */
+int store_add_hook(struct store* st, store_hook_t fn, void* arg);
+
+/* STORE_REMOVE_HOOK
+ * Description: stops calling a hook, once appends have stopped
+ * Input:
+ *  st = store
+ *  fn, arg = hook as added
+ * Output: N/A
+ */
+void store_remove_hook(struct store* st, store_hook_t fn, void* arg);
+
+/* STORE_WAIT_DURABLE
+ * Description: blocks until everything up to end is durable
+ *   under the store's sync policy; returns at once for none.
+ * Input:
+ *  st = store
+ *  end = offset returned by store_write
+ * Output: N/A
+ */
+void store_wait_durable(struct store* st, off_t end);
+
+/* STORE_READ
+ * Description: reads from the store at a logical offset, touching
+ *   only the segment holding it (so reads stop at segment ends).
+ *   Never waits on appends and only sees complete ones.
+ * Input:
+ *  st = store
+ *  buf, len = destination
+ *  off = offset to read from, at least store_start()
+ * Output: bytes read, 0 at the end, -1 on error
+ *   (including an offset whose segment was dropped)
+ */
+ssize_t store_read(struct store* st, char* buf, size_t len, off_t off);
+
+/* STORE_START / STORE_SIZE
+ * Description: logical offset of the oldest kept byte / of the end
+ * Input: st = store
+ * Output: the offset
+ */
+off_t store_start(struct store* st);
+off_t store_size(struct store* st);
+
+/* STORE_RECORDS
+ * Description: finds records [a, b) from the record index,
+ *   clamped to the complete records kept (see rec_index_span)
+ * Input:
+ *  st = store
+ *  a, b = record numbers, 0 is the oldest kept, a negative a counts
+ *    back from the newest
+ *  s = filled in with the records found and their bytes
+ * Output: 0 on success, -1 if the index is unavailable
+ */
+int store_records(struct store* st, long a, long b, struct rec_span* s);
+
+/* STORE_RECORDS_AT
+ * Description: store_records by absolute record numbers
+ *   (see rec_index_span_at), for readers keeping their place in the
+ *   store across retention
+ * Input:
+ *  st = store
+ *  a, b = absolute record numbers
+ *  s = filled in, s->base + s->count ends the records there are
+ * Output: 0 on success, -1 if the index is unavailable
+ */
+int store_records_at(struct store* st, uint64_t a, uint64_t b, struct rec_span* s);
+
+/* STORE_RECORDS_BETWEEN
+ * Description: finds the records written in [from_ms, to_ms) from the
+ *   time index (to within TIME_INDEX_RES_MS)
+ * Input:
+ *  st = store
+ *  from_ms, to_ms = CLOCK_REALTIME in ms
+ *  s = filled in with the records found and their bytes
+ * Output: 0 on success, -1 if the record index is unavailable
+ */
+int store_records_between(struct store* st, int64_t from_ms, int64_t to_ms, struct rec_span* s);
+
+/* STORE_MAINTAIN
+ * Description: applies time based rotation and retention and
+ *   compresses sealed segments when enabled, called periodically
+ *   from main (size based rotation happens on append)
+ * Input: st = store
+ * Output: N/A
+ */
+void store_maintain(struct store* st);
+
+/* STORE_FLUSH
+ * Description: makes the committer sync pending data at once and keep
+ *   doing so, used on shutdown so draining writers aren't held back
+ *   by the policy's interval.
+ * Input: st = store
+ * Output: N/A
+ */
+void store_flush(struct store* st);
+
+/* STORE_CLOSE
+ * Description: syncs anything still pending, stops the committer and
+ *   closes the file.
+ * Input:
+ *  st = store
+ *  remove = 1 to unlink the file as well
+ * Output: N/A
+ */
+void store_close(struct store* st, int remove);
+
+#endif /* STORE_H_ */
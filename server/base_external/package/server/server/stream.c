@@ -0,0 +1,151 @@
+/* Streams
+ * Description:
+ *  Streams are only added, at the end of the list and under the lock,
+ *  and only freed at shutdown, so a connection keeps a plain pointer
+ *  to its stream, and stream_each walks the list without holding the
+ *  lock while it works on each store (a maintenance pass can take a
+ *  while). Opening one (recovering its store, starting its
+ *  threads) happens under the lock too, which only holds up other
+ *  connections naming a stream for the first time.
+ */
+
+#include "stream.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+//letters, digits, '_' and '-', so it makes a file name
+static int valid_name(const char* name, size_t len) {
+	if(len > STREAM_NAME_MAX) return 0;
+	for(size_t i = 0; i < len; i++) {
+		char c = name[i];
+		if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-'))
+			return 0;
+	}
+	return 1;
+}
+
+//stops a stream's storage stage once its queue is empty
+static void stop_stage(struct stream* s) {
+	if(!s->storer_running) return;
+	pkt_queue_close(&s->q);
+	pthread_join(s->storer, NULL);
+	pkt_queue_destroy(&s->q);
+	s->storer_running = 0;
+}
+
+//stops a stream's storage stage and closes its store
+static void close_stream(struct stream* s, int remove) {
+	stop_stage(s);
+	if(s->store_ok) {
+		search_close(&s->search);
+		store_close(&s->st, remove);
+		s->store_ok = 0;
+	}
+}
+
+/* OPEN_STREAM
+ * Description: opens a stream's store, search index and storage stage.
+ *   lock held.
+ * Output: the stream, NULL on error
+ */
+static struct stream* open_stream(struct stream_table* t, const char* name, size_t len) {
+	struct stream* s = calloc(1, sizeof *s);
+	if(!s) {
+		syslog(LOG_ERR, "Failed to allocate stream.\n");
+		return NULL;
+	}
+	memcpy(s->name, name, len);
+	if(t->file) {
+		char path[PATH_MAX];
+		if(len) snprintf(path, sizeof path, STREAM_PATH, t->path, s->name);
+		else snprintf(path, sizeof path, "%s", t->path);
+		if(store_open(&s->st, path, &t->opts) != 0) {
+			free(s);
+			return NULL;
+		}
+		s->store_ok = 1;
+		//searches read every record if the indexer doesn't start
+		search_open(&s->search, &s->st);
+	}
+	if(pkt_queue_init(&s->q, PIPE_STORE_DEPTH, t->stats) != 0) {
+		close_stream(s, 0);
+		free(s);
+		return NULL;
+	}
+	if(pthread_create(&s->storer, NULL, t->stage, s) != 0) {
+		syslog(LOG_ERR, "Failed to start storage stage.\n");
+		pkt_queue_destroy(&s->q);
+		close_stream(s, 0);
+		free(s);
+		return NULL;
+	}
+	s->storer_running = 1;
+	if(t->last) t->last->next = s;
+	else t->first = s;
+	t->last = s;
+	if(len) syslog(LOG_INFO, "Opened stream %s\n", s->name);
+	return s;
+}
+
+int stream_table_open(struct stream_table* t, const char* path, const struct store_opts* opts,
+  void* (*stage)(void*), struct stage_stats* stats) {
+	memset(t, 0, sizeof *t);
+	pthread_mutex_init(&t->lock, NULL);
+	t->path = path;
+	if(opts) {
+		t->opts = *opts;
+		t->file = 1;
+	}
+	t->stage = stage;
+	t->stats = stats;
+	return open_stream(t, "", 0) ? 0 : -1;
+}
+
+struct stream* stream_default(struct stream_table* t) {
+	return t->first;
+}
+
+struct stream* stream_get(struct stream_table* t, const char* name, size_t len) {
+	if(len == 0) return t->first;
+	if(!t->file || !valid_name(name, len)) return NULL;
+	pthread_mutex_lock(&t->lock);
+	struct stream* s = t->first;
+	while(s && (strlen(s->name) != len || memcmp(s->name, name, len) != 0)) s = s->next;
+	if(!s && t->count < STREAM_MAX) {
+		s = open_stream(t, name, len);
+		if(s) t->count++;
+	}
+	else if(!s) syslog(LOG_ERR, "ERROR: %d streams at most.\n", STREAM_MAX);
+	pthread_mutex_unlock(&t->lock);
+	return s;
+}
+
+void stream_each(struct stream_table* t, void (*fn)(struct store*)) {
+	//the streams up to last are linked for good, the lock is only
+	//needed to see them all
+	pthread_mutex_lock(&t->lock);
+	struct stream* s = t->first;
+	struct stream* last = t->last;
+	pthread_mutex_unlock(&t->lock);
+	for(; s; s = s == last ? NULL : s->next)
+		if(s->store_ok) fn(&s->st);
+}
+
+void stream_table_stop(struct stream_table* t) {
+	for(struct stream* s = t->first; s; s = s->next) stop_stage(s);
+}
+
+void stream_table_close(struct stream_table* t, int remove) {
+	while(t->first) {
+		struct stream* s = t->first;
+		t->first = s->next;
+		close_stream(s, remove);
+		free(s);
+	}
+	t->last = NULL;
+	pthread_mutex_destroy(&t->lock);
+}
@@ -0,0 +1,118 @@
+/*
+ * stream.h
+ *
+ *  Named streams: "AESD_STREAM:name\n" moves a connection's packets
+ *  from then on (and its echoes and queries) to the stream of that
+ *  name, answered with "AESD_STREAM:name\n" or ":error". "AESD_STREAM\n"
+ *  moves it back to the default stream, the one every connection
+ *  starts on. A stream is opened the first time it is named and lives
+ *  until shutdown.
+ *
+ *  Every stream has a store of its own (FILENAME-name, with the same
+ *  sync and segment options), so its own append lock, committer,
+ *  record and time indexes, a search index, and its own storage stage
+ *  thread and queue: producers on different streams never wait on one
+ *  another. Named streams need the file backend. Replication, live
+ *  tails and the timestamps only cover the default stream: with -R or
+ *  -F a named stream is refused, and so is "AESD_SUBSCRIBE" from a
+ *  connection on one.
+ */
+
+#ifndef STREAM_H_
+#define STREAM_H_
+//-------------------------INCLUDES-------------------------
+#include <pthread.h>
+#include "pipeline.h"
+#include "search.h"
+#include "store.h"
+
+//-------------------------DEFINES-------------------------
+#define STREAM_CMD "AESD_STREAM"
+#define STREAM_CMD_L 11
+#define STREAM_NAME_MAX 32 //letters, digits, '_' and '-'
+#define STREAM_MAX 16 //named streams at most
+#define STREAM_PATH "%s-%s" //default stream's path, name
+
+//-------------------------STRUCTS-------------------------
+struct stream {
+	char name[STREAM_NAME_MAX + 1]; //"" for the default stream
+	struct store st; //unused with the char device
+	struct search_index search;
+	struct pkt_queue q; //packets waiting for its storage stage
+	pthread_t storer;
+	int store_ok;
+	int storer_running;
+	struct stream* next;
+};
+
+struct stream_table {
+	pthread_mutex_t lock; //opening streams and the list
+	struct stream* first; //the default stream, then the named ones oldest first
+	struct stream* last;
+	int count;
+	const char* path; //the default stream's store
+	struct store_opts opts;
+	int file; //1 with the file backend
+	void* (*stage)(void*); //storage stage, passed its stream
+	struct stage_stats* stats; //the storage stage's, shared by the queues
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* STREAM_TABLE_OPEN
+ * Description: opens the default stream and starts its storage stage
+ * Input:
+ *  t = streams
+ *  path = the default stream's store
+ *  opts = store options for every stream, NULL with the char device
+ *  stage = storage stage thread, passed the stream
+ *  stats = storage stage metrics
+ * Output: 0 on success, -1 on error (then stream_table_close it)
+ */
+int stream_table_open(struct stream_table* t, const char* path, const struct store_opts* opts,
+  void* (*stage)(void*), struct stage_stats* stats);
+
+/* STREAM_DEFAULT
+ * Description: the stream connections start on
+ * Input: t = streams
+ * Output: the default stream
+ */
+struct stream* stream_default(struct stream_table* t);
+
+/* STREAM_GET
+ * Description: finds a stream by name, opening it the first time
+ * Input:
+ *  t = streams
+ *  name, len = stream name, empty for the default stream
+ * Output: the stream, NULL if the name is malformed or it can't be opened
+ */
+struct stream* stream_get(struct stream_table* t, const char* name, size_t len);
+
+/* STREAM_EACH
+ * Description: calls fn on the store of every stream open when it was
+ *   called, streams can still be opened meanwhile. Nothing with the
+ *   char device.
+ * Input:
+ *  t = streams
+ *  fn = called with each store
+ * Output: N/A
+ */
+void stream_each(struct stream_table* t, void (*fn)(struct store*));
+
+/* STREAM_TABLE_STOP
+ * Description: stops the storage stages once their queues are empty,
+ *   when no connection is left to push to them
+ * Input: t = streams
+ * Output: N/A
+ */
+void stream_table_stop(struct stream_table* t);
+
+/* STREAM_TABLE_CLOSE
+ * Description: closes the streams' stores and search indexes
+ * Input:
+ *  t = streams, stopped
+ *  remove = 1 to delete the stores' files
+ * Output: N/A
+ */
+void stream_table_close(struct stream_table* t, int remove);
+
+#endif /* STREAM_H_ */
@@ -0,0 +1,169 @@
+/* Time index
+ * Description:
+ *  The entries live in memory for the binary searches; the sidecar is
+ *  only appended to, an entry per slice, and read back on open. An
+ *  append cut short by a crash leaves a partial entry at the end,
+ *  which open drops by rewriting the sidecar from the entries it
+ *  could read, the same way as it drops the entries of records a
+ *  recovered store no longer has.
+ *
+ *  A wall clock stepping back would leave the entries out of order,
+ *  so a write time is never taken as less than the last one: records
+ *  written until the clock catches up share that time.
+ */
+
+#include "timeindex.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TIME_INDEX_GROW 1024 //entries kept room for at first
+
+/* REWRITE
+ * Description: writes the sidecar over with the entries in memory, via
+ *   a new file and a rename like the manifest. lock held.
+ * Output: 0 on success, -1 on error (the old sidecar stays)
+ */
+static int rewrite(struct time_index* tx) {
+	char tmp[PATH_MAX + 4];
+	snprintf(tmp, sizeof tmp, "%s.new", tx->path);
+	struct time_index_header h;
+	memcpy(h.magic, TIME_INDEX_MAGIC, sizeof h.magic);
+	h.res_ms = TIME_INDEX_RES_MS;
+	ssize_t len = tx->count * sizeof(struct time_entry);
+	int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND | O_CLOEXEC, 00666);
+	if(fd == -1 || write(fd, &h, sizeof h) != sizeof h || (len && write(fd, tx->e, len) != len) ||
+	  rename(tmp, tx->path) != 0) {
+		syslog(LOG_ERR, "Failed to rewrite time index:%m\n");
+		if(fd != -1) close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	if(tx->fd != -1) close(tx->fd);
+	tx->fd = fd;
+	tx->dropped = 0;
+	return 0;
+}
+
+//drops the entries of records before first, lock held
+static void drop_entries(struct time_index* tx, uint64_t first) {
+	size_t i = 0;
+	while(i + 1 < tx->count && tx->e[i + 1].record <= first) i++;
+	if(i == 0) return;
+	memmove(tx->e, tx->e + i, (tx->count - i) * sizeof *tx->e);
+	tx->count -= i;
+	tx->dropped += i;
+}
+
+void time_index_open(struct time_index* tx, const char* path, uint64_t first, uint64_t total) {
+	memset(tx, 0, sizeof *tx);
+	pthread_mutex_init(&tx->lock, NULL);
+	tx->path = strdup(path);
+	tx->fd = tx->path ? open(path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 00666) : -1;
+	if(tx->fd == -1) {
+		syslog(LOG_ERR, "Failed to open time index %s:%m\n", path);
+		return;
+	}
+
+	//whatever is readable, if it was written the way we write it
+	struct stat sb;
+	struct time_index_header h;
+	int ok = fstat(tx->fd, &sb) == 0 && pread(tx->fd, &h, sizeof h, 0) == sizeof h &&
+	  memcmp(h.magic, TIME_INDEX_MAGIC, sizeof h.magic) == 0 && h.res_ms == TIME_INDEX_RES_MS;
+	size_t n = ok ? (sb.st_size - sizeof h) / sizeof(struct time_entry) : 0;
+	int clean = ok && sizeof h + n * sizeof(struct time_entry) == (size_t)sb.st_size;
+	tx->cap = n > TIME_INDEX_GROW ? n : TIME_INDEX_GROW;
+	tx->e = malloc(tx->cap * sizeof *tx->e);
+	if(!tx->e || (n && pread(tx->fd, tx->e, n * sizeof *tx->e, sizeof h) != (ssize_t)(n * sizeof *tx->e))) {
+		n = 0;
+		clean = 0;
+	}
+
+	//in order, and of records the store still has
+	while(tx->count < n && tx->e[tx->count].record < total && (tx->count == 0 ||
+	  (tx->e[tx->count].record > tx->e[tx->count - 1].record && tx->e[tx->count].wall_ms >= tx->e[tx->count - 1].wall_ms)))
+		tx->count++;
+	if(tx->count < n) clean = 0;
+	drop_entries(tx, first);
+	if(!clean && rewrite(tx) != 0) {
+		close(tx->fd); //don't append to something we can't read back
+		tx->fd = -1;
+	}
+}
+
+void time_index_add(struct time_index* tx, uint64_t record) {
+	struct timespec w, m;
+	clock_gettime(CLOCK_REALTIME, &w);
+	clock_gettime(CLOCK_MONOTONIC, &m);
+	struct time_entry entry = { record, w.tv_sec * 1000LL + w.tv_nsec / 1000000, m.tv_sec * 1000LL + m.tv_nsec / 1000000 };
+
+	pthread_mutex_lock(&tx->lock);
+	if(tx->count > 0) {
+		struct time_entry* last = &tx->e[tx->count - 1];
+		if(entry.wall_ms < last->wall_ms) entry.wall_ms = last->wall_ms; //the clock went back
+		if(entry.wall_ms / TIME_INDEX_RES_MS == last->wall_ms / TIME_INDEX_RES_MS || record <= last->record) {
+			pthread_mutex_unlock(&tx->lock);
+			return;
+		}
+	}
+	if(tx->count == tx->cap) {
+		size_t cap = tx->cap ? tx->cap * 2 : TIME_INDEX_GROW;
+		struct time_entry* e = realloc(tx->e, cap * sizeof *e);
+		if(!e) {
+			if(!tx->failed) syslog(LOG_ERR, "Time index out of memory, records take earlier times\n");
+			tx->failed = 1;
+			pthread_mutex_unlock(&tx->lock);
+			return;
+		}
+		tx->e = e;
+		tx->cap = cap;
+	}
+	tx->e[tx->count++] = entry;
+	if(tx->fd != -1 && write(tx->fd, &entry, sizeof entry) != sizeof entry) {
+		syslog(LOG_ERR, "Failed to write time index, keeping it in memory:%m\n");
+		close(tx->fd); //the next open drops a partial entry
+		tx->fd = -1;
+	}
+	pthread_mutex_unlock(&tx->lock);
+}
+
+void time_index_trim(struct time_index* tx, uint64_t first) {
+	pthread_mutex_lock(&tx->lock);
+	drop_entries(tx, first);
+	if(tx->fd != -1 && tx->dropped >= TIME_INDEX_COMPACT && tx->dropped >= tx->count) rewrite(tx);
+	pthread_mutex_unlock(&tx->lock);
+}
+
+uint64_t time_index_find(struct time_index* tx, int64_t wall_ms) {
+	pthread_mutex_lock(&tx->lock);
+	size_t lo = 0, hi = tx->count;
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if(tx->e[mid].wall_ms < wall_ms) lo = mid + 1;
+		else hi = mid;
+	}
+	uint64_t record;
+	if(lo == 0 && wall_ms <= 0) record = 0; //records from before the index too
+	else if(lo == tx->count) record = UINT64_MAX;
+	else record = tx->e[lo].record;
+	pthread_mutex_unlock(&tx->lock);
+	return record;
+}
+
+void time_index_close(struct time_index* tx, int remove) {
+	if(tx->fd != -1) close(tx->fd);
+	tx->fd = -1;
+	if(remove && tx->path) unlink(tx->path);
+	free(tx->path);
+	tx->path = NULL;
+	free(tx->e);
+	tx->e = NULL;
+	pthread_mutex_destroy(&tx->lock);
+}
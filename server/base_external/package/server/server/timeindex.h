@@ -0,0 +1,104 @@
+/*
+ * timeindex.h
+ *
+ *  Time index of the user space store: when its records were written,
+ *  to within TIME_INDEX_RES_MS. Rather than a time per record, it has
+ *  an entry for every slice of TIME_INDEX_RES_MS (by the wall clock)
+ *  in which records were written, naming the first of them, so it
+ *  grows with the time the store was written in and not with its
+ *  records. A time range is two binary searches, and reading it then
+ *  costs what the records in it do.
+ *
+ *  Sidecar layout, host byte order, appended to:
+ *   struct time_index_header
+ *   then struct time_entry after struct time_entry, oldest first
+ *  Records older than the first entry (written before there was a
+ *  sidecar) count as written at time 0.
+ */
+
+#ifndef TIMEINDEX_H_
+#define TIMEINDEX_H_
+//-------------------------INCLUDES-------------------------
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//-------------------------DEFINES-------------------------
+#define TIME_INDEX_MAGIC "AZTI"
+#define TIME_INDEX_RES_MS 100 //write times are kept to within this, dividing 1000
+#define TIME_INDEX_COMPACT 4096 //dropped entries worth rewriting the sidecar for
+
+//-------------------------STRUCTS-------------------------
+struct time_index_header {
+	char magic[4];
+	uint32_t res_ms; //TIME_INDEX_RES_MS it was written with
+};
+
+struct time_entry {
+	uint64_t record; //absolute number of the first record written in the slice
+	int64_t wall_ms; //when, CLOCK_REALTIME, never less than the entry before
+	int64_t mono_ms; //when, CLOCK_MONOTONIC, for intervals within one boot
+};
+
+struct time_index {
+	pthread_mutex_t lock;
+	char* path; //sidecar
+	int fd; //-1 if it couldn't be opened, the index is then kept in memory only
+	struct time_entry* e; //the entries still needed, oldest first
+	size_t count;
+	size_t cap;
+	size_t dropped; //entries before e[0] still in the sidecar
+	int failed; //1 once an entry was lost, logged once
+};
+
+//-------------------------FUNCTIONS-------------------------
+/* TIME_INDEX_OPEN
+ * Description: loads the sidecar of a store, keeping the entries that
+ *   match the records it holds
+ * Input:
+ *  tx = index
+ *  path = sidecar file
+ *  first, total = absolute numbers of the oldest record kept and of
+ *    the next one to be written
+ * Output: N/A
+ */
+void time_index_open(struct time_index* tx, const char* path, uint64_t first, uint64_t total);
+
+/* TIME_INDEX_ADD
+ * Description: records that records were just written, called in the
+ *   order they were appended. Adds an entry when the slice changed.
+ * Input:
+ *  tx = index
+ *  record = absolute number of the first of them
+ * Output: N/A
+ */
+void time_index_add(struct time_index* tx, uint64_t record);
+
+/* TIME_INDEX_TRIM
+ * Description: forgets the entries of records retention dropped
+ * Input:
+ *  tx = index
+ *  first = absolute number of the oldest record kept
+ * Output: N/A
+ */
+void time_index_trim(struct time_index* tx, uint64_t first);
+
+/* TIME_INDEX_FIND
+ * Description: finds the first record written at or after a time
+ * Input:
+ *  tx = index
+ *  wall_ms = CLOCK_REALTIME in ms
+ * Output: its absolute number, UINT64_MAX if none was written since
+ */
+uint64_t time_index_find(struct time_index* tx, int64_t wall_ms);
+
+/* TIME_INDEX_CLOSE
+ * Description: closes the sidecar and frees the index
+ * Input:
+ *  tx = index
+ *  remove = 1 to delete the sidecar, along with the store
+ * Output: N/A
+ */
+void time_index_close(struct time_index* tx, int remove);
+
+#endif /* TIMEINDEX_H_ */
@@ -0,0 +1,224 @@
+/* Tracer
+ * Description:
+ *  Each thread gets a ring the first time it records an event; a
+ *  pthread key gives the ring back when the thread exits, for the next
+ *  thread to reuse. The owner writes an event and then publishes it by
+ *  advancing head. The dump copies a ring without stopping its owner and
+ *  checks head again afterwards: events the owner may have overwritten
+ *  during the copy are dropped, like a seqlock reader would retry.
+ */
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef AESD_TRACE
+#include <stdatomic.h>
+#include <stdlib.h>
+
+struct trace_rec {
+	uint64_t ts; //CLOCK_MONOTONIC ns
+	uint32_t conn;
+	uint32_t bytes;
+	uint8_t ev;
+	char ph;
+};
+
+struct trace_ring {
+	_Atomic uint64_t head; //events ever recorded, the next goes at head % size
+	int tid; //thread number in the dump, new for every owner
+	int idle; //1 once its thread exited
+	pthread_t thread;
+	char name[32];
+	struct trace_rec rec[TRACE_RING_EVENTS];
+};
+
+static const char* trace_names[TR_EVENTS] = {
+	"accept", "recv", "frame", "lock_wait", "write", "sync", "store_batch", "echo", "send"
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring* rings[TRACE_MAX_THREADS];
+static int nrings;
+static int next_tid = 1;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread struct trace_ring* my_ring;
+static __thread int no_ring; //1 if every ring was taken
+
+//thread exit: the ring keeps its events until someone reuses it
+static void ring_release(void* arg) {
+	struct trace_ring* r = arg;
+	pthread_mutex_lock(&rings_lock);
+	r->idle = 1;
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void make_key(void) {
+	pthread_key_create(&ring_key, ring_release);
+}
+
+//takes an idle ring or a new one for the calling thread
+static struct trace_ring* ring_attach(void) {
+	pthread_once(&key_once, make_key);
+	pthread_mutex_lock(&rings_lock);
+	struct trace_ring* r = NULL;
+	for(int i = 0; i < nrings && !r; i++)
+		if(rings[i]->idle) r = rings[i];
+	if(!r && nrings < TRACE_MAX_THREADS) {
+		r = calloc(1, sizeof *r);
+		if(r) rings[nrings++] = r;
+	}
+	if(r) {
+		atomic_store(&r->head, 0);
+		r->idle = 0;
+		r->tid = next_tid++;
+		r->thread = pthread_self();
+		snprintf(r->name, sizeof r->name, "thread");
+	}
+	pthread_mutex_unlock(&rings_lock);
+
+	if(r) pthread_setspecific(ring_key, r);
+	else no_ring = 1;
+	return r;
+}
+
+void trace_event(enum trace_event ev, char ph, uint32_t conn, uint32_t bytes) {
+	struct trace_ring* r = my_ring;
+	if(!r) {
+		if(no_ring || !(r = my_ring = ring_attach())) return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	struct trace_rec* e = &r->rec[h & (TRACE_RING_EVENTS - 1)];
+	e->ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	e->conn = conn;
+	e->bytes = bytes;
+	e->ev = ev;
+	e->ph = ph;
+	atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+void trace_thread(const char* name, uint32_t num) {
+	struct trace_ring* r = my_ring;
+	if(!r && (no_ring || !(r = my_ring = ring_attach()))) return;
+	pthread_mutex_lock(&rings_lock);
+	if(num) snprintf(r->name, sizeof r->name, "%s %u", name, num);
+	else snprintf(r->name, sizeof r->name, "%s", name);
+	pthread_mutex_unlock(&rings_lock);
+}
+
+//JSON being built, handed to the writer a chunk at a time
+struct dump_buf {
+	char data[TRACE_DUMP_CHUNK];
+	size_t len;
+	trace_writer_t out;
+	void* arg;
+	int failed;
+};
+
+static void put(struct dump_buf* b, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void put(struct dump_buf* b, const char* fmt, ...) {
+	if(b->failed) return;
+	if(b->len > TRACE_DUMP_CHUNK - 256) { //every entry fits in what is left
+		if(b->out(b->arg, b->data, b->len) != 0) b->failed = 1;
+		b->len = 0;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	b->len += vsnprintf(b->data + b->len, TRACE_DUMP_CHUNK - b->len, fmt, ap);
+	va_end(ap);
+}
+
+int trace_dump(trace_writer_t out, void* arg) {
+	struct dump_buf* b = malloc(sizeof *b);
+	struct trace_rec* copy = malloc(TRACE_RING_EVENTS * sizeof *copy);
+	if(!b || !copy) {
+		free(b);
+		free(copy);
+		return -1;
+	}
+	b->len = 0;
+	b->out = out;
+	b->arg = arg;
+	b->failed = 0;
+
+	put(b, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	const char* sep = "";
+	for(int i = 0; ; i++) {
+		//copy one ring under the lock, it is written out after: the
+		//writer can block on a client that doesn't read, and new
+		//threads need the lock for their first trace point
+		pthread_mutex_lock(&rings_lock);
+		if(i >= nrings) {
+			pthread_mutex_unlock(&rings_lock);
+			break;
+		}
+		struct trace_ring* r = rings[i];
+		int tid = r->tid;
+		char name[sizeof r->name];
+		memcpy(name, r->name, sizeof name);
+
+		//a live thread's CPU time so far goes in its name
+		double cpu_ms = -1;
+		clockid_t cid;
+		struct timespec ts;
+		if(!r->idle && pthread_getcpuclockid(r->thread, &cid) == 0 && clock_gettime(cid, &ts) == 0)
+			cpu_ms = ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+
+		//copy what the ring holds, then drop what got overwritten meanwhile
+		uint64_t h1 = atomic_load_explicit(&r->head, memory_order_acquire);
+		uint64_t from = h1 > TRACE_RING_EVENTS ? h1 - TRACE_RING_EVENTS : 0;
+		for(uint64_t k = from; k < h1; k++)
+			copy[k - from] = r->rec[k & (TRACE_RING_EVENTS - 1)];
+		atomic_thread_fence(memory_order_acquire);
+		uint64_t h2 = atomic_load_explicit(&r->head, memory_order_relaxed);
+		uint64_t valid = h2 >= TRACE_RING_EVENTS ? h2 - TRACE_RING_EVENTS + 1 : 0;
+		pthread_mutex_unlock(&rings_lock);
+
+		if(cpu_ms >= 0)
+			put(b, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s cpu=%.1fms\"}}",
+			  sep, tid, name, cpu_ms);
+		else
+			put(b, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			  sep, tid, name);
+		sep = ",\n";
+
+		for(uint64_t k = from > valid ? from : valid; k < h1; k++) {
+			struct trace_rec* e = &copy[k - from];
+			if(e->ev >= TR_EVENTS) continue;
+			put(b, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%d",
+			  trace_names[e->ev], e->ph, (unsigned long long)(e->ts / 1000), (unsigned)(e->ts % 1000), tid);
+			if(e->ph == 'b' || e->ph == 'e') put(b, ",\"cat\":\"packet\",\"id\":%u", e->conn);
+			if(e->ph == 'i') put(b, ",\"s\":\"t\"");
+			put(b, ",\"args\":{\"conn\":%u,\"bytes\":%u}}", e->conn, e->bytes);
+		}
+	}
+	put(b, "\n]}\n");
+
+	if(!b->failed && b->len && out(arg, b->data, b->len) != 0) b->failed = 1;
+	int result = b->failed ? -1 : 0;
+	free(copy);
+	free(b);
+	return result;
+}
+
+#else //tracer compiled out
+
+void trace_event(enum trace_event ev, char ph, uint32_t conn, uint32_t bytes) {
+}
+
+void trace_thread(const char* name, uint32_t num) {
+}
+
+int trace_dump(trace_writer_t out, void* arg) {
+	const char* empty = "{\"traceEvents\":[]}\n";
+	return out(arg, empty, strlen(empty));
+}
+
+#endif
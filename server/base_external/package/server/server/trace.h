@@ -0,0 +1,92 @@
+/*
+ * trace.h
+ *
+ *  Built-in tracer for per-packet timelines, compiled in with
+ *  make TRACE=1 (-DAESD_TRACE) and free otherwise: the TRACE_ macros
+ *  expand to nothing. Every thread records into a ring of its own,
+ *  so a trace point is a clock read and a few stores, with no lock
+ *  and no syscall. The "AESD_TRACE\n" command dumps every ring as
+ *  Chrome trace-event JSON (chrome://tracing, Perfetto), with each
+ *  thread's CPU time in its name.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+//-------------------------INCLUDES-------------------------
+#include <stddef.h>
+#include <stdint.h>
+
+//-------------------------DEFINES-------------------------
+#define TRACE_RING_EVENTS 16384 //events kept per thread, a power of two
+#define TRACE_MAX_THREADS 128 //rings; threads past this aren't traced
+#define TRACE_DUMP_CHUNK 65536 //JSON bytes handed to the writer at a time
+
+//what a trace point records, see trace_names in trace.c
+enum trace_event {
+	TR_ACCEPT,  //connection started (main)
+	TR_RECV,    //recv on a client socket, bytes received
+	TR_FRAME,   //packet framed, its bytes
+	TR_LOCK,    //waiting for the append lock
+	TR_WRITE,   //append to the store or driver, bytes written
+	TR_SYNC,    //fdatasync by the committer
+	TR_STORE,   //a storage stage batch, bytes = packets
+	TR_ECHO,    //echo of one packet, from the reply scheduler (async)
+	TR_SEND,    //send of echo bytes
+	TR_EVENTS
+};
+
+#ifdef AESD_TRACE
+#define TRACE_BEGIN(ev, conn, bytes) trace_event(ev, 'B', conn, bytes)
+#define TRACE_END(ev, conn, bytes) trace_event(ev, 'E', conn, bytes)
+#define TRACE_MARK(ev, conn, bytes) trace_event(ev, 'i', conn, bytes)
+//spans that interleave on one thread, matched up by connection
+#define TRACE_ASYNC_BEGIN(ev, conn) trace_event(ev, 'b', conn, 0)
+#define TRACE_ASYNC_END(ev, conn) trace_event(ev, 'e', conn, 0)
+#define TRACE_THREAD(name, num) trace_thread(name, num)
+#else
+#define TRACE_BEGIN(ev, conn, bytes) ((void)0)
+#define TRACE_END(ev, conn, bytes) ((void)0)
+#define TRACE_MARK(ev, conn, bytes) ((void)0)
+#define TRACE_ASYNC_BEGIN(ev, conn) ((void)0)
+#define TRACE_ASYNC_END(ev, conn) ((void)0)
+#define TRACE_THREAD(name, num) ((void)0)
+#endif
+
+//takes JSON from trace_dump, returns 0 or -1 to stop the dump
+typedef int (*trace_writer_t)(void* arg, const char* data, size_t len);
+
+//-------------------------FUNCTIONS-------------------------
+/* TRACE_EVENT
+ * Description: records an event in the calling thread's ring,
+ *   overwriting the oldest once it is full. Use the TRACE_ macros.
+ * Input:
+ *  ev = what happened
+ *  ph = Chrome phase: B/E span, i instant, b/e async span
+ *  conn = connection number, 0 if none
+ *  bytes = size involved, 0 if none
+ * Output: N/A
+ */
+void trace_event(enum trace_event ev, char ph, uint32_t conn, uint32_t bytes);
+
+/* TRACE_THREAD
+ * Description: names the calling thread in the dump
+ * Input:
+ *  name = short name
+ *  num = appended to the name unless 0 (a connection number)
+ * Output: N/A
+ */
+void trace_thread(const char* name, uint32_t num);
+
+/* TRACE_DUMP
+ * Description: writes every ring out as Chrome trace-event JSON,
+ *   an empty trace when the tracer isn't compiled in. The threads
+ *   keep tracing meanwhile, events overwritten during the copy are
+ *   left out.
+ * Input:
+ *  out = called with each piece of JSON
+ *  arg = passed to out
+ * Output: 0 on success, -1 if out failed
+ */
+int trace_dump(trace_writer_t out, void* arg);
+
+#endif /* TRACE_H_ */